@@ -0,0 +1,110 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/*
+ * CPU feature detection, in the spirit of freebl's blinit.c.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "blinit.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__x86_64))
+#include <cpuid.h>
+#define BLAPI_X86 1
+#endif
+
+static int avx2_support_ = 0;
+static int avx512_support_ = 0;
+static int sha_support_ = 0;
+
+static pthread_once_t cpu_features_once = PTHREAD_ONCE_INIT;
+
+#ifdef BLAPI_X86
+/* cpuid(1).ecx */
+#define ECX_SSSE3   (1 << 9)
+#define ECX_SSE4_1  (1 << 19)
+#define ECX_OSXSAVE (1 << 27)
+#define ECX_AVX     (1 << 28)
+/* cpuid(7,0).ebx */
+#define EBX_AVX2    (1 << 5)
+#define EBX_AVX512F (1 << 16)
+#define EBX_SHA     (1 << 29)
+/* xcr0 */
+#define XCR0_SSE_AVX    0x06  /* xmm and ymm state */
+#define XCR0_AVX512     0xe6  /* also opmask and zmm state */
+
+static unsigned long long
+xgetbv0(void)
+{
+    unsigned int eax, edx;
+    __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+}
+
+static void
+check_cpu_features(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int ecx1, ebx7;
+    unsigned long long xcr0 = 0;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+    ecx1 = ecx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+    ebx7 = ebx;
+
+    /* AVX registers are only usable if the OS saves them */
+    if (ecx1 & ECX_OSXSAVE) {
+        xcr0 = xgetbv0();
+    }
+    if ((ecx1 & ECX_AVX) && (xcr0 & XCR0_SSE_AVX) == XCR0_SSE_AVX) {
+        avx2_support_ = (ebx7 & EBX_AVX2) != 0;
+        avx512_support_ = (ebx7 & EBX_AVX512F) != 0 &&
+                          (xcr0 & XCR0_AVX512) == XCR0_AVX512;
+    }
+    sha_support_ = (ebx7 & EBX_SHA) && (ecx1 & ECX_SSSE3) &&
+                   (ecx1 & ECX_SSE4_1);
+}
+#else
+static void
+check_cpu_features(void)
+{
+}
+#endif
+
+int
+avx2_support(void)
+{
+    pthread_once(&cpu_features_once, check_cpu_features);
+    return avx2_support_;
+}
+
+int
+avx512_support(void)
+{
+    pthread_once(&cpu_features_once, check_cpu_features);
+    return avx512_support_;
+}
+
+int
+sha_support(void)
+{
+    pthread_once(&cpu_features_once, check_cpu_features);
+    return sha_support_;
+}
+
+const char *
+blapi_forced_backend(const char *var)
+{
+    const char *backend = getenv(var);
+    if (backend && *backend == '\0') {
+        return NULL;
+    }
+    return backend;
+}
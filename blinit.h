@@ -0,0 +1,24 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _BLINIT_H_
+#define _BLINIT_H_
+
+/*
+ * CPU feature detection shared by the hash implementations. cpuid is run
+ * once, the first time any of these is called. Each returns non-zero if the
+ * feature is there and the OS saves the registers it needs.
+ */
+extern int avx2_support(void);
+extern int avx512_support(void);
+extern int sha_support(void);
+
+/*
+ * Returns the backend forced with the environment variable var (for
+ * instance NSS_SHA3_BACKEND=scalar), or NULL if it isn't set. It is up to
+ * the caller to ignore a backend the CPU can't run.
+ */
+extern const char *blapi_forced_backend(const char *var);
+
+#endif /* _BLINIT_H_ */
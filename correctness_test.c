@@ -1,6 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "sha3.h"
+#include "hmac.h"
 #include "test_vectors.h"
 
 // These are the test vectors we will use to check correctess
@@ -13,6 +16,8 @@ const char *d384 = "1881de2ca7e41ef95dc4732b8f5f002b189cc1e42b74168ed1732649ce1d
 const char *d512 = "e76dfad22084a8b1467fcf2ffa58361bec7628edf5f3fdc0e4805dc48caeeca8"
                    "1b7c13c30adf52a3659584739a2df46be589c51ca1a4a8416df6545a1ce8ba00";
 
+static int failures;
+
 void hexcmp(const char* tv, uint8_t *digest, size_t digestLen) {
   size_t hexlen = 2*digestLen;
   char *hex = (char*) malloc(hexlen+1);
@@ -23,38 +28,1535 @@ void hexcmp(const char* tv, uint8_t *digest, size_t digestLen) {
 
   if (strncmp(tv, hex, hexlen) != 0) {
     printf("[%lu] FAIL\n%s\n%s\n", digestLen * 8, tv, hex);
+    failures++;
   } else {
     printf("[%lu] OK\n", digestLen * 8);
   }
+  free(hex);
+}
+
+// Same as hexcmp, for outputs that aren't told apart by their length
+void check(const char *name, const char* tv, const uint8_t *out, size_t outLen) {
+  size_t i;
+
+  for (i=0; i<outLen; ++i) {
+    char byte[3];
+    sprintf(byte, "%02x", out[i]);
+    if (strncmp(tv + 2*i, byte, 2) != 0) {
+      break;
+    }
+  }
+  if (i != outLen || strlen(tv) != 2*outLen) {
+    printf("[%s] FAIL\n%s\n", name, tv);
+    for (i=0; i<outLen; ++i) {
+      printf("%02x", out[i]);
+    }
+    printf("\n");
+    failures++;
+  } else {
+    printf("[%s] OK\n", name);
+  }
+}
+
+// For outputs checked against another way of computing them
+void compare(const char *name, const uint8_t *want, const uint8_t *out,
+             size_t outLen) {
+  if (memcmp(want, out, outLen) != 0) {
+    printf("[%s] FAIL\n", name);
+    failures++;
+  } else {
+    printf("[%s] OK\n", name);
+  }
+}
+
+size_t unhex(uint8_t *out, const char *hex) {
+  size_t n = strlen(hex) / 2;
+  unsigned int b;
+
+  for (size_t i=0; i<n; ++i) {
+    sscanf(hex + 2*i, "%2x", &b);
+    out[i] = b;
+  }
+  return n;
 }
 
 #define MAX_DIGEST_SIZE 64
 
+// RFC 4231 test cases 1, 6 and 2 (key, data), for SHA-2. The HMAC-SHA3
+// values are the same inputs through Python's hmac and hashlib.
+static const struct {
+  HMACHashType type;
+  const char *mac[3];
+} hmac_tv[] = {
+  { HMAC_SHA3_224, {
+    "3b16546bbc7be2706a031dcafd56373d9884367641d8c59af3c860f7",
+    "b4a1f04c00287a9b7f6075b313d279b833bc8f75124352d05fb9995f",
+    "7fdb8dd88bd2f60d1b798634ad386811c2cfc85bfaf5d52bbace5e66" } },
+  { HMAC_SHA3_256, {
+    "ba85192310dffa96e2a3a40e69774351140bb7185e1202cdcc917589f95e16bb",
+    "ed73a374b96c005235f948032f09674a58c0ce555cfc1f223b02356560312c3b",
+    "c7d4072e788877ae3596bbb0da73b887c9171f93095b294ae857fbe2645e1ba5" } },
+  { HMAC_SHA3_384, {
+    "68d2dcf7fd4ddd0a2240c8a437305f61fb7334cfb5d0226e1bc27dc10a2e723a"
+    "20d370b47743130e26ac7e3d532886bd",
+    "0fc19513bf6bd878037016706a0e57bc528139836b9a42c3d419e498e0e1fb96"
+    "16fd669138d33a1105e07c72b6953bcc",
+    "f1101f8cbf9766fd6764d2ed61903f21ca9b18f57cf3e1a23ca13508a93243ce"
+    "48c045dc007f26a21b3f5e0e9df4c20a" } },
+  { HMAC_SHA3_512, {
+    "eb3fbd4b2eaab8f5c504bd3a41465aacec15770a7cabac531e482f860b5ec7ba"
+    "47ccb2c6f2afce8f88d22b6dc61380f23a668fd3888bb80537c0a0b86407689e",
+    "00f751a9e50695b090ed6911a4b65524951cdc15a73a5d58bb55215ea2cd839a"
+    "c79d2b44a39bafab27e83fde9e11f6340b11d991b1b91bf2eee7fc872426c3a4",
+    "5a4bfeab6166427c7a3647b747292b8384537cdb89afb3bf5665e4c5e709350b"
+    "287baec921fd7ca0ee7a0c31d022a95e1fc92ba9d77df883960275beb4e62024" } },
+  { HMAC_SHA256, {
+    "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7",
+    "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54",
+    "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843" } },
+  { HMAC_SHA512, {
+    "87aa7cdea5ef619d4ff0b4241a1d6cb02379f4e2ce4ec2787ad0b30545e17cde"
+    "daa833b7d6b8a702038b274eaea3f4e4be9d914eeb61f1702e696c203a126854",
+    "80b24263c7c1a3ebb71493c1dd7be8b49b46d1f41b4aeec1121b013783f8f352"
+    "6b56d037e05f2598bd0fd2215d6a1e5295e64f73f63f0aec8b915a985d786598",
+    "164b7a7bfcf819e2e395fbe73b56e0a387bd64222e831fd610270cd7ea250554"
+    "9758bf75c05a994a6d034f65f8f0e6fdcaeab1a34d4a6b4b636e070a38bce737" } },
+};
+
+void test_hmac(void) {
+  static const char *names[] = {
+    "HMAC-SHA3-224", "HMAC-SHA3-256", "HMAC-SHA3-384", "HMAC-SHA3-512",
+    "HMAC-SHA256", "HMAC-SHA512"
+  };
+  static const char *data[3] = {
+    "Hi There",
+    "Test Using Larger Than Block-Size Key - Hash Key First",
+    "what do ya want for nothing?"
+  };
+  uint8_t key[3][131], mac[MAX_DIGEST_SIZE];
+  unsigned int keyLen[3] = { 20, 131, 4 };
+  unsigned int macLen;
+  char name[32];
+
+  memset(key[0], 0x0b, 20);
+  memset(key[1], 0xaa, 131);
+  memcpy(key[2], "Jefe", 4);
+  for (size_t t=0; t<sizeof hmac_tv / sizeof hmac_tv[0]; ++t) {
+    for (int c=0; c<3; ++c) {
+      HMACKey *k = HMAC_NewKey(hmac_tv[t].type, key[c], keyLen[c]);
+      HMACVerifyJob jobs[2];
+
+      HMAC_Compute(k, mac, &macLen, sizeof mac, (const uint8_t *)data[c],
+                   strlen(data[c]));
+      sprintf(name, "%s %d", names[t], c + 1);
+      check(name, hmac_tv[t].mac[c], mac, macLen);
+
+      // one good MAC truncated to half, one with a bit flipped
+      jobs[0].data = jobs[1].data = (const uint8_t *)data[c];
+      jobs[0].dataLen = jobs[1].dataLen = strlen(data[c]);
+      jobs[0].mac = jobs[1].mac = mac;
+      jobs[0].macLen = macLen / 2;
+      jobs[1].macLen = macLen;
+      mac[macLen - 1] ^= 1;
+      if (HMAC_VerifyBatch(k, jobs, 2) != SECFailure ||
+          !jobs[0].valid || jobs[1].valid) {
+        printf("[%s verify] FAIL\n", name);
+        failures++;
+      }
+      HMAC_DestroyKey(k);
+    }
+  }
+}
+
+// The samples of NIST's SP 800-185 examples (cSHAKE samples 1-4, KMAC
+// samples 1-6, KMACXOF samples 1 and 6), and a KMAC256 of 100 bytes, which
+// is too long for the pruned last round; its value is from a Python
+// implementation of SP 800-185 that gives all the samples.
+static const struct {
+  SHA3Type type;
+  const char *S;
+  PRBool kmac, xof;
+  unsigned int msgLen, outLen;
+  const char *out;
+} sp800_185_tv[] = {
+  { SHA3_TYPE_SHAKE128, "Email Signature", PR_FALSE, PR_FALSE, 4, 32,
+    "c1c36925b6409a04f1b504fcbca9d82b4017277cb5ed2b2065fc1d3814d5aaf5" },
+  { SHA3_TYPE_SHAKE128, "Email Signature", PR_FALSE, PR_FALSE, 200, 32,
+    "c5221d50e4f822d96a2e8881a961420f294b7b24fe3d2094baed2c6524cc166b" },
+  { SHA3_TYPE_SHAKE256, "Email Signature", PR_FALSE, PR_FALSE, 4, 64,
+    "d008828e2b80ac9d2218ffee1d070c48b8e4c87bff32c9699d5b6896eee0edd1"
+    "64020e2be0560858d9c00c037e34a96937c561a74c412bb4c746469527281c8c" },
+  { SHA3_TYPE_SHAKE256, "Email Signature", PR_FALSE, PR_FALSE, 200, 64,
+    "07dc27b11e51fbac75bc7b3c1d983e8b4b85fb1defaf218912ac864302730917"
+    "27f42b17ed1df63e8ec118f04b23633c1dfb1574c8fb55cb45da8e25afb092bb" },
+  { SHA3_TYPE_SHAKE128, "", PR_TRUE, PR_FALSE, 4, 32,
+    "e5780b0d3ea6f7d3a429c5706aa43a00fadbd7d49628839e3187243f456ee14e" },
+  { SHA3_TYPE_SHAKE128, "My Tagged Application", PR_TRUE, PR_FALSE, 4, 32,
+    "3b1fba963cd8b0b59e8c1a6d71888b7143651af8ba0a7070c0979e2811324aa5" },
+  { SHA3_TYPE_SHAKE128, "My Tagged Application", PR_TRUE, PR_FALSE, 200, 32,
+    "1f5b4e6cca02209e0dcb5ca635b89a15e271ecc760071dfd805faa38f9729230" },
+  { SHA3_TYPE_SHAKE256, "My Tagged Application", PR_TRUE, PR_FALSE, 4, 64,
+    "20c570c31346f703c9ac36c61c03cb64c3970d0cfc787e9b79599d273a68d2f7"
+    "f69d4cc3de9d104a351689f27cf6f5951f0103f33f4f24871024d9c27773a8dd" },
+  { SHA3_TYPE_SHAKE256, "", PR_TRUE, PR_FALSE, 200, 64,
+    "75358cf39e41494e949707927cee0af20a3ff553904c86b08f21cc414bcfd691"
+    "589d27cf5e15369cbbff8b9a4c2eb17800855d0235ff635da82533ec6b759b69" },
+  { SHA3_TYPE_SHAKE256, "My Tagged Application", PR_TRUE, PR_FALSE, 200, 64,
+    "b58618f71f92e1d56c1b8c55ddd7cd188b97b4ca4d99831eb2699a837da2e4d9"
+    "70fbacfde50033aea585f1a2708510c32d07880801bd182898fe476876fc8965" },
+  { SHA3_TYPE_SHAKE128, "", PR_TRUE, PR_TRUE, 4, 32,
+    "cd83740bbd92ccc8cf032b1481a0f4460e7ca9dd12b08a0c4031178bacd6ec35" },
+  { SHA3_TYPE_SHAKE256, "My Tagged Application", PR_TRUE, PR_TRUE, 200, 64,
+    "d5be731c954ed7732846bb59dbe3a8e30f83e77a4bff4459f2f1c2b4ecebb8ce"
+    "67ba01c62e8ab8578d2d499bd1bb276768781190020a306a97de281dcc30305d" },
+  { SHA3_TYPE_SHAKE256, "My Tagged Application", PR_TRUE, PR_FALSE, 200, 100,
+    "ca46456ef6fe76bc67fec121065d0360a9bb3a72bce7c5474003c96eeee94d76"
+    "aff6c4f652fcb46795009967f14af51e521d169353afad546502aca35f265015"
+    "255d620cdc6633deea912e8504df2cd0b52aab763ea3ffbf242dbb3cba42cd33"
+    "abdc0e6d" },
+};
+
+void test_cshake_kmac(void) {
+  uint8_t msg[200], key[32], out[100], mac[100];
+  char name[32];
+
+  for (int i=0; i<200; ++i) {
+    msg[i] = i;
+  }
+  for (int i=0; i<32; ++i) {
+    key[i] = 0x40 + i;
+  }
+  for (size_t t=0; t<sizeof sp800_185_tv / sizeof sp800_185_tv[0]; ++t) {
+    const uint8_t *S = (const uint8_t *)sp800_185_tv[t].S;
+    unsigned int Slen = strlen(sp800_185_tv[t].S);
+    unsigned int len = sp800_185_tv[t].msgLen, outLen = sp800_185_tv[t].outLen;
+    CSHAKEState *state;
+    CSHAKEContext *cx;
+
+    if (sp800_185_tv[t].kmac) {
+      state = KMAC_NewKey(sp800_185_tv[t].type, key, sizeof key, S, Slen);
+    } else {
+      state = CSHAKE_NewState(sp800_185_tv[t].type, NULL, 0, S, Slen);
+    }
+    sprintf(name, "%s%s %zu", sp800_185_tv[t].kmac ? "KMAC" : "cSHAKE",
+            sp800_185_tv[t].xof ? "XOF" : "", t + 1);
+
+    // in two updates, and the output in two squeezes
+    cx = CSHAKE_NewContext(state);
+    CSHAKE_Update(cx, msg, len / 3);
+    CSHAKE_Update(cx, msg + len / 3, len - len / 3);
+    if (sp800_185_tv[t].kmac && !sp800_185_tv[t].xof) {
+      KMAC_Finish(cx, out, outLen);
+      check(name, sp800_185_tv[t].out, out, outLen);
+      // the context has nothing more to give, and takes nothing more
+      memcpy(mac, out, outLen);
+      if (CSHAKE_Squeeze(cx, out, outLen) != SECFailure ||
+          memcmp(out, mac, outLen) != 0 ||
+          CSHAKE_Update(cx, msg, len) != SECFailure) {
+        printf("[%s after finish] FAIL\n", name);
+        failures++;
+      }
+      KMAC_Compute(state, msg, len, out, outLen);
+    } else {
+      // input after the first squeeze is refused, and changes nothing
+      CSHAKE_Squeeze(cx, out, 5);
+      if (CSHAKE_Update(cx, msg, len) != SECFailure) {
+        printf("[%s update after squeeze] FAIL\n", name);
+        failures++;
+      }
+      CSHAKE_Squeeze(cx, out + 5, outLen - 5);
+      check(name, sp800_185_tv[t].out, out, outLen);
+      // on a KMAC key that is KMACXOF
+      CSHAKE_Hash(state, msg, len, out, outLen);
+    }
+    strcat(name, " one-shot");
+    check(name, sp800_185_tv[t].out, out, outLen);
+    CSHAKE_DestroyContext(cx, PR_TRUE);
+    CSHAKE_DestroyState(state);
+  }
+}
+
+// SHAKE of the 200 bytes of 0xA3 of the SHA3 tests, bytes 0-31 and
+// 480-511 of the output (FIPS 202 examples, same as hashlib), and of the
+// empty message. RawSHAKE has no published vectors; these are from a
+// Python sponge with the RawSHAKE suffix, which gives the SHAKE ones too.
+static const struct {
+  SHA3Type type;
+  const char *head, *tail, *empty, *raw;
+} shake_tv[] = {
+  { SHA3_TYPE_SHAKE128,
+    "131ab8d2b594946b9c81333f9bb6e0ce75c3b93104fa3469d3917457385da037",
+    "44c9fb359fd56ac0a9a75a743cff6862f17d7259ab075216c0699511643b6439",
+    "7f9c2ba4e88f827d616045507605853ed73b8093f6efbc88eb1a6eacfa66ef26",
+    "96a8092bb1419aefb092e1935190b10e6323db3b2e8e1ecc546518f20820da7b" },
+  { SHA3_TYPE_SHAKE256,
+    "cd8a920ed141aa0407a22d59288652e9d9f1a7ee0c1e7c1ca699424da84a904d",
+    "6a1a9d7846436e4dca5728b6f760eef0ca92bf0be5615e96959d767197a0beeb",
+    "46b9dd2b0ba88d13233b3feb743eeb243fcd52ea62b81b82b50c27646ed5762f",
+    "f353b1260d7a0adb3f5c08bf292f3372ad3ee4630d56cf11ba15ddfb2e70e7a2" },
+};
+
+void test_shake(void) {
+  uint8_t out[512], stream[512];
+  char name[32];
+
+  for (int t=0; t<2; ++t) {
+    SHAKEContext *cx = SHAKE_NewContext(shake_tv[t].type);
+    const char *bits = t ? "256" : "128";
+    unsigned int off, n;
+
+    (t ? SHAKE256 : SHAKE128)(message_short, MESSAGE_LEN_SHORT, out, 512);
+    sprintf(name, "SHAKE%s", bits);
+    check(name, shake_tv[t].head, out, 32);
+    check(name, shake_tv[t].tail, out + 480, 32);
+
+    // absorbed in uneven pieces, squeezed in pieces across block edges
+    for (off=0, n=1; off < MESSAGE_LEN_SHORT; off += n, n = n*3 + 1) {
+      n = off + n > MESSAGE_LEN_SHORT ? MESSAGE_LEN_SHORT - off : n;
+      SHAKE_Absorb(cx, message_short + off, n);
+    }
+    for (off=0, n=7; off < sizeof stream; off += n, n += 61) {
+      n = off + n > sizeof stream ? sizeof stream - off : n;
+      SHAKE_Squeeze(cx, stream + off, n);
+      // input once squeezing has started is refused, and changes nothing
+      if (SHAKE_Absorb(cx, message_short, MESSAGE_LEN_SHORT) != SECFailure) {
+        printf("[SHAKE%s absorb after squeeze] FAIL\n", bits);
+        failures++;
+      }
+    }
+    sprintf(name, "SHAKE%s streamed", bits);
+    check(name, shake_tv[t].head, stream, 32);
+    if (memcmp(out, stream, sizeof out) != 0) {
+      printf("[%s] FAIL\n", name);
+      failures++;
+    }
+
+    SHAKE_Begin(cx);
+    SHAKE_Squeeze(cx, out, 32);
+    sprintf(name, "SHAKE%s empty", bits);
+    check(name, shake_tv[t].empty, out, 32);
+    SHAKE_DestroyContext(cx, PR_TRUE);
+
+    (t ? SHAKE256_Raw : SHAKE128_Raw)(message_short, MESSAGE_LEN_SHORT,
+                                      out, 32);
+    sprintf(name, "RawSHAKE%s", bits);
+    check(name, shake_tv[t].raw, out, 32);
+  }
+}
+
+// RFC 9861 test vectors. ptn(n) is the repeated pattern 00 01 .. FA of n
+// bytes; "ff" messages are that many bytes of 0xFF.
+void ptn(uint8_t *buf, size_t n) {
+  for (size_t i=0; i<n; ++i) {
+    buf[i] = i % 251;
+  }
+}
+
+static const struct {
+  size_t msgLen;            // ptn(msgLen), or msgLen bytes of 0xFF if ff
+  PRBool ff;
+  unsigned int customLen;   // ptn(customLen)
+  const char *out;          // the first 32 bytes
+} k12_tv[] = {
+  { 0, PR_FALSE, 0,
+    "1ac2d450fc3b4205d19da7bfca1b37513c0803577ac7167f06fe2ce1f0ef39e5" },
+  { 1, PR_FALSE, 0,
+    "2bda92450e8b147f8a7cb629e784a058efca7cf7d8218e02d345dfaa65244a1f" },
+  { 17, PR_FALSE, 0,
+    "6bf75fa2239198db4772e36478f8e19b0f371205f6a9a93a273f51df37122888" },
+  { 17*17, PR_FALSE, 0,
+    "0c315ebcdedbf61426de7dcf8fb725d1e74675d7f5327a5067f367b108ecb67c" },
+  { 17*17*17, PR_FALSE, 0,
+    "cb552e2ec77d9910701d578b457ddf772c12e322e4ee7fe417f92c758f0d59d0" },
+  { 17*17*17*17, PR_FALSE, 0,
+    "8701045e22205345ff4dda05555cbb5c3af1a771c2b89baef37db43d9998b9fe" },
+  { 17*17*17*17*17, PR_FALSE, 0,
+    "844d610933b1b9963cbdeb5ae3b6b05cc7cbd67ceedf883eb678a0a8e0371682" },
+  { 17*17*17*17*17*17, PR_FALSE, 0,
+    "3c390782a8a4e89fa6367f72feaaf13255c8d95878481d3cd8ce85f58e880af8" },
+  { 0, PR_FALSE, 1,
+    "fab658db63e94a246188bf7af69a133045f46ee984c56e3c3328caaf1aa1a583" },
+  { 1, PR_TRUE, 41,
+    "d848c5068ced736f4462159b9867fd4c20b808acc3d5bc48e0b06ba0a3762ec4" },
+  { 3, PR_TRUE, 41*41,
+    "c389e5009ae57120854c2e8c64670ac01358cf4c1baf89447a724234dc7ced74" },
+  { 8191, PR_FALSE, 0,
+    "1b577636f723643e990cc7d6a659837436fd6a103626600eb8301cd1dbe553d6" },
+  { 8192, PR_FALSE, 0,
+    "48f256f6772f9edfb6a8b661ec92dc93b95ebd05a08a17b39ae3490870c926c3" },
+  { 8192, PR_FALSE, 8189,
+    "3ed12f70fb05ddb58689510ab3e4d23c6c6033849aa01e1d8c220a297fedcd0b" },
+  { 8192, PR_FALSE, 8190,
+    "6a7c1b6a5cd0d8c9ca943a4a216cc64604559a2ea45f78570a15253d67ba00ae" },
+};
+
+static const struct {
+  SHA3Type type;
+  size_t msgLen;            // as for k12_tv
+  PRBool ff;
+  unsigned char D;
+  const char *out;          // the first 32 or 64 bytes
+} turboshake_tv[] = {
+  { SHA3_TYPE_SHAKE128, 0, PR_FALSE, 0x1f,
+    "1e415f1c5983aff2169217277d17bb538cd945a397ddec541f1ce41af2c1b74c" },
+  { SHA3_TYPE_SHAKE128, 17, PR_FALSE, 0x1f,
+    "9c97d036a3bac819db70ede0ca554ec6e4c2a1a4ffbfd9ec269ca6a111161233" },
+  { SHA3_TYPE_SHAKE128, 3, PR_TRUE, 0x01,
+    "bf323f940494e88ee1c540fe660be8a0c93f43d15ec006998462fa994eed5dab" },
+  { SHA3_TYPE_SHAKE128, 1, PR_TRUE, 0x06,
+    "8ec9c66465ed0d4a6c35d13506718d687a25cb05c74cca1e42501abd83874a67" },
+  { SHA3_TYPE_SHAKE128, 7, PR_TRUE, 0x0b,
+    "8deeaa1aec47ccee569f659c21dfa8e112db3cee37b18178b2acd805b799cc37" },
+  { SHA3_TYPE_SHAKE256, 0, PR_FALSE, 0x1f,
+    "367a329dafea871c7802ec67f905ae13c57695dc2c6663c61035f59a18f8e7db"
+    "11edc0e12e91ea60eb6b32df06dd7f002fbafabb6e13ec1cc20d995547600db0" },
+  { SHA3_TYPE_SHAKE256, 17*17, PR_FALSE, 0x1f,
+    "66b810db8e90780424c0847372fdc95710882fde31c6df75beb9d4cd9305cfca"
+    "e35e7b83e8b7e6eb4b78605880116316fe2c078a09b94ad7b8213c0a738b65c0" },
+  { SHA3_TYPE_SHAKE256, 1, PR_TRUE, 0x06,
+    "738d7b4e37d18b7f22ad1b5313e357e3dd7d07056a26a303c433fa3533455280"
+    "f4f5a7d4f700efb437fe6d281405e07be32a0a972e22e63adc1b090daefe004b" },
+};
+
+// the message of a k12_tv or turboshake_tv entry
+uint8_t *rfc9861_msg(size_t len, PRBool ff) {
+  uint8_t *msg = malloc(len + 1);
+
+  if (ff) {
+    memset(msg, 0xff, len);
+  } else {
+    ptn(msg, len);
+  }
+  return msg;
+}
+
+void test_k12(void) {
+  uint8_t custom[8192], out[10032];
+  char name[48];
+  SHA3ThreadPool *pool = SHA3_NewThreadPool(4);
+
+  for (size_t t=0; t<sizeof k12_tv / sizeof k12_tv[0]; ++t) {
+    size_t len = k12_tv[t].msgLen;
+    uint8_t *msg = rfc9861_msg(len, k12_tv[t].ff);
+    unsigned int customLen = k12_tv[t].customLen;
+    K12Context *cx;
+    size_t off, n;
+
+    ptn(custom, customLen);
+    KangarooTwelve(msg, len, custom, customLen, out, 32);
+    sprintf(name, "KT128 %zu", t + 1);
+    check(name, k12_tv[t].out, out, 32);
+
+    // in pieces that start and end inside the chunks
+    cx = K12_NewContext(custom, customLen);
+    for (off=0, n=1; off < len; off += n, n = n*5 + 3) {
+      n = off + n > len ? len - off : n;
+      K12_Update(cx, msg + off, n);
+    }
+    K12_Squeeze(cx, out, 16);
+    if (K12_Update(cx, msg, len) != SECFailure) {
+      printf("[%s update after squeeze] FAIL\n", name);
+      failures++;
+    }
+    K12_Squeeze(cx, out + 16, 16);
+    strcat(name, " streamed");
+    check(name, k12_tv[t].out, out, 32);
+
+    // long enough for the leaves to go to the workers
+    if (len >= 512*1024) {
+      K12_SetThreadPool(cx, pool);
+      K12_Begin(cx);
+      K12_Update(cx, msg, len);
+      K12_Squeeze(cx, out, 32);
+      sprintf(name, "KT128 %zu, 4 threads", t + 1);
+      check(name, k12_tv[t].out, out, 32);
+    }
+    K12_DestroyContext(cx);
+    free(msg);
+  }
+  SHA3_DestroyThreadPool(pool);
+
+  // long outputs of the empty message
+  KangarooTwelve(NULL, 0, NULL, 0, out, 10032);
+  check("KT128 empty, bytes 32-63",
+        "4269c056b8c82e48276038b6d292966cc07a3d4645272e31ff38508139eb0a71",
+        out + 32, 32);
+  check("KT128 empty, last 32 of 10032",
+        "e8dc563642f7228c84684c898405d3a834799158c079b12880277a1d28e2ff6d",
+        out + 10000, 32);
+
+  for (size_t t=0; t<sizeof turboshake_tv / sizeof turboshake_tv[0]; ++t) {
+    size_t len = turboshake_tv[t].msgLen;
+    uint8_t *msg = rfc9861_msg(len, turboshake_tv[t].ff);
+    unsigned int outLen = turboshake_tv[t].type == SHA3_TYPE_SHAKE128 ? 32 : 64;
+    SHAKEContext *cx = TurboSHAKE_NewContext(turboshake_tv[t].type,
+                                             turboshake_tv[t].D);
+
+    (outLen == 32 ? TurboSHAKE128 : TurboSHAKE256)(msg, len,
+                                                   turboshake_tv[t].D,
+                                                   out, outLen);
+    sprintf(name, "TurboSHAKE%d %zu", outLen * 4, t + 1);
+    check(name, turboshake_tv[t].out, out, outLen);
+    SHAKE_Absorb(cx, msg, len / 2);
+    SHAKE_Absorb(cx, msg + len / 2, len - len / 2);
+    SHAKE_Squeeze(cx, out, 3);
+    SHAKE_Squeeze(cx, out + 3, outLen - 3);
+    strcat(name, " streamed");
+    check(name, turboshake_tv[t].out, out, outLen);
+    SHAKE_DestroyContext(cx, PR_TRUE);
+    free(msg);
+  }
+}
+
+// Each lane of a SHAKEMultiContext against a SHAKEContext given the same
+// bytes: a seed shared by every lane, then a per lane nonce across block
+// edges, squeezed over three calls with lane 0 sitting one out.
+void test_shake_multi(void) {
+  uint8_t buf[1024], out[8][4*168], want[4*168];
+  char name[48];
+
+  ptn(buf, sizeof buf);
+  for (int t=0; t<2; ++t) {
+    SHA3Type type = shake_tv[t].type;
+    unsigned int r = t ? 136 : 168, fails = failures;
+
+    sprintf(name, "SHAKE%s multi-lane, %s", t ? "256" : "128",
+            SHA3_GetBackend());
+    for (unsigned int lanes=1; lanes<=8; ++lanes) {
+      SHAKEMultiContext *mc = SHAKE_NewMultiContext(type, lanes);
+      const unsigned char *seed[8], *nonce[8];
+      unsigned char *dest[8];
+
+      memset(out, 0, sizeof out);
+      for (unsigned int s=0; s<lanes; ++s) {
+        seed[s] = buf;
+        nonce[s] = buf + 200 + 13*s;
+        dest[s] = out[s];
+      }
+      SHAKE_MultiAbsorb(mc, seed, r - 3);
+      SHAKE_MultiAbsorb(mc, nonce, 2*r + 5);
+      SHAKE_MultiSqueezeBlocks(mc, dest, 1);
+      if (SHAKE_MultiAbsorb(mc, nonce, 1) != SECFailure) {
+        printf("[%s absorb after squeeze] FAIL\n", name);
+        failures++;
+      }
+      for (unsigned int s=0; s<lanes; ++s) {
+        dest[s] = out[s] + r;
+      }
+      dest[0] = NULL;
+      SHAKE_MultiSqueezeBlocks(mc, dest, 1);
+      for (unsigned int s=0; s<lanes; ++s) {
+        dest[s] = out[s] + 2*r;
+      }
+      SHAKE_MultiSqueezeBlocks(mc, dest, 2);
+
+      for (unsigned int s=0; s<lanes; ++s) {
+        SHAKEContext *cx = SHAKE_NewContext(type);
+
+        SHAKE_Absorb(cx, buf, r - 3);
+        SHAKE_Absorb(cx, buf + 200 + 13*s, 2*r + 5);
+        SHAKE_Squeeze(cx, want, 4*r);
+        if (s == 0) {
+          // the skipped block was still squeezed, just not written
+          memset(want + r, 0, r);
+        }
+        if (memcmp(want, out[s], 4*r) != 0) {
+          printf("[%s, lane %u of %u] FAIL\n", name, s, lanes);
+          failures++;
+        }
+        SHAKE_DestroyContext(cx, PR_TRUE);
+      }
+      SHAKE_DestroyMultiContext(mc);
+    }
+    // forked from a seed left a few bytes into a block, twice, with the
+    // second fork over lanes that have already squeezed
+    for (unsigned int lanes=1; lanes<=8; ++lanes) {
+      SHAKEMultiContext *mc = SHAKE_NewMultiContext(type, lanes);
+      SHAKEContext *seed = SHAKE_NewContext(type);
+      const unsigned char *nonce[8];
+      unsigned char *dest[8];
+
+      SHAKE_Absorb(seed, buf, r + 7);
+      for (unsigned int round=0; round<2; ++round) {
+        if (SHAKE_MultiFork(mc, seed) != SECSuccess) {
+          printf("[%s fork] FAIL\n", name);
+          failures++;
+        }
+        for (unsigned int s=0; s<lanes; ++s) {
+          nonce[s] = buf + 300 + 11*s + round;
+          dest[s] = out[s];
+        }
+        SHAKE_MultiAbsorb(mc, nonce, 9);
+        SHAKE_MultiSqueezeBlocks(mc, dest, 2);
+        for (unsigned int s=0; s<lanes; ++s) {
+          SHAKEContext *cx = SHAKE_NewContext(type);
+
+          SHAKE_Absorb(cx, buf, r + 7);
+          SHAKE_Absorb(cx, nonce[s], 9);
+          SHAKE_Squeeze(cx, want, 2*r);
+          if (memcmp(want, out[s], 2*r) != 0) {
+            printf("[%s fork, lane %u of %u] FAIL\n", name, s, lanes);
+            failures++;
+          }
+          SHAKE_DestroyContext(cx, PR_TRUE);
+        }
+      }
+
+      // a seed of the other SHAKE, a TurboSHAKE one or a squeezed one
+      // can't be forked
+      SHAKEContext *other = SHAKE_NewContext(shake_tv[!t].type);
+      SHAKEContext *turbo = TurboSHAKE_NewContext(type, 0x1f);
+      SHAKE_Squeeze(seed, want, 1);
+      if (SHAKE_MultiFork(mc, other) != SECFailure ||
+          SHAKE_MultiFork(mc, turbo) != SECFailure ||
+          SHAKE_MultiFork(mc, seed) != SECFailure) {
+        printf("[%s fork refused] FAIL\n", name);
+        failures++;
+      }
+      SHAKE_DestroyContext(other, PR_TRUE);
+      SHAKE_DestroyContext(turbo, PR_TRUE);
+      SHAKE_DestroyContext(seed, PR_TRUE);
+      SHAKE_DestroyMultiContext(mc);
+    }
+    if (SHAKE_NewMultiContext(type, 9) != NULL ||
+        SHAKE_NewMultiContext(type, 0) != NULL) {
+      printf("[%s, 0 or 9 lanes] FAIL\n", name);
+      failures++;
+    }
+    if (failures == fails) {
+      printf("[%s] OK\n", name);
+    }
+  }
+}
+
+// ParallelHash samples 1, 2, 4 and 5 and ParallelHashXOF128 sample 2 of
+// NIST's SP 800-185 examples (X = 00..07 10..17 20..27, B = 8), then
+// blocks longer than the 128 KiB a pool item usually takes, over 1 MiB of
+// ptn; those values are from a Python ParallelHash that gives the samples.
+static const struct {
+  SHA3Type type;
+  unsigned int B;
+  const char *S;
+  PRBool xof;
+  const char *out;
+} parallelhash_tv[] = {
+  { SHA3_TYPE_SHAKE128, 8, "", PR_FALSE,
+    "ba8dc1d1d979331d3f813603c67f72609ab5e44b94a0b8f9af46514454a2b4f5" },
+  { SHA3_TYPE_SHAKE128, 8, "Parallel Data", PR_FALSE,
+    "fc484dcb3f84dceedc353438151bee58157d6efed0445a81f165e495795b7206" },
+  { SHA3_TYPE_SHAKE256, 8, "", PR_FALSE,
+    "bc1ef124da34495e948ead207dd9842235da432d2bbc54b4c110e64c45110553"
+    "1b7f2a3e0ce055c02805e7c2de1fb746af97a1dd01f43b824e31b87612410429" },
+  { SHA3_TYPE_SHAKE256, 8, "Parallel Data", PR_FALSE,
+    "cdf15289b54f6212b4bc270528b49526006dd9b54e2b6add1ef6900dda3963bb"
+    "33a72491f236969ca8afaea29c682d47a393c065b38e29fae651a2091c833110" },
+  { SHA3_TYPE_SHAKE128, 8, "Parallel Data", PR_TRUE,
+    "ea2a793140820f7a128b8eb70a9439f93257c6e6e79b4a540d291d6dae7098d7" },
+  { SHA3_TYPE_SHAKE128, 256*1024, "", PR_FALSE,
+    "bbafb77d5e170a9b99afed1c300b485f3f2f630d578b14ee0bc23f10699f567f" },
+  { SHA3_TYPE_SHAKE256, 256*1024 + 5, "big", PR_FALSE,
+    "5b4ce3f31dd49f8147636c6f39f78eaddc077a6857c232e887b8ed6aab4045c2"
+    "59c8586bf69816a7690d6f441c96084cb23915682bf30d7fb514eaf51d4b2dbb" },
+};
+
+void test_parallelhash(void) {
+  static const uint8_t X[24] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27
+  };
+  size_t bigLen = 1024*1024 + 1000;
+  uint8_t *big = malloc(bigLen), out[64], prev[64];
+  SHA3ThreadPool *pool = SHA3_NewThreadPool(4);
+  char name[48];
+
+  ptn(big, bigLen);
+  for (size_t t=0; t<sizeof parallelhash_tv / sizeof parallelhash_tv[0]; ++t) {
+    const uint8_t *msg = parallelhash_tv[t].B == 8 ? X : big;
+    size_t len = parallelhash_tv[t].B == 8 ? sizeof X : bigLen;
+    unsigned int outLen =
+      parallelhash_tv[t].type == SHA3_TYPE_SHAKE128 ? 32 : 64;
+    ParallelHashContext *cx = ParallelHash_NewContext(
+      parallelhash_tv[t].type, parallelhash_tv[t].B,
+      (const uint8_t *)parallelhash_tv[t].S, strlen(parallelhash_tv[t].S));
+
+    // one update, then in pieces, then one update on the pool
+    for (int pass=0; pass<3; ++pass) {
+      ParallelHash_Begin(cx);
+      if (pass == 1) {
+        for (size_t off=0, n=1; off < len; off += n, n = n*7 + 1) {
+          n = off + n > len ? len - off : n;
+          ParallelHash_Update(cx, msg + off, n);
+        }
+      } else {
+        ParallelHash_SetThreadPool(cx, pass == 2 ? pool : NULL);
+        ParallelHash_Update(cx, msg, len);
+      }
+      sprintf(name, "ParallelHash%s%d %zu%s",
+              parallelhash_tv[t].xof ? "XOF" : "", outLen * 4, t + 1,
+              pass == 0 ? "" : pass == 1 ? " streamed" : ", 4 threads");
+      if (parallelhash_tv[t].xof) {
+        ParallelHash_Squeeze(cx, out, 5);
+        ParallelHash_Squeeze(cx, out + 5, outLen - 5);
+      } else {
+        ParallelHash_Finish(cx, out, outLen);
+      }
+      check(name, parallelhash_tv[t].out, out, outLen);
+
+      // an ended context takes no more input, nor gives more of a
+      // fixed-length output
+      memcpy(prev, out, outLen);
+      if (ParallelHash_Update(cx, msg, len) != SECFailure ||
+          ParallelHash_Squeeze(cx, out, outLen) !=
+            (parallelhash_tv[t].xof ? SECSuccess : SECFailure) ||
+          (!parallelhash_tv[t].xof && memcmp(out, prev, outLen) != 0) ||
+          ParallelHash_Finish(cx, out, outLen) != SECFailure) {
+        printf("[%s after end] FAIL\n", name);
+        failures++;
+      }
+    }
+    ParallelHash_DestroyContext(cx);
+  }
+  SHA3_DestroyThreadPool(pool);
+  free(big);
+}
+
+// TupleHash samples 1-6 and TupleHashXOF samples 3 and 6 of NIST's
+// SP 800-185 examples, over the first nfields of 000102, 101112131415
+// and 202122232425262728.
+static const struct {
+  SHA3Type type;
+  const char *S;
+  PRBool xof;
+  unsigned int nfields;
+  const char *out;
+} tuplehash_tv[] = {
+  { SHA3_TYPE_SHAKE128, "", PR_FALSE, 2,
+    "c5d8786c1afb9b82111ab34b65b2c0048fa64e6d48e263264ce1707d3ffc8ed1" },
+  { SHA3_TYPE_SHAKE128, "My Tuple App", PR_FALSE, 2,
+    "75cdb20ff4db1154e841d758e24160c54bae86eb8c13e7f5f40eb35588e96dfb" },
+  { SHA3_TYPE_SHAKE128, "My Tuple App", PR_FALSE, 3,
+    "e60f202c89a2631eda8d4c588ca5fd07f39e5151998deccf973adb3804bb6e84" },
+  { SHA3_TYPE_SHAKE128, "My Tuple App", PR_TRUE, 3,
+    "900fe16cad098d28e74d632ed852f99daab7f7df4d99e775657885b4bf76d6f8" },
+  { SHA3_TYPE_SHAKE256, "", PR_FALSE, 2,
+    "cfb7058caca5e668f81a12a20a2195ce97a925f1dba3e7449a56f82201ec6073"
+    "11ac2696b1ab5ea2352df1423bde7bd4bb78c9aed1a853c78672f9eb23bbe194" },
+  { SHA3_TYPE_SHAKE256, "My Tuple App", PR_FALSE, 2,
+    "147c2191d5ed7efd98dbd96d7ab5a11692576f5fe2a5065f3e33de6bba9f3aa1"
+    "c4e9a068a289c61c95aab30aee1e410b0b607de3620e24a4e3bf9852a1d4367e" },
+  { SHA3_TYPE_SHAKE256, "My Tuple App", PR_FALSE, 3,
+    "45000be63f9b6bfd89f54717670f69a9bc763591a4f05c50d68891a744bcc6e7"
+    "d6d5b5e82c018da999ed35b0bb49c9678e526abd8e85c13ed254021db9e790ce" },
+  { SHA3_TYPE_SHAKE256, "My Tuple App", PR_TRUE, 3,
+    "0c59b11464f2336c34663ed51b2b950bec743610856f36c28d1d088d8a244628"
+    "4dd09830a6a178dc752376199fae935d86cfdee5913d4922dfd369b66a53c897" },
+};
+
+void test_tuplehash(void) {
+  static const uint8_t X0[3] = { 0x00, 0x01, 0x02 };
+  static const uint8_t X1[6] = { 0x10, 0x11, 0x12, 0x13, 0x14, 0x15 };
+  static const uint8_t X2[9] = {
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28
+  };
+  static const uint8_t ten[10] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+  SHA3Field X[3] = { { X0, sizeof X0 }, { X1, sizeof X1 }, { X2, sizeof X2 } };
+  unsigned int bigLen = 1024*1024 + 1000;
+  uint8_t *big = malloc(bigLen), out[64], prev[64];
+  TupleHashContext *cx;
+  char name[48];
+
+  for (size_t t=0; t<sizeof tuplehash_tv / sizeof tuplehash_tv[0]; ++t) {
+    unsigned int outLen = tuplehash_tv[t].type == SHA3_TYPE_SHAKE128 ? 32 : 64;
+    cx = TupleHash_NewContext(tuplehash_tv[t].type,
+      (const uint8_t *)tuplehash_tv[t].S, strlen(tuplehash_tv[t].S));
+
+    // all fields in one update, then a field (and an empty update) at a time
+    for (int pass=0; pass<2; ++pass) {
+      TupleHash_Begin(cx);
+      if (pass == 0) {
+        TupleHash_Update(cx, X, tuplehash_tv[t].nfields);
+      } else {
+        for (unsigned int i=0; i<tuplehash_tv[t].nfields; ++i) {
+          TupleHash_Update(cx, NULL, 0);
+          TupleHash_Update(cx, &X[i], 1);
+        }
+      }
+      sprintf(name, "TupleHash%s%d %zu%s",
+              tuplehash_tv[t].xof ? "XOF" : "", outLen * 4, t + 1,
+              pass == 0 ? "" : " streamed");
+      if (tuplehash_tv[t].xof) {
+        TupleHash_Squeeze(cx, out, 5);
+        TupleHash_Squeeze(cx, out + 5, outLen - 5);
+      } else {
+        TupleHash_Finish(cx, out, outLen);
+      }
+      check(name, tuplehash_tv[t].out, out, outLen);
+
+      // an ended tuple takes no more fields, nor gives more of a
+      // fixed-length output
+      memcpy(prev, out, outLen);
+      if (TupleHash_Update(cx, X, 1) != SECFailure ||
+          TupleHash_Squeeze(cx, out, outLen) !=
+            (tuplehash_tv[t].xof ? SECSuccess : SECFailure) ||
+          (!tuplehash_tv[t].xof && memcmp(out, prev, outLen) != 0) ||
+          TupleHash_Finish(cx, out, outLen) != SECFailure) {
+        printf("[%s after end] FAIL\n", name);
+        failures++;
+      }
+    }
+    TupleHash_DestroyContext(cx);
+  }
+
+  // a field longer than a block, and an empty one, from a Python
+  // TupleHash that gives the samples
+  ptn(big, bigLen);
+  X[1].data = big;
+  X[1].len = bigLen;
+  X[2].len = 0;
+  cx = TupleHash_NewContext(SHA3_TYPE_SHAKE256, (const uint8_t *)"big", 3);
+  TupleHash_Begin(cx);
+  TupleHash_Update(cx, X, 3);
+  TupleHash_Finish(cx, out, 64);
+  check("TupleHash256 long field", "bfedb7add953197cf4cae6715844c504f378079a63"
+        "86990c6f96e479f5e27e093fdde0579a1c4c5ac891264a2943e659097f83b3ceb8f3"
+        "a4a56f81739ba78897", out, 64);
+  TupleHash_DestroyContext(cx);
+  free(big);
+
+  // a field of nearly 4 GiB after a short one, whose length once wrapped
+  // the buffered-field check; zero pages mapped, not allocated
+  X[0].data = ten;
+  X[0].len = sizeof ten;
+  X[1].len = 0xFFFFFFF0u;
+  X[1].data = mmap(NULL, X[1].len, PROT_READ,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (X[1].data == MAP_FAILED) {
+    printf("TupleHash128 4 GiB field: SKIPPED (no address space)\n");
+    return;
+  }
+  cx = TupleHash_NewContext(SHA3_TYPE_SHAKE128, NULL, 0);
+  TupleHash_Begin(cx);
+  TupleHash_Update(cx, X, 2);
+  TupleHash_Finish(cx, out, 32);
+  check("TupleHash128 4 GiB field",
+        "6fc0fa87832d8b4ea2176f12855e0f6b5399e0b92836ee7e292651f6c73a15eb",
+        out, 32);
+  TupleHash_DestroyContext(cx);
+  munmap((void *)X[1].data, X[1].len);
+}
+
+// The multi-buffer hashes, message by message against SHA3_xxx_HashBuf,
+// which always runs the scalar permutation, at lengths around the rate.
+// make test runs this under each NSS_SHA3_BACKEND the CPU has.
+static const struct {
+  const char *name;
+  unsigned int r, digestLen;
+  SECStatus (*hash)(unsigned char *, const unsigned char *, PRUint32);
+  SECStatus (*hash4)(unsigned char *[4], const unsigned char *[4], PRUint32);
+  SECStatus (*hash8)(unsigned char *[8], const unsigned char *[8], PRUint32);
+  SECStatus (*many)(unsigned char *const *, const unsigned char *const *,
+                    unsigned int, PRUint32);
+  void (*update)(SHA3Context *, const unsigned char *, unsigned int);
+  void (*end)(SHA3Context *, unsigned char *, unsigned int *, unsigned int);
+} sha3_fns[] = {
+  { "SHA3-224", 144, 28, SHA3_224_HashBuf, SHA3_224_HashBuf4,
+    SHA3_224_HashBuf8, SHA3_224_HashBufMany, SHA3_224_Update, SHA3_224_End },
+  { "SHA3-256", 136, 32, SHA3_256_HashBuf, SHA3_256_HashBuf4,
+    SHA3_256_HashBuf8, SHA3_256_HashBufMany, SHA3_256_Update, SHA3_256_End },
+  { "SHA3-384", 104, 48, SHA3_384_HashBuf, SHA3_384_HashBuf4,
+    SHA3_384_HashBuf8, SHA3_384_HashBufMany, SHA3_384_Update, SHA3_384_End },
+  { "SHA3-512", 72, 64, SHA3_512_HashBuf, SHA3_512_HashBuf4,
+    SHA3_512_HashBuf8, SHA3_512_HashBufMany, SHA3_512_Update, SHA3_512_End },
+};
+
+// 0, r-1, r, r+1 and 2r
+static unsigned int rate_len(unsigned int r, int i) {
+  static const int mul[5] = { 0, 1, 1, 1, 2 }, add[5] = { 0, -1, 0, 1, 0 };
+
+  return mul[i] * r + add[i];
+}
+
+// the digests of n messages of sha3_fns[t], one line for all of them
+void compare_many(const char *name, size_t t, uint8_t *const *dest,
+                  const uint8_t *const *src, unsigned int n,
+                  unsigned int len) {
+  uint8_t want[64];
+
+  for (unsigned int i=0; i<n; ++i) {
+    sha3_fns[t].hash(want, src[i], len);
+    if (memcmp(want, dest[i], sha3_fns[t].digestLen) != 0) {
+      printf("[%s] FAIL at message %u\n", name, i);
+      failures++;
+      return;
+    }
+  }
+  printf("[%s] OK\n", name);
+}
+
+void test_multibuffer(void) {
+  // a single message, part of a group, whole groups and leftovers
+  static const unsigned int counts[] = { 1, 2, 5, 8, 13, 19 };
+  uint8_t buf[19*13 + 2*144], digest[19][64];
+  const uint8_t *src[19];
+  uint8_t *dest[19];
+  char name[64];
+
+  // each a different message, 13 bytes on from the one before
+  ptn(buf, sizeof buf);
+  for (int i=0; i<19; ++i) {
+    src[i] = buf + 13*i;
+    dest[i] = digest[i];
+  }
+  for (size_t t=0; t<sizeof sha3_fns / sizeof sha3_fns[0]; ++t) {
+    for (int l=0; l<5; ++l) {
+      unsigned int len = rate_len(sha3_fns[t].r, l);
+
+      memset(digest, 0, sizeof digest);
+      sha3_fns[t].hash4(dest, src, len);
+      sprintf(name, "%s HashBuf4 %u, %s", sha3_fns[t].name, len,
+              SHA3_GetBackend());
+      compare_many(name, t, dest, src, 4, len);
+
+      memset(digest, 0, sizeof digest);
+      sha3_fns[t].hash8(dest, src, len);
+      sprintf(name, "%s HashBuf8 %u, %s", sha3_fns[t].name, len,
+              SHA3_GetBackend());
+      compare_many(name, t, dest, src, 8, len);
+
+      for (size_t c=0; c<sizeof counts / sizeof counts[0]; ++c) {
+        memset(digest, 0, sizeof digest);
+        sha3_fns[t].many(dest, src, counts[c], len);
+        sprintf(name, "%s HashBufMany %u x %u, %s", sha3_fns[t].name,
+                counts[c], len, SHA3_GetBackend());
+        compare_many(name, t, dest, src, counts[c], len);
+      }
+    }
+  }
+}
+
+// SHA3_HashBatch over messages of mixed lengths, 0 to 4r, and for SHAKE
+// outputs of mixed lengths, against the one-shot hashes; run under each
+// backend too, for the lane scheduling and the scalar leftovers.
+void test_hashbatch(void) {
+  static const struct {
+    SHA3Type type;
+    const char *name;
+    unsigned int r;
+    void (*shake)(const unsigned char *, unsigned int, unsigned char *,
+                  unsigned int);
+  } types[] = {
+    { SHA3_TYPE_224, "SHA3-224", 144, NULL },
+    { SHA3_TYPE_256, "SHA3-256", 136, NULL },
+    { SHA3_TYPE_384, "SHA3-384", 104, NULL },
+    { SHA3_TYPE_512, "SHA3-512", 72, NULL },
+    { SHA3_TYPE_SHAKE128, "SHAKE128", 168, SHAKE128 },
+    { SHA3_TYPE_SHAKE256, "SHAKE256", 136, SHAKE256 },
+  };
+  enum { JOBS = 23 };
+  uint8_t buf[JOBS*13 + 4*168], out[JOBS][400], want[400];
+  SHA3Job jobs[JOBS];
+  SHA3BatchStats stats;
+  char name[48];
+
+  ptn(buf, sizeof buf);
+  for (size_t t=0; t<sizeof types / sizeof types[0]; ++t) {
+    unsigned int i;
+
+    memset(out, 0, sizeof out);
+    for (i=0; i<JOBS; ++i) {
+      jobs[i].src = buf + 13*i;
+      jobs[i].srcLen = (i*i*29) % (4*types[t].r + 1);
+      jobs[i].dest = out[i];
+      jobs[i].destLen = types[t].shake ? 1 + (i*71) % 400 : 0;
+    }
+    sprintf(name, "%s HashBatch, %s", types[t].name, SHA3_GetBackend());
+    if (SHA3_HashBatch(types[t].type, jobs, JOBS, &stats) != SECSuccess ||
+        stats.jobs != JOBS || stats.busyLanes > stats.lanes) {
+      printf("[%s] FAIL\n", name);
+      failures++;
+      continue;
+    }
+    for (i=0; i<JOBS; ++i) {
+      unsigned int len = types[t].shake ? jobs[i].destLen
+                                        : sha3_fns[t].digestLen;
+
+      if (types[t].shake) {
+        types[t].shake(jobs[i].src, jobs[i].srcLen, want, len);
+      } else {
+        sha3_fns[t].hash(want, jobs[i].src, jobs[i].srcLen);
+      }
+      if (memcmp(want, out[i], len) != 0) {
+        break;
+      }
+    }
+    if (i != JOBS) {
+      printf("[%s] FAIL at job %u\n", name, i);
+      failures++;
+    } else {
+      printf("[%s] OK\n", name);
+    }
+  }
+}
+
+// Streams for the interleaved tests: stream k of sha3_fns[t] hashes
+// stream_len bytes of ptn from offset 17*k, given in chunks of 1, 7, r-1,
+// r, 2r+5 and 0 bytes in turn; the digests are checked against one
+// context that takes the whole message in one update.
+enum { STREAMS = 11 };
+
+static unsigned int stream_len(size_t t, unsigned int k) {
+  return (k*k*53 + 11*k) % (5*sha3_fns[t].r);
+}
+
+static unsigned int chunk_len(size_t t, unsigned int k, unsigned int j) {
+  unsigned int r = sha3_fns[t].r;
+  unsigned int sizes[6] = { 1, 7, r - 1, r, 2*r + 5, 0 };
+
+  return sizes[(k + j) % 6];
+}
+
+void context_digest(size_t t, const uint8_t *msg, unsigned int len,
+                    uint8_t *digest) {
+  SHA3Context *ctx = SHA3_NewContext();
+  unsigned int digestLen;
+
+  SHA3_Begin(ctx);
+  sha3_fns[t].update(ctx, msg, len);
+  sha3_fns[t].end(ctx, digest, &digestLen, 64);
+  SHA3_DestroyContext(ctx, PR_TRUE);
+}
+
+// a job test_jobmanager got back; returns 1 if it was the stream's last
+int job_done(const char *name, size_t t, SHA3HashJob *job,
+             const uint8_t *buf, PRBool *held) {
+  unsigned int k = (uintptr_t)job->user;
+  uint8_t want[64];
+
+  if (!held[k] || job->status != SHA3_JOB_COMPLETE) {
+    printf("[%s] FAIL, stream %u not complete\n", name, k);
+    failures++;
+  }
+  held[k] = PR_FALSE;
+  if (!job->digestLen) {
+    return 0;
+  }
+  context_digest(t, buf + 17*k, stream_len(t, k), want);
+  if (job->digestLen != sha3_fns[t].digestLen ||
+      memcmp(want, job->digest, job->digestLen) != 0) {
+    printf("[%s] FAIL, stream %u\n", name, k);
+    failures++;
+  }
+  return 1;
+}
+
+// The job manager, with every stream's next chunk submitted as soon as
+// its job is back from the manager, and a flush whenever none is.
+void test_jobmanager(void) {
+  uint8_t buf[17*STREAMS + 5*144];
+  char name[48];
+
+  ptn(buf, sizeof buf);
+  for (size_t t=0; t<sizeof sha3_fns / sizeof sha3_fns[0]; ++t) {
+    SHA3JobManager *mgr = SHA3_NewJobManager((SHA3Type)t);
+    SHA3Context *ctx[STREAMS];
+    SHA3HashJob jobs[STREAMS], *job;
+    unsigned int off[STREAMS], chunk[STREAMS], done = 0, fails = failures;
+    PRBool held[STREAMS];       // the job belongs to the manager
+
+    sprintf(name, "%s job manager, %s", sha3_fns[t].name, SHA3_GetBackend());
+    memset(jobs, 0, sizeof jobs);
+    for (unsigned int k=0; k<STREAMS; ++k) {
+      ctx[k] = SHA3_NewContext();
+      jobs[k].ctx = ctx[k];
+      jobs[k].user = (void *)(uintptr_t)k;
+      jobs[k].status = SHA3_JOB_IDLE;
+      off[k] = chunk[k] = 0;
+      held[k] = PR_FALSE;
+    }
+    while (done < STREAMS) {
+      PRBool submitted = PR_FALSE;
+
+      for (unsigned int k=0; k<STREAMS; ++k) {
+        unsigned int len = stream_len(t, k), n, flags = SHA3_JOB_UPDATE;
+
+        if (held[k] || off[k] > len) {
+          continue;
+        }
+        n = chunk_len(t, k, chunk[k]++);
+        n = off[k] + n > len ? len - off[k] : n;
+        if (off[k] == 0 && chunk[k] == 1) {
+          flags |= SHA3_JOB_FIRST;
+        }
+        if (off[k] + n == len) {
+          flags |= SHA3_JOB_LAST;
+        }
+        held[k] = PR_TRUE;
+        job = SHA3_SubmitJob(mgr, &jobs[k], buf + 17*k + off[k], n, flags);
+        // past the end once the last chunk is in
+        off[k] += (flags & SHA3_JOB_LAST) ? n + 1 : n;
+        submitted = PR_TRUE;
+        if (job) {
+          done += job_done(name, t, job, buf, held);
+        }
+      }
+      if (!submitted) {
+        job = SHA3_FlushJobs(mgr);
+        if (!job) {
+          printf("[%s] FAIL, %u streams lost\n", name, STREAMS - done);
+          failures++;
+          break;
+        }
+        done += job_done(name, t, job, buf, held);
+      }
+    }
+    if (SHA3_FlushJobs(mgr) != NULL) {
+      printf("[%s] FAIL, jobs left over\n", name);
+      failures++;
+    }
+    if (failures == fails) {
+      printf("[%s] OK\n", name);
+    }
+    for (unsigned int k=0; k<STREAMS; ++k) {
+      SHA3_DestroyContext(ctx[k], PR_TRUE);
+    }
+    SHA3_DestroyJobManager(mgr);
+  }
+}
+
+// The scheduler: the streams' contexts take their chunks in turn, with a
+// flush along the way, then a second message each after SHA3_Begin, which
+// they stay attached across.
+void test_scheduler(void) {
+  uint8_t buf[17*STREAMS + 5 + 5*144], want[64], digest[64];
+  unsigned int digestLen;
+  char name[48];
+
+  ptn(buf, sizeof buf);
+  for (size_t t=0; t<sizeof sha3_fns / sizeof sha3_fns[0]; ++t) {
+    SHA3Scheduler *sched = SHA3_NewScheduler((SHA3Type)t);
+    SHA3Context *ctx[STREAMS];
+    int fails = failures;
+
+    sprintf(name, "%s scheduler, %s", sha3_fns[t].name, SHA3_GetBackend());
+    for (unsigned int k=0; k<STREAMS; ++k) {
+      ctx[k] = SHA3_NewContext();
+      SHA3_SetScheduler(ctx[k], sched);
+    }
+    for (unsigned int pass=0; pass<2; ++pass) {
+      unsigned int off[STREAMS], more = STREAMS;
+
+      for (unsigned int k=0; k<STREAMS; ++k) {
+        SHA3_Begin(ctx[k]);
+        off[k] = 0;
+      }
+      for (unsigned int j=0; more; ++j) {
+        more = 0;
+        for (unsigned int k=0; k<STREAMS; ++k) {
+          unsigned int len = stream_len(t, k + pass*STREAMS);
+          unsigned int n = chunk_len(t, k, j);
+
+          n = off[k] + n > len ? len - off[k] : n;
+          sha3_fns[t].update(ctx[k], buf + 17*k + 5*pass + off[k], n);
+          off[k] += n;
+          more += off[k] < len;
+        }
+        if (j == 3) {
+          SHA3_FlushScheduler(sched);
+        }
+      }
+      for (unsigned int k=0; k<STREAMS; ++k) {
+        sha3_fns[t].end(ctx[k], digest, &digestLen, sizeof digest);
+        context_digest(t, buf + 17*k + 5*pass, off[k], want);
+        if (memcmp(want, digest, sha3_fns[t].digestLen) != 0) {
+          printf("[%s] FAIL, stream %u, message %u\n", name, k, pass + 1);
+          failures++;
+        }
+      }
+    }
+    if (failures == fails) {
+      printf("[%s] OK\n", name);
+    }
+    for (unsigned int k=0; k<STREAMS; ++k) {
+      SHA3_DestroyContext(ctx[k], PR_TRUE);
+    }
+    SHA3_DestroyScheduler(sched);
+  }
+}
+
+// An update of nearly 4 GiB to a context whose block is queued with a
+// tail of 20 bytes, which once wrapped the check for an update that can
+// wait with the tail; the other context shares the queue. The value is
+// hashlib's SHA3-256 of ptn(156) and 0xFFFFFFF0 zero bytes.
+void test_scheduler_long(void) {
+  SHA3Scheduler *sched = SHA3_NewScheduler(SHA3_TYPE_256);
+  SHA3Context *ctx[2];
+  uint8_t buf[136 + 20], want[32], digest[32];
+  unsigned int digestLen, zerosLen = 0xFFFFFFF0u;
+  const uint8_t *zeros;
+
+  zeros = mmap(NULL, zerosLen, PROT_READ,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (zeros == MAP_FAILED) {
+    printf("SHA3-256 scheduler, 4 GiB update: SKIPPED (no address space)\n");
+    SHA3_DestroyScheduler(sched);
+    return;
+  }
+  ptn(buf, sizeof buf);
+  for (int i=0; i<2; ++i) {
+    ctx[i] = SHA3_NewContext();
+    SHA3_SetScheduler(ctx[i], sched);
+    SHA3_Begin(ctx[i]);
+    SHA3_256_Update(ctx[i], buf, 135);
+    SHA3_256_Update(ctx[i], buf + 135, 21);
+  }
+  SHA3_256_Update(ctx[0], zeros, zerosLen);
+  SHA3_256_End(ctx[0], digest, &digestLen, sizeof digest);
+  check("SHA3-256 scheduler, 4 GiB update",
+        "f6ff1114b7b38443304c6e5a021b46969b1dc098e88cae76c8998945288da3a0",
+        digest, 32);
+  SHA3_256_End(ctx[1], digest, &digestLen, sizeof digest);
+  context_digest(1, buf, sizeof buf, want);
+  compare("SHA3-256 scheduler, queue mate", want, digest, 32);
+  for (int i=0; i<2; ++i) {
+    SHA3_DestroyContext(ctx[i], PR_TRUE);
+  }
+  SHA3_DestroyScheduler(sched);
+  munmap((void *)zeros, zerosLen);
+}
+
+// The context table: more streams than it has tail slots, updated in turn
+// in chunks, then a second message on each handle after SHA3_TableEnd, and
+// a third after a third of the handles are closed mid-message and opened
+// again. The messages are a block and 3 bytes longer than the streams'
+// of the other tests, and that is their first chunk, which leaves every
+// stream owed a permutation with input waiting in a tail, so the table
+// runs out of slots.
+void test_table(void) {
+  enum { TSTREAMS = 300 };
+  static uint8_t buf[13*TSTREAMS + 10 + 6*144 + 3];
+  unsigned int h[TSTREAMS], extra, digestLen;
+  uint8_t want[64], digest[64];
+  char name[48];
+
+  ptn(buf, sizeof buf);
+  for (size_t t=0; t<sizeof sha3_fns / sizeof sha3_fns[0]; ++t) {
+    SHA3Table *table = SHA3_NewTable((SHA3Type)t, TSTREAMS);
+    int fails = failures;
+
+    sprintf(name, "%s table, %s", sha3_fns[t].name, SHA3_GetBackend());
+    for (unsigned int k=0; k<TSTREAMS; ++k) {
+      SHA3_TableOpen(table, &h[k]);
+    }
+    if (SHA3_TableOpen(table, &extra) != SECFailure) {
+      printf("[%s] FAIL, opened past capacity\n", name);
+      failures++;
+    }
+    for (unsigned int pass=0; pass<3; ++pass) {
+      unsigned int off[TSTREAMS], more = TSTREAMS;
+
+      if (pass == 2) {
+        for (unsigned int k=0; k<TSTREAMS; k+=3) {
+          SHA3_TableUpdate(table, h[k], buf, 5);
+          SHA3_TableClose(table, h[k]);
+        }
+        for (unsigned int k=0; k<TSTREAMS; k+=3) {
+          SHA3_TableOpen(table, &h[k]);
+        }
+      }
+      memset(off, 0, sizeof off);
+      for (unsigned int j=0; more; ++j) {
+        more = 0;
+        for (unsigned int k=0; k<TSTREAMS; ++k) {
+          unsigned int len = sha3_fns[t].r + 3 +
+                             stream_len(t, k + pass*TSTREAMS);
+          unsigned int n = j ? chunk_len(t, k, j) : sha3_fns[t].r + 3;
+
+          n = off[k] + n > len ? len - off[k] : n;
+          SHA3_TableUpdate(table, h[k], buf + 13*k + 5*pass + off[k], n);
+          off[k] += n;
+          more += off[k] < len;
+        }
+        if (j == 2) {
+          SHA3_TableFlush(table);
+        }
+      }
+      for (unsigned int k=0; k<TSTREAMS; ++k) {
+        SHA3_TableEnd(table, h[k], digest, &digestLen, sizeof digest);
+        context_digest(t, buf + 13*k + 5*pass, off[k], want);
+        if (digestLen != sha3_fns[t].digestLen ||
+            memcmp(want, digest, digestLen) != 0) {
+          printf("[%s] FAIL, stream %u, message %u\n", name, k, pass + 1);
+          failures++;
+        }
+      }
+    }
+    if (failures == fails) {
+      printf("[%s] OK\n", name);
+    }
+    SHA3_DestroyTable(table);
+  }
+}
+
+// SHA3_Clone and prefixes: the first lp bytes of buf go into one context,
+// which is then cloned, or frozen as a prefix, and each copy hashes the
+// next ls bytes; the digest must be that of the lp+ls bytes. The clones
+// are made from and into contexts with a block queued in a scheduler.
+void test_clone_prefix(void) {
+  static const unsigned int ls[3] = { 0, 9, 300 };
+  uint8_t buf[3*144 + 300], want[64], digest[64], out[8][64];
+  unsigned int digestLen;
+  SHA3Job jobs[8];
+  char name[48];
+
+  ptn(buf, sizeof buf);
+  for (size_t t=0; t<sizeof sha3_fns / sizeof sha3_fns[0]; ++t) {
+    unsigned int r = sha3_fns[t].r, dlen = sha3_fns[t].digestLen;
+    unsigned int lps[6] = { 0, 5, r - 1, r, r + 7, 2*r };
+    SHA3Scheduler *sched = SHA3_NewScheduler((SHA3Type)t);
+    SHA3Context *src = SHA3_NewContext(), *dest = SHA3_NewContext();
+    SHA3Context *mate = SHA3_NewContext();
+    int fails = failures;
+
+    sprintf(name, "%s clone and prefix, %s", sha3_fns[t].name,
+            SHA3_GetBackend());
+    for (int p=0; p<6; ++p) {
+      unsigned int lp = lps[p];
+      SHA3Prefix *prefix;
+      SHA3BatchStats stats;
+
+      for (int i=0; i<3; ++i) {
+        // src and dest each with a block queued, and another context in
+        // the queue with them
+        SHA3_SetScheduler(src, sched);
+        SHA3_SetScheduler(dest, sched);
+        SHA3_SetScheduler(mate, sched);
+        SHA3_Begin(src);
+        SHA3_Begin(dest);
+        SHA3_Begin(mate);
+        sha3_fns[t].update(mate, buf, r + 1);
+        sha3_fns[t].update(dest, buf, r + 2);
+        sha3_fns[t].update(src, buf, lp);
+
+        SHA3_Clone(dest, src);
+        sha3_fns[t].update(src, buf + lp, ls[i]);
+        sha3_fns[t].update(dest, buf + lp, ls[i]);
+
+        // the queue runs before dest is done, and mustn't take dest along
+        sha3_fns[t].end(mate, digest, &digestLen, sizeof digest);
+        context_digest(t, buf, r + 1, want);
+        if (memcmp(want, digest, dlen) != 0) {
+          printf("[%s] FAIL, queue mate of %u + %u\n", name, lp, ls[i]);
+          failures++;
+        }
+        context_digest(t, buf, lp + ls[i], want);
+        sha3_fns[t].end(dest, digest, &digestLen, sizeof digest);
+        if (memcmp(want, digest, dlen) != 0) {
+          printf("[%s] FAIL, clone of %u + %u\n", name, lp, ls[i]);
+          failures++;
+        }
+        sha3_fns[t].end(src, digest, &digestLen, sizeof digest);
+        if (memcmp(want, digest, dlen) != 0) {
+          printf("[%s] FAIL, source of %u + %u\n", name, lp, ls[i]);
+          failures++;
+        }
+      }
+      SHA3_SetScheduler(src, NULL);
+      SHA3_SetScheduler(dest, NULL);
+      SHA3_SetScheduler(mate, NULL);
+
+      SHA3_Begin(src);
+      sha3_fns[t].update(src, buf, lp);
+      prefix = SHA3_NewPrefix(src);
+      for (int i=0; i<3; ++i) {
+        SHA3_PrefixBegin(dest, prefix);
+        sha3_fns[t].update(dest, buf + lp, ls[i]);
+        sha3_fns[t].end(dest, digest, &digestLen, sizeof digest);
+        context_digest(t, buf, lp + ls[i], want);
+        if (memcmp(want, digest, dlen) != 0) {
+          printf("[%s] FAIL, prefix of %u + %u\n", name, lp, ls[i]);
+          failures++;
+        }
+      }
+
+      // a batch from the prefix, which has to end on a block boundary
+      for (int i=0; i<8; ++i) {
+        jobs[i].src = buf + lp;
+        jobs[i].srcLen = (i*i*37) % 300;
+        jobs[i].dest = out[i];
+        jobs[i].destLen = 0;
+      }
+      if (SHA3_PrefixHashBatch(prefix, (SHA3Type)t, jobs, 8, &stats) !=
+          (lp % r ? SECFailure : SECSuccess)) {
+        printf("[%s] FAIL, prefix batch of %u\n", name, lp);
+        failures++;
+      } else if (lp % r == 0) {
+        for (int i=0; i<8; ++i) {
+          context_digest(t, buf, lp + jobs[i].srcLen, want);
+          if (memcmp(want, out[i], dlen) != 0) {
+            printf("[%s] FAIL, prefix batch of %u + %u\n", name, lp,
+                   jobs[i].srcLen);
+            failures++;
+          }
+        }
+      }
+      SHA3_DestroyPrefix(prefix);
+    }
+    if (failures == fails) {
+      printf("[%s] OK\n", name);
+    }
+    SHA3_DestroyContext(src, PR_TRUE);
+    SHA3_DestroyContext(dest, PR_TRUE);
+    SHA3_DestroyContext(mate, PR_TRUE);
+    SHA3_DestroyScheduler(sched);
+  }
+}
+
+// Checkpoints: saved after 0, 1, r-1, r, r+1 and 2r+3 bytes of a message
+// (from a context in a scheduler, with a block queued in some of them),
+// loaded into another context that hashes the rest. The format is checked
+// on SHA3-256 of "abc", whose state is still the bytes themselves, and
+// SHAKE and damaged checkpoints must be refused.
+void test_checkpoint(void) {
+  uint8_t buf[2*144 + 10], want[64], digest[64];
+  uint8_t space[SHA3_CHECKPOINT_LEN + 1], bad[SHA3_CHECKPOINT_LEN];
+  unsigned int digestLen;
+  SHA3Context *ctx = SHA3_NewContext(), *resumed = SHA3_NewContext();
+  SHA3Type type;
+  char name[48];
+  int fails;
+
+  ptn(buf, sizeof buf);
+  for (size_t t=0; t<sizeof sha3_fns / sizeof sha3_fns[0]; ++t) {
+    unsigned int r = sha3_fns[t].r, len = 2*r + 10;
+    unsigned int splits[6] = { 0, 1, r - 1, r, r + 1, 2*r + 3 };
+    SHA3Scheduler *sched = SHA3_NewScheduler((SHA3Type)t);
+    SHA3Context *mate = SHA3_NewContext();
+
+    fails = failures;
+    sprintf(name, "%s checkpoint, %s", sha3_fns[t].name, SHA3_GetBackend());
+    context_digest(t, buf, len, want);
+    SHA3_SetScheduler(ctx, sched);
+    SHA3_SetScheduler(mate, sched);
+    for (int i=0; i<6; ++i) {
+      SHA3_Begin(mate);
+      sha3_fns[t].update(mate, buf, r + 1);
+      SHA3_Begin(ctx);
+      sha3_fns[t].update(ctx, buf, splits[i]);
+      if (SHA3_SaveCheckpoint(ctx, (SHA3Type)t, space, sizeof space) !=
+            SECSuccess ||
+          space[0] != SHA3_CHECKPOINT_VERSION || space[1] != r ||
+          space[3] != splits[i] % r ||
+          SHA3_LoadCheckpoint(resumed, &type, space, SHA3_CHECKPOINT_LEN) !=
+            SECSuccess || type != (SHA3Type)t) {
+        printf("[%s] FAIL, at %u\n", name, splits[i]);
+        failures++;
+        continue;
+      }
+      sha3_fns[t].update(resumed, buf + splits[i], len - splits[i]);
+      sha3_fns[t].end(resumed, digest, &digestLen, sizeof digest);
+      if (memcmp(want, digest, sha3_fns[t].digestLen) != 0) {
+        printf("[%s] FAIL, resumed at %u\n", name, splits[i]);
+        failures++;
+      }
+    }
+    SHA3_SetScheduler(ctx, NULL);
+    SHA3_DestroyContext(mate, PR_TRUE);
+    SHA3_DestroyScheduler(sched);
+    if (failures == fails) {
+      printf("[%s] OK\n", name);
+    }
+  }
+
+  fails = failures;
+  SHA3_Begin(ctx);
+  SHA3_256_Update(ctx, (const uint8_t *)"abc", 3);
+  // version 1, rate 136, domain 06, 3 bytes in, then the state
+  memset(bad, 0, sizeof bad);
+  memcpy(bad, "\x01\x88\x06\x03" "abc", 7);
+  if (SHA3_SaveCheckpoint(ctx, SHA3_TYPE_256, space, SHA3_CHECKPOINT_LEN) !=
+        SECSuccess || memcmp(space, bad, SHA3_CHECKPOINT_LEN) != 0) {
+    printf("[checkpoint format] FAIL\n");
+    failures++;
+  }
+
+  // what isn't a SHA3 checkpoint
+  if (SHA3_SaveCheckpoint(ctx, SHA3_TYPE_SHAKE128, space, sizeof space) !=
+        SECFailure ||
+      SHA3_SaveCheckpoint(ctx, SHA3_TYPE_SHAKE256, space, sizeof space) !=
+        SECFailure ||
+      SHA3_SaveCheckpoint(ctx, SHA3_TYPE_256, space,
+                          SHA3_CHECKPOINT_LEN - 1) != SECFailure) {
+    printf("[checkpoint of SHAKE or too short] FAIL\n");
+    failures++;
+  }
+  SHA3_SaveCheckpoint(ctx, SHA3_TYPE_256, space, SHA3_CHECKPOINT_LEN);
+  for (int i=0; i<6; ++i) {
+    static const struct { int at, value; } damage[6] = {
+      { 0, 0 }, { 0, SHA3_CHECKPOINT_VERSION + 1 }, { 1, 168 }, { 1, 100 },
+      { 2, 0x1f }, { 3, 136 }
+    };
+
+    memcpy(bad, space, sizeof bad);
+    bad[damage[i].at] = damage[i].value;
+    if (SHA3_LoadCheckpoint(resumed, &type, bad, sizeof bad) != SECFailure) {
+      printf("[checkpoint damage %d] FAIL\n", i);
+      failures++;
+    }
+  }
+  if (SHA3_LoadCheckpoint(resumed, &type, space, SHA3_CHECKPOINT_LEN - 1) !=
+      SECFailure) {
+    printf("[short checkpoint] FAIL\n");
+    failures++;
+  }
+  if (failures == fails) {
+    printf("[checkpoint format and refusals] OK\n");
+  }
+  SHA3_DestroyContext(ctx, PR_TRUE);
+  SHA3_DestroyContext(resumed, PR_TRUE);
+}
+
 int main() {
   unsigned int digestLen;
   uint8_t digest[MAX_DIGEST_SIZE];
   SHA3Context *ctx = SHA3_NewContext();
 
   SHA3_224_Begin(ctx);
-  SHA3_Update(ctx, message_short, MESSAGE_LEN_SHORT);
-  SHA3_End(ctx, digest, &digestLen, MAX_DIGEST_SIZE);
+  SHA3_224_Update(ctx, message_short, MESSAGE_LEN_SHORT);
+  SHA3_224_End(ctx, digest, &digestLen, MAX_DIGEST_SIZE);
   hexcmp(d224, digest, digestLen);
 
   SHA3_256_Begin(ctx);
-  SHA3_Update(ctx, message_short, MESSAGE_LEN_SHORT);
-  SHA3_End(ctx, digest, &digestLen, MAX_DIGEST_SIZE);
+  SHA3_256_Update(ctx, message_short, MESSAGE_LEN_SHORT);
+  SHA3_256_End(ctx, digest, &digestLen, MAX_DIGEST_SIZE);
   hexcmp(d256, digest, digestLen);
 
   SHA3_384_Begin(ctx);
-  SHA3_Update(ctx, message_short, MESSAGE_LEN_SHORT);
-  SHA3_End(ctx, digest, &digestLen, MAX_DIGEST_SIZE);
+  SHA3_384_Update(ctx, message_short, MESSAGE_LEN_SHORT);
+  SHA3_384_End(ctx, digest, &digestLen, MAX_DIGEST_SIZE);
   hexcmp(d384, digest, digestLen);
 
-  SHA3_256_Begin(ctx);
-  SHA3_Update(ctx, message_short, MESSAGE_LEN_SHORT);
-  SHA3_End(ctx, digest, &digestLen, MAX_DIGEST_SIZE);
-  hexcmp(d256, digest, digestLen);
+  SHA3_512_Begin(ctx);
+  SHA3_512_Update(ctx, message_short, MESSAGE_LEN_SHORT);
+  SHA3_512_End(ctx, digest, &digestLen, MAX_DIGEST_SIZE);
+  hexcmp(d512, digest, digestLen);
 
   SHA3_DestroyContext(ctx, PR_TRUE);
-  return 0;
+
+  test_multibuffer();
+  test_hashbatch();
+  test_jobmanager();
+  test_scheduler();
+  test_scheduler_long();
+  test_table();
+  test_clone_prefix();
+  test_checkpoint();
+  test_hmac();
+  test_cshake_kmac();
+  test_shake();
+  test_k12();
+  test_shake_multi();
+  test_parallelhash();
+  test_tuplehash();
+  return failures != 0;
 }
@@ -0,0 +1,379 @@
+/*
+ * hmac.c - HMAC over SHA3 and SHA2, with the padded key states saved
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "hmac.h"
+
+/*** BEGIN NSPR polyfill ***/
+#define PORT_Alloc(x) malloc(x)
+#define PORT_ZAlloc(x) calloc(1,x)
+#define PORT_Memset(x,y,z) memset(x,y,z)
+/*** END NSPR polyfill ***/
+
+#define HMAC_PAD_SIZE   144     /* largest block: the SHA3-224 rate */
+#define HMAC_MAX_LENGTH 64
+
+#define HMAC_IPAD 0x36
+#define HMAC_OPAD 0x5c
+
+/*
+ * The hash functions, the way freebl's SECHashObject describes them. For
+ * SHA3 the block length is the rate, as in FIPS 202 / SP 800-224.
+ */
+typedef struct {
+    unsigned int length;
+    unsigned int blockLength;
+    int sha3;                           /* SHA3Type, or -1 for SHA2 */
+    void *(*create)(void);
+    void (*destroy)(void *cx, PRBool freeit);
+    void (*begin)(void *cx);
+    void (*update)(void *cx, const unsigned char *input,
+                   unsigned int inputLen);
+    void (*end)(void *cx, unsigned char *digest, unsigned int *digestLen,
+                unsigned int maxDigestLen);
+    void (*clone)(void *dest, void *src);
+} hmac_hash;
+
+#define HMAC_SHA3_HASH(bits, rate) \
+    { bits/8, rate, SHA3_TYPE_##bits,                                   \
+      (void *(*)(void))SHA3_NewContext,                                 \
+      (void (*)(void *, PRBool))SHA3_DestroyContext,                    \
+      (void (*)(void *))SHA3_Begin,                                     \
+      (void (*)(void *, const unsigned char *, unsigned int))           \
+            SHA3_##bits##_Update,                                       \
+      (void (*)(void *, unsigned char *, unsigned int *, unsigned int)) \
+            SHA3_##bits##_End,                                          \
+      (void (*)(void *, void *))SHA3_Clone }
+
+#define HMAC_SHA2_HASH(bits) \
+    { SHA##bits##_LENGTH, SHA##bits##_BLOCK_LENGTH, -1,                 \
+      (void *(*)(void))SHA##bits##_NewContext,                          \
+      (void (*)(void *, PRBool))SHA##bits##_DestroyContext,             \
+      (void (*)(void *))SHA##bits##_Begin,                              \
+      (void (*)(void *, const unsigned char *, unsigned int))           \
+            SHA##bits##_Update,                                         \
+      (void (*)(void *, unsigned char *, unsigned int *, unsigned int)) \
+            SHA##bits##_End,                                            \
+      (void (*)(void *, void *))SHA##bits##_Clone }
+
+static const hmac_hash hmac_hashes[] = {
+    HMAC_SHA3_HASH(224, 144),
+    HMAC_SHA3_HASH(256, 136),
+    HMAC_SHA3_HASH(384, 104),
+    HMAC_SHA3_HASH(512, 72),
+    HMAC_SHA2_HASH(256),
+    HMAC_SHA2_HASH(512),
+};
+
+struct HMACKeyStr {
+    const hmac_hash *hash;
+    void *inner;                /* after K^ipad */
+    void *outer;                /* after K^opad */
+    SHA3Prefix *innerPrefix;    /* the same two, for SHA3 batches */
+    SHA3Prefix *outerPrefix;
+};
+
+struct HMACContextStr {
+    const HMACKey *key;
+    void *cx;
+};
+
+/* a hash state that has absorbed the key, padded to a block, XOR pad */
+static void *
+hmac_pad_state(const hmac_hash *hash, const unsigned char *K,
+               unsigned char pad)
+{
+    unsigned char block[HMAC_PAD_SIZE];
+    unsigned int i;
+    void *cx = hash->create();
+
+    if (cx) {
+        for (i=0; i < hash->blockLength; i++) {
+            block[i] = K[i] ^ pad;
+        }
+        hash->begin(cx);
+        hash->update(cx, block, hash->blockLength);
+        PORT_Memset(block, 0, sizeof block);
+    }
+    return cx;
+}
+
+HMACKey *
+HMAC_NewKey(HMACHashType type, const unsigned char *secret,
+            unsigned int secretLen)
+{
+    unsigned char K[HMAC_PAD_SIZE];
+    const hmac_hash *hash;
+    unsigned int len;
+    HMACKey *key;
+    void *cx;
+
+    if ((unsigned int)type >= sizeof(hmac_hashes)/sizeof(hmac_hashes[0])) {
+        return NULL;
+    }
+    hash = &hmac_hashes[type];
+    key = PORT_ZAlloc(sizeof(*key));
+    if (!key) {
+        return NULL;
+    }
+    key->hash = hash;
+
+    /* keys longer than a block are hashed first */
+    PORT_Memset(K, 0, sizeof K);
+    if (secretLen > hash->blockLength) {
+        cx = hash->create();
+        if (!cx) {
+            goto loser;
+        }
+        hash->begin(cx);
+        hash->update(cx, secret, secretLen);
+        hash->end(cx, K, &len, hash->length);
+        hash->destroy(cx, PR_TRUE);
+    } else {
+        PORT_Memcpy(K, secret, secretLen);
+    }
+
+    key->inner = hmac_pad_state(hash, K, HMAC_IPAD);
+    key->outer = hmac_pad_state(hash, K, HMAC_OPAD);
+    PORT_Memset(K, 0, sizeof K);
+    if (!key->inner || !key->outer) {
+        goto loser;
+    }
+    if (hash->sha3 >= 0) {
+        key->innerPrefix = SHA3_NewPrefix(key->inner);
+        key->outerPrefix = SHA3_NewPrefix(key->outer);
+        if (!key->innerPrefix || !key->outerPrefix) {
+            goto loser;
+        }
+    }
+    return key;
+
+loser:
+    HMAC_DestroyKey(key);
+    return NULL;
+}
+
+void
+HMAC_DestroyKey(HMACKey *key)
+{
+    if (key->inner) {
+        key->hash->destroy(key->inner, PR_TRUE);
+    }
+    if (key->outer) {
+        key->hash->destroy(key->outer, PR_TRUE);
+    }
+    if (key->innerPrefix) {
+        SHA3_DestroyPrefix(key->innerPrefix);
+    }
+    if (key->outerPrefix) {
+        SHA3_DestroyPrefix(key->outerPrefix);
+    }
+    PORT_Memset(key, 0, sizeof(*key));
+    PORT_Free(key);
+}
+
+unsigned int
+HMAC_Length(const HMACKey *key)
+{
+    return key->hash->length;
+}
+
+HMACContext *
+HMAC_NewContext(const HMACKey *key)
+{
+    HMACContext *cx = PORT_ZAlloc(sizeof(*cx));
+
+    if (!cx) {
+        return NULL;
+    }
+    cx->key = key;
+    cx->cx = key->hash->create();
+    if (!cx->cx) {
+        PORT_Free(cx);
+        return NULL;
+    }
+    HMAC_Begin(cx);
+    return cx;
+}
+
+void
+HMAC_DestroyContext(HMACContext *cx, PRBool freeit)
+{
+    cx->key->hash->destroy(cx->cx, PR_TRUE);
+    PORT_Memset(cx, 0, sizeof(*cx));
+    if (freeit) {
+        PORT_Free(cx);
+    }
+}
+
+void
+HMAC_Begin(HMACContext *cx)
+{
+    cx->key->hash->clone(cx->cx, cx->key->inner);
+}
+
+void
+HMAC_Update(HMACContext *cx, const unsigned char *data, unsigned int dataLen)
+{
+    cx->key->hash->update(cx->cx, data, dataLen);
+}
+
+SECStatus
+HMAC_Finish(HMACContext *cx, unsigned char *result, unsigned int *resultLen,
+            unsigned int maxResultLen)
+{
+    const hmac_hash *hash = cx->key->hash;
+    unsigned char inner[HMAC_MAX_LENGTH];
+    unsigned int len;
+
+    if (maxResultLen < hash->length) {
+        return SECFailure;
+    }
+    hash->end(cx->cx, inner, &len, hash->length);
+    hash->clone(cx->cx, cx->key->outer);
+    hash->update(cx->cx, inner, len);
+    hash->end(cx->cx, result, resultLen, hash->length);
+    PORT_Memset(inner, 0, sizeof inner);
+    return SECSuccess;
+}
+
+SECStatus
+HMAC_Compute(const HMACKey *key, unsigned char *result,
+             unsigned int *resultLen, unsigned int maxResultLen,
+             const unsigned char *data, unsigned int dataLen)
+{
+    HMACContext *cx = HMAC_NewContext(key);
+    SECStatus rv;
+
+    if (!cx) {
+        return SECFailure;
+    }
+    HMAC_Update(cx, data, dataLen);
+    rv = HMAC_Finish(cx, result, resultLen, maxResultLen);
+    HMAC_DestroyContext(cx, PR_TRUE);
+    return rv;
+}
+
+/* compare in time that depends only on len */
+static PRBool
+hmac_equal(const unsigned char *a, const unsigned char *b, unsigned int len)
+{
+    unsigned char diff = 0;
+    unsigned int i;
+
+    for (i=0; i < len; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+static PRBool
+hmac_check(const hmac_hash *hash, const HMACVerifyJob *job,
+           const unsigned char *mac)
+{
+    if (job->macLen < hash->length/2 || job->macLen > hash->length) {
+        return PR_FALSE;
+    }
+    return hmac_equal(job->mac, mac, job->macLen);
+}
+
+/*
+ * Both hashes of each MAC as two SHA3 batches: the inner hashes of all the
+ * messages from the K^ipad prefix, then the outer hashes of all the inner
+ * digests from the K^opad prefix.
+ */
+static SECStatus
+hmac_verify_sha3(const HMACKey *key, HMACVerifyJob *jobs, unsigned int count)
+{
+    const hmac_hash *hash = key->hash;
+    unsigned int L = hash->length;
+    unsigned char *digests;
+    SHA3Job *batch;
+    SECStatus rv = SECFailure;
+    unsigned int i;
+
+    batch = PORT_Alloc(count * sizeof(*batch));
+    digests = PORT_Alloc(2 * count * L);
+    if (!batch || !digests) {
+        goto done;
+    }
+    for (i=0; i < count; i++) {
+        batch[i].src = jobs[i].data;
+        batch[i].srcLen = jobs[i].dataLen;
+        batch[i].dest = &digests[2*i*L];
+        batch[i].destLen = L;
+    }
+    if (SHA3_PrefixHashBatch(key->innerPrefix, hash->sha3, batch, count,
+                             NULL) != SECSuccess) {
+        goto done;
+    }
+    for (i=0; i < count; i++) {
+        batch[i].src = &digests[2*i*L];
+        batch[i].srcLen = L;
+        batch[i].dest = &digests[(2*i+1)*L];
+    }
+    if (SHA3_PrefixHashBatch(key->outerPrefix, hash->sha3, batch, count,
+                             NULL) != SECSuccess) {
+        goto done;
+    }
+    rv = SECSuccess;
+    for (i=0; i < count; i++) {
+        jobs[i].valid = hmac_check(hash, &jobs[i], &digests[(2*i+1)*L]);
+        if (!jobs[i].valid) {
+            rv = SECFailure;
+        }
+    }
+
+done:
+    if (digests) {
+        PORT_Memset(digests, 0, 2 * count * L);
+        PORT_Free(digests);
+    }
+    if (batch) {
+        PORT_Free(batch);
+    }
+    return rv;
+}
+
+SECStatus
+HMAC_VerifyBatch(const HMACKey *key, HMACVerifyJob *jobs, unsigned int count)
+{
+    unsigned char mac[HMAC_MAX_LENGTH];
+    unsigned int i, len;
+    HMACContext *cx;
+    SECStatus rv = SECSuccess;
+
+    for (i=0; i < count; i++) {
+        jobs[i].valid = PR_FALSE;
+    }
+    /*
+     * Without a multi-buffer Keccak the batch code is slower than a
+     * context, which gets the pruned last round.
+     */
+    if (key->innerPrefix && strcmp(SHA3_GetBackend(), "scalar") != 0) {
+        return hmac_verify_sha3(key, jobs, count);
+    }
+
+    /* no multi-buffer SHA2, one context in turn */
+    cx = HMAC_NewContext(key);
+    if (!cx) {
+        return SECFailure;
+    }
+    for (i=0; i < count; i++) {
+        HMAC_Begin(cx);
+        HMAC_Update(cx, jobs[i].data, jobs[i].dataLen);
+        HMAC_Finish(cx, mac, &len, sizeof mac);
+        jobs[i].valid = hmac_check(key->hash, &jobs[i], mac);
+        if (!jobs[i].valid) {
+            rv = SECFailure;
+        }
+    }
+    PORT_Memset(mac, 0, sizeof mac);
+    HMAC_DestroyContext(cx, PR_TRUE);
+    return rv;
+}
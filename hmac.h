@@ -0,0 +1,73 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef _HMAC_H_
+#define _HMAC_H_
+
+#include "sha3.h"
+#include "sha2.h"
+
+/*
+ * HMAC (FIPS 198-1) over SHA3-224/256/384/512, SHA-256 and SHA-512.
+ *
+ * An HMACKey holds the hash state after K^ipad and the one after K^opad,
+ * each absorbed once when the key is made. A MAC then starts from a clone
+ * of the inner state, and finishes with a clone of the outer state and the
+ * inner digest, so it costs the message plus one block of the outer hash,
+ * instead of the two extra key blocks of a plain HMAC. Keys can be shared
+ * between threads; each thread needs its own HMACContext.
+ */
+typedef enum {
+    HMAC_SHA3_224,
+    HMAC_SHA3_256,
+    HMAC_SHA3_384,
+    HMAC_SHA3_512,
+    HMAC_SHA256,
+    HMAC_SHA512
+} HMACHashType;
+
+typedef struct HMACKeyStr HMACKey;
+typedef struct HMACContextStr HMACContext;
+
+extern HMACKey *HMAC_NewKey(HMACHashType type, const unsigned char *secret,
+                            unsigned int secretLen);
+extern void HMAC_DestroyKey(HMACKey *key);
+/* length of the MACs made with the key */
+extern unsigned int HMAC_Length(const HMACKey *key);
+
+extern HMACContext *HMAC_NewContext(const HMACKey *key);
+extern void HMAC_DestroyContext(HMACContext *cx, PRBool freeit);
+extern void HMAC_Begin(HMACContext *cx);
+extern void HMAC_Update(HMACContext *cx, const unsigned char *data,
+                        unsigned int dataLen);
+extern SECStatus HMAC_Finish(HMACContext *cx, unsigned char *result,
+                             unsigned int *resultLen,
+                             unsigned int maxResultLen);
+
+/* one MAC, with a context of its own */
+extern SECStatus HMAC_Compute(const HMACKey *key, unsigned char *result,
+                              unsigned int *resultLen,
+                              unsigned int maxResultLen,
+                              const unsigned char *data, unsigned int dataLen);
+
+/*
+ * Verify count MACs made with the same key. Each job's valid is set to
+ * whether mac is the MAC of data, compared in constant time. A mac may be
+ * truncated to its leftmost macLen bytes, but no shorter than half the
+ * MAC length. With a SHA3 key the messages are hashed together on the
+ * multi-buffer Keccak (see SHA3_HashBatch), if the CPU has one. Returns
+ * SECSuccess if all the MACs are valid.
+ */
+typedef struct HMACVerifyJobStr {
+    const unsigned char *data;
+    unsigned int dataLen;
+    const unsigned char *mac;
+    unsigned int macLen;
+    PRBool valid;
+} HMACVerifyJob;
+
+extern SECStatus HMAC_VerifyBatch(const HMACKey *key, HMACVerifyJob *jobs,
+                                  unsigned int count);
+
+#endif /* ndef _HMAC_H_ */
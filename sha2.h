@@ -22,6 +22,11 @@
 #define PORT_Strlen(str) strlen(str)
 #define LL_SHL(r, a, b)     ((r) = (uint64_t)(a) << (b))
 #define PR_MIN(x, y)  ((x < y)? x : y)
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define IS_LITTLE_ENDIAN 1
+#elif defined(_M_IX86) || defined(_M_X64)
+#define IS_LITTLE_ENDIAN 1
+#endif
 
 struct SHA256ContextStr;
 struct SHA512ContextStr;
@@ -35,6 +40,13 @@ extern void SHA256_Update(SHA256Context *cx, const unsigned char *input,
                         unsigned int inputLen);
 extern void SHA256_End(SHA256Context *cx, unsigned char *digest,
                      unsigned int *digestLen, unsigned int maxDigestLen);
+extern void SHA256_Clone(SHA256Context *dest, SHA256Context *src);
+
+/*
+ * Name of the compression function in use: "generic", or "shani" for the
+ * SHA extensions. NSS_SHA2_BACKEND=generic forces the C implementation.
+ */
+extern const char *SHA256_GetBackend(void);
 
 extern SHA512Context *SHA512_NewContext(void);
 extern void SHA512_DestroyContext(SHA512Context *cx, PRBool freeit);
@@ -43,5 +55,8 @@ extern void SHA512_Update(SHA512Context *cx, const unsigned char *input,
                         unsigned int inputLen);
 extern void SHA512_End(SHA512Context *cx, unsigned char *digest,
                      unsigned int *digestLen, unsigned int maxDigestLen);
+extern void SHA512_Clone(SHA512Context *dest, SHA512Context *src);
+
+extern const char *SHA512_GetBackend(void);
 
 #endif /* ndef _SHA2_H_ */
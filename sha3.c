@@ -6,21 +6,39 @@
 #include <stdlib.h>
 #include <memory.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include "sha3.h"
+#include "blinit.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__x86_64))
+#define SHA3_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 /*** BEGIN NSPR polyfill ***/
 typedef uint64_t PRUint64;
-typedef uint32_t PRUint32;
-typedef enum { SECSuccess=0, SECFailure=-1 } SECStatus;
 #define PORT_Assert(x)
 #define PORT_New(x) (x *)malloc(sizeof(x))
+#define PORT_Alloc(x) malloc(x)
+#define PORT_ZAlloc(x) calloc(1,x)
 #define PORT_Memset(x,y,z) memset(x,y,z)
 #define PORT_Memcpy(x,y,z) memcpy(x,y,z)
+#define PORT_Memmove(x,y,z) memmove(x,y,z)
 #define PORT_Free(x) free(x)
 #define PORT_Strlen(x) strlen(x)
 /*** END NSPR polyfill ***/
 
 #define SHA_MIN(x,y) (((x)>(y))?(y):(x))
+#define SHA_MAX(x,y) (((x)>(y))?(x):(y))
+
+#if defined(_MSC_VER)
+#define SHA3_FORCEINLINE __forceinline
+#elif defined(__GNUC__)
+#define SHA3_FORCEINLINE inline __attribute__((always_inline))
+#else
+#define SHA3_FORCEINLINE inline
+#endif
 
 #define X_SIZE 5
 #define Y_SIZE 5
@@ -29,11 +47,25 @@ typedef struct SHA3ContextStr SHA3Context;
 
 struct SHA3ContextStr {
     PRUint64 A1[X_SIZE*Y_SIZE];
-    PRUint64 A2[X_SIZE*Y_SIZE];
-    unsigned char buf[X_SIZE*Y_SIZE*sizeof(PRUint64)];
-    unsigned int bufSize;
+    unsigned int bufSize;   /* bytes of the current block already in A1 */
+    unsigned int pending;   /* 1 + our slot in sched's queue, or 0 */
+    SHA3Scheduler *sched;
 };
 
+static void sha3_sched_run(SHA3Scheduler *sched);
+static void sha3_sched_cancel(SHA3Context *ctx);
+static PRBool sha3_sched_update(SHA3Context *ctx, const unsigned char *N,
+                                unsigned int len, unsigned int r);
+
+/* bring the state up to date, if the scheduler still holds a block of ours */
+static SHA3_FORCEINLINE void
+sha3_settle(SHA3Context *ctx)
+{
+    if (ctx->pending) {
+        sha3_sched_run(ctx->sched);
+    }
+}
+
 
 #if defined(_MSC_VER)
 #pragma intrinsic (_rotl64, _rotr64)
@@ -68,6 +100,36 @@ static PRUint64 swap8b(PRUint64 x)  {
 #define SHA_HTONLL swap8b
 #endif
 
+/*
+ * Lane i of an input block, which is little endian. The block is just
+ * bytes, possibly unaligned, so it is read with memcpy, which compiles to
+ * a single load. Casting it to PRUint64 * would break strict aliasing: the
+ * compiler may then move the loads above the stores that wrote the block.
+ */
+static SHA3_FORCEINLINE PRUint64
+sha3_lane_in(const unsigned char *N, unsigned int i)
+{
+    PRUint64 lane;
+
+    PORT_Memcpy(&lane, N + i*sizeof(PRUint64), sizeof(PRUint64));
+#ifdef PR_BIG_ENDIAN
+    lane = SHA_HTONLL(lane);
+#endif
+    return lane;
+}
+#define LANE_IN(N,i) sha3_lane_in((const unsigned char *)(N), (i))
+
+/* store lane i of an output block, the same way */
+static SHA3_FORCEINLINE void
+sha3_lane_out(unsigned char *Z, unsigned int i, PRUint64 lane)
+{
+#ifdef PR_BIG_ENDIAN
+    lane = SHA_HTONLL(lane);
+#endif
+    PORT_Memcpy(Z + i*sizeof(PRUint64), &lane, sizeof(PRUint64));
+}
+#define LANE_OUT(Z,i,lane) sha3_lane_out((Z), (i), (lane))
+
 /* Select the x value to the left or right */
 #define LEFT(x) ((x) == 0 ? (X_SIZE-1) : ((x)-1))
 #define RIGHT(x) ((x) == X_SIZE-1 ? 0 : ((x)+1))
@@ -171,9 +233,13 @@ dump_buf(char *label, const unsigned char *b, int size)
  *
  * In the spec, all the functions take array A and return array A'. Many
  * Of the functions, however, can modify A in place, namely theta, rho, and
- * iota. The other two functions use the temparary A2 array. Since they are
+ * iota. The other two functions use a temparary A2 array. Since they are
  * called one after another, pi uses A2 as A' and chi uses A2 as A (putting
- * The result back into A1 where most functions expect it as an input.
+ * The result back into A where most functions expect it as an input.
+ *
+ * These step functions are the reference implementation, and are what runs
+ * in TRACE builds so the intermediate states can be checked. The normal
+ * build uses the register resident permutation further down.
  *
  * The spec specifies serveral elements that can be preprocessed into
  * Array indexes or shift values. We recalculate all those constants rather
@@ -194,11 +260,10 @@ dump_buf(char *label, const unsigned char *b, int size)
  *
  */
 static inline void
-sha3_theta(SHA3Context *ctx)
+sha3_theta(PRUint64 *A)
 {
     PRUint64 C[X_SIZE];
     PRUint64 D;
-    PRUint64 *A = &ctx->A1[0];
 
 #define STEP_THETA1(x)                          \
     C[x] = A[IN(x,0)] ^ A[IN(x,1)] ^ A[IN(x,2)] \
@@ -326,10 +391,8 @@ sha3_theta(SHA3Context *ctx)
 #define PI_INV_24 4
 
 static inline void
-sha3_rho_pi(SHA3Context *ctx)
+sha3_rho_pi(const PRUint64 *A, PRUint64 *A_prime)
 {
-    PRUint64 *A = &ctx->A1[0];
-    PRUint64 *A_prime = &ctx->A2[0];
 
 #define STEP_RHO_PI(i) \
     A_prime[PI_INV(i)] = ROTL(A[i],RHO(i))
@@ -357,10 +420,8 @@ sha3_rho_pi(SHA3Context *ctx)
  */
 
 static inline void
-sha3_chi(SHA3Context *ctx)
+sha3_chi(const PRUint64 *A, PRUint64 *A_prime)
 {
-    PRUint64 *A = &ctx->A2[0];
-    PRUint64 *A_prime = &ctx->A1[0];
 #define CHIR(x,i) (x / X_SIZE) * X_SIZE + ((x + i) % X_SIZE)
 #define CHIR1(x) CHIR(x,1)
 #define CHIR2(x) CHIR(x,2)
@@ -421,425 +482,4067 @@ PRUint64 RC[24] = {
 };
 
 static inline void
-sha3_iota(SHA3Context *ctx, int iR)
+sha3_iota(PRUint64 *A, int iR)
 {
-    PRUint64 *A = &ctx->A1[0];
-
     A[0] ^= RC[iR];
 }
 
 static inline void
-sha3_Rnd(SHA3Context *ctx, int iR)
+sha3_Rnd(PRUint64 *A, PRUint64 *A2, int iR)
 {
-   sha3_theta(ctx);
-   DUMP_BYTES("after Theta",ctx->A1);
-   sha3_rho_pi(ctx);
-   DUMP_BYTES("after Rho and Pi",ctx->A1);
-   sha3_chi(ctx);
-   DUMP_BYTES("after Chi",ctx->A1);
-   sha3_iota(ctx, iR);
-   DUMP_BYTES("after Iota",ctx->A1);
+   sha3_theta(A);
+   DUMP_BYTES("after Theta",A);
+   sha3_rho_pi(A, A2);
+   DUMP_BYTES("after Rho and Pi",A2);
+   sha3_chi(A2, A);
+   DUMP_BYTES("after Chi",A);
+   sha3_iota(A, iR);
+   DUMP_BYTES("after Iota",A);
 }
 
-static inline void
-Keccak_f(SHA3Context *ctx)
+/* copy the first d bytes of the output lanes L to Z, little endian */
+static SHA3_FORCEINLINE void
+sha3_digest_out(unsigned char *Z, PRUint64 *L, unsigned int d)
+{
+#ifdef PR_BIG_ENDIAN
+    unsigned int i;
+
+    for (i=0; i < (d+7)/sizeof(PRUint64); i++) {
+        L[i] = SHA_HTONLL(L[i]);
+    }
+#endif
+    PORT_Memcpy(Z, L, d);
+}
+
+#if defined(TEST_TRACE) || defined(TRACE)
+static void
+Keccak_f(PRUint64 *A)
 {
+    PRUint64 A2[X_SIZE*Y_SIZE];
     int iR;
     for (iR=0; iR < 24; iR++) {
 #ifdef TRACE
         printf("Round #%d\n",iR);
 #endif
-        sha3_Rnd(ctx,iR);
+        sha3_Rnd(A,A2,iR);
     }
 }
 
 static void
-sha3_absorb(SHA3Context *ctx, const unsigned char *Nr, unsigned int r)
+Keccak_p(PRUint64 *A, unsigned int nr)
 {
-   /* convert to PRUint64's */
-   unsigned int i;
-   PRUint64 *A = &ctx->A1[0];
-   PRUint64 *N = (PRUint64*)Nr;
-
-   PORT_Assert((r & 0xf) == 0);
-   DUMP_BUF("Data to be absorbed", Nr, r);
-
-   for (i = 0; i < r / sizeof(PRUint64); ++i) {
-#ifdef PR_BIG_ENDIAN
-     A[i] ^= SHA_HTONLL(N[i]);
-#else
-     A[i] ^= N[i];
+    PRUint64 A2[X_SIZE*Y_SIZE];
+    int iR;
+    for (iR=24-nr; iR < 24; iR++) {
+#ifdef TRACE
+        printf("Round #%d\n",iR);
 #endif
-   }
-
-   DUMP_BYTES("Xor'd state(in bytes)",ctx->A1);
-   DUMP_LANES("Xor'd state(as lanes)",ctx->A1);
-   Keccak_f(ctx);
+        sha3_Rnd(A,A2,iR);
+    }
 }
 
-static inline void
-sha3_update(SHA3Context *ctx, const unsigned char *N, unsigned int len,
-                                                 unsigned int r)
+static SHA3_FORCEINLINE void
+Keccak_absorb(PRUint64 *A, const unsigned char *N, unsigned int blocks,
+                                     unsigned int r, unsigned int nr)
 {
-    if (ctx->bufSize) {
-        unsigned int fill = ctx->bufSize - r;
-        if (fill < len) {
-           PORT_Memcpy(&ctx->buf[ctx->bufSize], N, len);
-           ctx->bufSize += len;
-           return;
+    unsigned int i;
+
+    while (blocks--) {
+        for (i = 0; i < r / sizeof(PRUint64); ++i) {
+            A[i] ^= LANE_IN(N,i);
         }
-        PORT_Memcpy(&ctx->buf[ctx->bufSize], N, fill);
-        sha3_absorb(ctx, ctx->buf, r);
-        ctx->bufSize= 0;
-        N +=fill;
-        len -= fill;
-    }
-    while (len >= r) {
-        sha3_absorb(ctx, N, r);
+        Keccak_p(A, nr);
         N += r;
-        len -= r;
-    }
-    if (len) {
-        PORT_Memcpy(ctx->buf, N, len);
-        ctx->bufSize = len;
     }
 }
 
-/* domains include initial padding bit */
-/* NOTE: domain values are bit strings of non-standard byte lengths. Since we
- * only support byte length hash bits, we know they always start on a byte
- * boundary. We also know that they will be followed up by the initial padding
- * bit. The final bit will be added as needed. Also know, bits go from right to
- * left (sigh) */
-#define SHA3_DOMAIN      0x06
-#define SHAKE_RAW_DOMAIN 0x07
-#define SHAKE_DOMAIN     0x1f
-#define SHA3_FINAL_PAD   0x80
-
-static inline void
-sha3_finalpad(SHA3Context *ctx, unsigned char domain, unsigned int r)
+static SHA3_FORCEINLINE void
+Keccak_f_out(PRUint64 *A, unsigned char *Z, unsigned int d)
 {
-    ctx->buf[ctx->bufSize++] = domain;
-    PORT_Memset(&ctx->buf[ctx->bufSize], 0, r-ctx->bufSize);
-    ctx->buf[r-1] |= SHA3_FINAL_PAD;
-    sha3_absorb(ctx, ctx->buf, r);
-    ctx->bufSize = 0;
+    Keccak_f(A);
+    sha3_digest_out(Z, A, d);
 }
 
-static inline void
-sha3_unload_state(SHA3Context *ctx, unsigned char *Z, unsigned int d)
+static SHA3_FORCEINLINE void
+Keccak_squeeze(PRUint64 *A, unsigned char *Z, unsigned int blocks,
+                                     unsigned int r, unsigned int nr)
 {
-    /* now fill remainder of 'd' that is a multiple of 64 */
-    PRUint64 *S = &ctx->A1[0];
-    int i;
-    while (d > sizeof(PRUint64)) {
-        Z[0] =     *S     & 0xff;
-        Z[1] = (*S >>  8) & 0xff;
-        Z[2] = (*S >> 16) & 0xff;
-        Z[3] = (*S >> 24) & 0xff;
-        Z[4] = (*S >> 32) & 0xff;
-        Z[5] = (*S >> 40) & 0xff;
-        Z[6] = (*S >> 48) & 0xff;
-        Z[7] = (*S >> 56) & 0xff;
-        S++;
-        Z += sizeof(PRUint64);
-        d -= sizeof(PRUint64);
-    }
-    /* handle any remaining partials  (SHA224, for instance) */
-    for (i=0; i < d; i++) {
-        Z[i] = ((*S) >> (i*8)) &0xff;
+    unsigned int i;
+
+    while (blocks--) {
+        Keccak_p(A, nr);
+        for (i = 0; i < r / sizeof(PRUint64); ++i) {
+            LANE_OUT(Z, i, A[i]);
+        }
+        Z += r;
     }
 }
+#else
+/*
+ * Register resident permutation
+ *
+ * The step functions above go through memory twice a round: rho/pi writes
+ * all 25 lanes to A2 and chi reads them back. Here the state lives in 25
+ * locals for all 24 rounds and each round is written out in full, so the
+ * compiler can keep (most of) it in registers. The lanes are named the way
+ * the Keccak team names them: the first letter is the row, y=0..4 is
+ * b,g,k,m,s, the second is the column, x=0..4 is a,e,i,o,u. So Aki is
+ * A[IN(2,2)] and Asu is A[IN(4,4)].
+ *
+ * Each output row is computed from the five lanes that pi moves into it, so
+ * rho and pi cost nothing beyond the rotates. Theta's column parities for
+ * the next round are accumulated while the row is still in registers.
+ *
+ * Lane complementing: chi needs a NOT per lane. If we keep the lanes
+ * be, bi, go, ki, mi and sa complemented for the whole permutation, chi can
+ * be rewritten with ANDs and ORs so that each row needs just one NOT
+ * (see the lane complementing transform in "Keccak implementation
+ * overview"). The complement is
+ * applied when loading the state and removed when storing it. Theta and
+ * rho/pi are linear, so they don't care.
+ *
+ * Rounds alternate between the A and E sets of locals, so there are no
+ * copies between rounds.
+ */
+#define KECCAK_COMPLEMENT(A)                            \
+    A[IN(1,0)] = ~A[IN(1,0)];                           \
+    A[IN(2,0)] = ~A[IN(2,0)];                           \
+    A[IN(3,1)] = ~A[IN(3,1)];                           \
+    A[IN(2,2)] = ~A[IN(2,2)];                           \
+    A[IN(2,3)] = ~A[IN(2,3)];                           \
+    A[IN(0,4)] = ~A[IN(0,4)]
+
+#define KECCAK_DECLARE_LANES(A)                         \
+    PRUint64 A##ba, A##be, A##bi, A##bo, A##bu;         \
+    PRUint64 A##ga, A##ge, A##gi, A##go, A##gu;         \
+    PRUint64 A##ka, A##ke, A##ki, A##ko, A##ku;         \
+    PRUint64 A##ma, A##me, A##mi, A##mo, A##mu;         \
+    PRUint64 A##sa, A##se, A##si, A##so, A##su
+
+#define KECCAK_LOAD(A, S)                               \
+    A##ba = (S)[ 0]; A##be = (S)[ 1]; A##bi = (S)[ 2];  \
+    A##bo = (S)[ 3]; A##bu = (S)[ 4];                   \
+    A##ga = (S)[ 5]; A##ge = (S)[ 6]; A##gi = (S)[ 7];  \
+    A##go = (S)[ 8]; A##gu = (S)[ 9];                   \
+    A##ka = (S)[10]; A##ke = (S)[11]; A##ki = (S)[12];  \
+    A##ko = (S)[13]; A##ku = (S)[14];                   \
+    A##ma = (S)[15]; A##me = (S)[16]; A##mi = (S)[17];  \
+    A##mo = (S)[18]; A##mu = (S)[19];                   \
+    A##sa = (S)[20]; A##se = (S)[21]; A##si = (S)[22];  \
+    A##so = (S)[23]; A##su = (S)[24]
+
+#define KECCAK_STORE(S, A)                              \
+    (S)[ 0] = A##ba; (S)[ 1] = A##be; (S)[ 2] = A##bi;  \
+    (S)[ 3] = A##bo; (S)[ 4] = A##bu;                   \
+    (S)[ 5] = A##ga; (S)[ 6] = A##ge; (S)[ 7] = A##gi;  \
+    (S)[ 8] = A##go; (S)[ 9] = A##gu;                   \
+    (S)[10] = A##ka; (S)[11] = A##ke; (S)[12] = A##ki;  \
+    (S)[13] = A##ko; (S)[14] = A##ku;                   \
+    (S)[15] = A##ma; (S)[16] = A##me; (S)[17] = A##mi;  \
+    (S)[18] = A##mo; (S)[19] = A##mu;                   \
+    (S)[20] = A##sa; (S)[21] = A##se; (S)[22] = A##si;  \
+    (S)[23] = A##so; (S)[24] = A##su
+
+/* theta column parities of the loaded state, for the first round */
+#define KECCAK_PARITY(A)                                \
+    Ca = A##ba ^ A##ga ^ A##ka ^ A##ma ^ A##sa;         \
+    Ce = A##be ^ A##ge ^ A##ke ^ A##me ^ A##se;         \
+    Ci = A##bi ^ A##gi ^ A##ki ^ A##mi ^ A##si;         \
+    Co = A##bo ^ A##go ^ A##ko ^ A##mo ^ A##so;         \
+    Cu = A##bu ^ A##gu ^ A##ku ^ A##mu ^ A##su
 
-#ifdef SHAKE
 /*
- * We currently don't have a need or use for SHAKE yet, but when we do,
- * this is what we need to implement it..
+ * One round from A into E. Expects the column parities of A in Ca..Cu, and
+ * leaves the column parities of E there.
  */
-static inline void
-shake_squeeze(SHA3Context *ctx, unsigned int r, unsigned char *Z,
-                                                unsigned int d)
+#define KECCAK_ROUND(iR, A, E)                          \
+    Da = Cu ^ ROTL(Ce, 1);                              \
+    De = Ca ^ ROTL(Ci, 1);                              \
+    Di = Ce ^ ROTL(Co, 1);                              \
+    Do = Ci ^ ROTL(Cu, 1);                              \
+    Du = Co ^ ROTL(Ca, 1);                              \
+                                                        \
+    Ba = A##ba ^ Da;                                    \
+    Be = ROTL(A##ge ^ De, 44);                          \
+    Bi = ROTL(A##ki ^ Di, 43);                          \
+    Bo = ROTL(A##mo ^ Do, 21);                          \
+    Bu = ROTL(A##su ^ Du, 14);                          \
+    E##ba = Ba ^ (Be | Bi) ^ RC[iR];                    \
+    E##be = Be ^ (~Bi | Bo);                            \
+    E##bi = Bi ^ (Bo & Bu);                             \
+    E##bo = Bo ^ (Bu | Ba);                             \
+    E##bu = Bu ^ (Ba & Be);                             \
+    Ca = E##ba; Ce = E##be; Ci = E##bi;                 \
+    Co = E##bo; Cu = E##bu;                             \
+                                                        \
+    Ba = ROTL(A##bo ^ Do, 28);                          \
+    Be = ROTL(A##gu ^ Du, 20);                          \
+    Bi = ROTL(A##ka ^ Da, 3);                           \
+    Bo = ROTL(A##me ^ De, 45);                          \
+    Bu = ROTL(A##si ^ Di, 61);                          \
+    E##ga = Ba ^ (Be | Bi);                             \
+    E##ge = Be ^ (Bi & Bo);                             \
+    E##gi = Bi ^ (Bo | ~Bu);                            \
+    E##go = Bo ^ (Bu | Ba);                             \
+    E##gu = Bu ^ (Ba & Be);                             \
+    Ca ^= E##ga; Ce ^= E##ge; Ci ^= E##gi;              \
+    Co ^= E##go; Cu ^= E##gu;                           \
+                                                        \
+    Ba = ROTL(A##be ^ De, 1);                           \
+    Be = ROTL(A##gi ^ Di, 6);                           \
+    Bi = ROTL(A##ko ^ Do, 25);                          \
+    Bo = ROTL(A##mu ^ Du, 8);                           \
+    Bu = ROTL(A##sa ^ Da, 18);                          \
+    E##ka = Ba ^ (Be | Bi);                             \
+    E##ke = Be ^ (Bi & Bo);                             \
+    E##ki = Bi ^ (~Bo & Bu);                            \
+    E##ko = ~Bo ^ (Bu | Ba);                            \
+    E##ku = Bu ^ (Ba & Be);                             \
+    Ca ^= E##ka; Ce ^= E##ke; Ci ^= E##ki;              \
+    Co ^= E##ko; Cu ^= E##ku;                           \
+                                                        \
+    Ba = ROTL(A##bu ^ Du, 27);                          \
+    Be = ROTL(A##ga ^ Da, 36);                          \
+    Bi = ROTL(A##ke ^ De, 10);                          \
+    Bo = ROTL(A##mi ^ Di, 15);                          \
+    Bu = ROTL(A##so ^ Do, 56);                          \
+    E##ma = Ba ^ (Be & Bi);                             \
+    E##me = Be ^ (Bi | Bo);                             \
+    E##mi = Bi ^ (~Bo | Bu);                            \
+    E##mo = ~Bo ^ (Bu & Ba);                            \
+    E##mu = Bu ^ (Ba | Be);                             \
+    Ca ^= E##ma; Ce ^= E##me; Ci ^= E##mi;              \
+    Co ^= E##mo; Cu ^= E##mu;                           \
+                                                        \
+    Ba = ROTL(A##bi ^ Di, 62);                          \
+    Be = ROTL(A##go ^ Do, 55);                          \
+    Bi = ROTL(A##ku ^ Du, 39);                          \
+    Bo = ROTL(A##ma ^ Da, 41);                          \
+    Bu = ROTL(A##se ^ De, 2);                           \
+    E##sa = Ba ^ (~Be & Bi);                            \
+    E##se = ~Be ^ (Bi | Bo);                            \
+    E##si = Bi ^ (Bo & Bu);                             \
+    E##so = Bo ^ (Bu | Ba);                             \
+    E##su = Bu ^ (Ba & Be);                             \
+    Ca ^= E##sa; Ce ^= E##se; Ci ^= E##si;              \
+    Co ^= E##so; Cu ^= E##su
+
+/*
+ * The last round of a hash, from A into E. Only the first 'lanes' lanes
+ * (at most 8) of the result are ever read: row b, and ga, ge and gi for
+ * SHA3-512. So chi and iota are only done for those lanes, and the theta
+ * parities of the result are not computed at all.
+ */
+#define KECCAK_ROUND_OUT(iR, A, E, lanes)               \
+    Da = Cu ^ ROTL(Ce, 1);                              \
+    De = Ca ^ ROTL(Ci, 1);                              \
+    Di = Ce ^ ROTL(Co, 1);                              \
+    Do = Ci ^ ROTL(Cu, 1);                              \
+    Du = Co ^ ROTL(Ca, 1);                              \
+                                                        \
+    Ba = A##ba ^ Da;                                    \
+    Be = ROTL(A##ge ^ De, 44);                          \
+    Bi = ROTL(A##ki ^ Di, 43);                          \
+    Bo = ROTL(A##mo ^ Do, 21);                          \
+    Bu = ROTL(A##su ^ Du, 14);                          \
+    E##ba = Ba ^ (Be | Bi) ^ RC[iR];                    \
+    E##be = Be ^ (~Bi | Bo);                            \
+    E##bi = Bi ^ (Bo & Bu);                             \
+    E##bo = Bo ^ (Bu | Ba);                             \
+    E##bu = Bu ^ (Ba & Be);                             \
+                                                        \
+    if ((lanes) > 5) {                                  \
+        Ba = ROTL(A##bo ^ Do, 28);                      \
+        Be = ROTL(A##gu ^ Du, 20);                      \
+        Bi = ROTL(A##ka ^ Da, 3);                       \
+        Bo = ROTL(A##me ^ De, 45);                      \
+        Bu = ROTL(A##si ^ Di, 61);                      \
+        E##ga = Ba ^ (Be | Bi);                         \
+        E##ge = Be ^ (Bi & Bo);                         \
+        E##gi = Bi ^ (Bo | ~Bu);                        \
+    }
+
+#define KECCAK_DECLARE_TEMPS                            \
+    PRUint64 Ba, Be, Bi, Bo, Bu;                        \
+    PRUint64 Ca, Ce, Ci, Co, Cu;                        \
+    PRUint64 Da, De, Di, Do, Du
+
+static void
+Keccak_f(PRUint64 *S)
 {
-    PORT_Assert((r & 0x7) == 0)
+    KECCAK_DECLARE_LANES(A);
+    KECCAK_DECLARE_LANES(E);
+    KECCAK_DECLARE_TEMPS;
+    int iR;
 
-    /* first deal with any extra squeeses */
-    while (d > r) {
-        sha3_unload_state(ctx, Z, r);
-        Z += r;
-        d -= r;
-        Keccak_f(ctx);
+    KECCAK_COMPLEMENT(S);
+    KECCAK_LOAD(A, S);
+    KECCAK_PARITY(A);
+    for (iR=0; iR < 24; iR += 2) {
+        KECCAK_ROUND(iR, A, E);
+        KECCAK_ROUND(iR+1, E, A);
     }
-    sha3_unload(ctx, Z, d);
+    KECCAK_STORE(S, A);
+    KECCAK_COMPLEMENT(S);
 }
 
-static inline void
-shake_final(SHA3Context *ctx, unsigned char domain, unsigned int r,
-            unsigned char *Z, unsigned int d)
+/*
+ * Keccak-p[1600,nr] (FIPS 202, section 3.3): the last nr rounds of
+ * Keccak-f, rounds 24-nr to 23. TurboSHAKE and KangarooTwelve use nr=12.
+ * The rounds go in pairs, A to E and back, so an odd nr runs its first
+ * round on its own and moves the lanes back to A through S.
+ */
+static void
+Keccak_p(PRUint64 *S, unsigned int nr)
 {
-    sha3_finalpad(ctx, domain, r);
-    shake_squeeze(ctx, r, Z, d);
+    KECCAK_DECLARE_LANES(A);
+    KECCAK_DECLARE_LANES(E);
+    KECCAK_DECLARE_TEMPS;
+    int iR = 24 - nr;
+
+    PORT_Assert(nr <= 24);
+    KECCAK_COMPLEMENT(S);
+    KECCAK_LOAD(A, S);
+    KECCAK_PARITY(A);
+    if (nr & 1) {
+        KECCAK_ROUND(iR, A, E);
+        KECCAK_STORE(S, E);
+        KECCAK_LOAD(A, S);
+        iR++;
+    }
+    for (; iR < 24; iR += 2) {
+        KECCAK_ROUND(iR, A, E);
+        KECCAK_ROUND(iR+1, E, A);
+    }
+    KECCAK_STORE(S, A);
+    KECCAK_COMPLEMENT(S);
 }
 
-static inline void
-shake(unsigned char *message, unsigned int len, unsigned char *out,
-                unsigned int outLen, unsigned char domain, unsigned int r)
+/*
+ * The final permutation of a hash: permute S and write the first d bytes
+ * of the result to Z. The last round is pruned to the digest lanes, and
+ * the state itself is not stored, so S is garbage afterwards.
+ */
+static SHA3_FORCEINLINE void
+Keccak_f_out(PRUint64 *S, unsigned char *Z, unsigned int d)
 {
-    SHA3Context ctx;
+    KECCAK_DECLARE_LANES(A);
+    KECCAK_DECLARE_LANES(E);
+    KECCAK_DECLARE_TEMPS;
+    PRUint64 L[8];
+    unsigned int lanes = (d + 7) / sizeof(PRUint64);
+    int iR;
 
-    SHA3_Begin(&ctx);
-    sha3_update(&ctx,message,len);
-    sha3_finalpad(ctx, domain, r);
-    shake_squeeze(ctx, r, out, outLen);
+    PORT_Assert(lanes <= 8);
+    KECCAK_COMPLEMENT(S);
+    KECCAK_LOAD(A, S);
+    KECCAK_PARITY(A);
+    for (iR=0; iR < 22; iR += 2) {
+        KECCAK_ROUND(iR, A, E);
+        KECCAK_ROUND(iR+1, E, A);
+    }
+    KECCAK_ROUND(22, A, E);
+    KECCAK_ROUND_OUT(23, E, A, lanes);
+
+    L[0] = Aba; L[1] = ~Abe; L[2] = ~Abi; L[3] = Abo; L[4] = Abu;
+    if (lanes > 5) {
+        L[5] = Aga; L[6] = Age; L[7] = Agi;
+    }
+    sha3_digest_out(Z, L, d);
 }
 
+/*
+ * XOR the first 'lanes' lanes of an input block into the locals. The rates
+ * we use are 9 (SHA3-512), 13 (SHA3-384), 17 (SHA3-256, SHAKE256),
+ * 18 (SHA3-224) and 21 (SHAKE128) lanes. XORing into a complemented lane
+ * is fine, since ~a ^ b == ~(a ^ b).
+ */
+#define KECCAK_XOR_BLOCK(A, N, lanes)                           \
+    switch (lanes) {                                            \
+    case 21:                                                    \
+        A##sa ^= LANE_IN(N,20); A##mu ^= LANE_IN(N,19);         \
+        A##mo ^= LANE_IN(N,18);                                 \
+        /* fall through */                                      \
+    case 18:                                                    \
+        A##mi ^= LANE_IN(N,17);                                 \
+        /* fall through */                                      \
+    case 17:                                                    \
+        A##me ^= LANE_IN(N,16); A##ma ^= LANE_IN(N,15);         \
+        A##ku ^= LANE_IN(N,14); A##ko ^= LANE_IN(N,13);         \
+        /* fall through */                                      \
+    case 13:                                                    \
+        A##ki ^= LANE_IN(N,12); A##ke ^= LANE_IN(N,11);         \
+        A##ka ^= LANE_IN(N,10); A##gu ^= LANE_IN(N, 9);         \
+        /* fall through */                                      \
+    case 9:                                                     \
+        A##go ^= LANE_IN(N, 8); A##gi ^= LANE_IN(N, 7);         \
+        A##ge ^= LANE_IN(N, 6); A##ga ^= LANE_IN(N, 5);         \
+        A##bu ^= LANE_IN(N, 4); A##bo ^= LANE_IN(N, 3);         \
+        A##bi ^= LANE_IN(N, 2); A##be ^= LANE_IN(N, 1);         \
+        A##ba ^= LANE_IN(N, 0);                                 \
+        break;                                                  \
+    default:                                                    \
+        PORT_Assert(0);                                         \
+    }
 
-void
-SHAKE128_Raw(unsigned char *message, unsigned int len,
-             unsigned char *out, unsigned int outlen)
+/*
+ * Absorb whole blocks straight from the caller's buffer. sha3_absorb would
+ * XOR each block into the context, and Keccak_f would load it right back
+ * and store it again at the end of the permutation. Here the state is
+ * loaded into locals once, each block is XORed into the locals and
+ * permuted, and the state only goes back to memory after the last block.
+ *
+ * This is always inlined into the per rate kernels below, so the rate is a
+ * constant and KECCAK_XOR_BLOCK turns into straight line code. So is the
+ * number of rounds, 24, or 12 for TurboSHAKE, which must be even.
+ */
+static SHA3_FORCEINLINE void
+Keccak_absorb(PRUint64 *S, const unsigned char *N, unsigned int blocks,
+                                     unsigned int r, unsigned int nr)
 {
-    shake(message, len, out, outLen, SHAKE_RAW_DOMAIN, SHAKE128_R);
+    KECCAK_DECLARE_LANES(A);
+    KECCAK_DECLARE_LANES(E);
+    KECCAK_DECLARE_TEMPS;
+    unsigned int lanes = r / sizeof(PRUint64);
+    int iR;
+
+    PORT_Assert((nr & 1) == 0);
+    KECCAK_COMPLEMENT(S);
+    KECCAK_LOAD(A, S);
+    while (blocks--) {
+        KECCAK_XOR_BLOCK(A, N, lanes);
+        KECCAK_PARITY(A);
+        for (iR=24-nr; iR < 24; iR += 2) {
+            KECCAK_ROUND(iR, A, E);
+            KECCAK_ROUND(iR+1, E, A);
+        }
+        N += r;
+    }
+    KECCAK_STORE(S, A);
+    KECCAK_COMPLEMENT(S);
 }
 
-void
-SHAKE128(unsigned char *message, unsigned int len,
-             unsigned char *out, unsigned int outlen)
+/*
+ * Store the first 'lanes' lanes of the state as an output block, taking
+ * the complement off the complemented lanes. Only the SHAKE rates, 17 and
+ * 21 lanes, are squeezed for more than a digest.
+ */
+#define KECCAK_OUT_BLOCK(Z, A, lanes)                           \
+    switch (lanes) {                                            \
+    case 21:                                                    \
+        LANE_OUT(Z,20,~A##sa); LANE_OUT(Z,19, A##mu);           \
+        LANE_OUT(Z,18, A##mo); LANE_OUT(Z,17,~A##mi);           \
+        /* fall through */                                      \
+    case 17:                                                    \
+        LANE_OUT(Z,16, A##me); LANE_OUT(Z,15, A##ma);           \
+        LANE_OUT(Z,14, A##ku); LANE_OUT(Z,13, A##ko);           \
+        LANE_OUT(Z,12,~A##ki); LANE_OUT(Z,11, A##ke);           \
+        LANE_OUT(Z,10, A##ka); LANE_OUT(Z, 9, A##gu);           \
+        LANE_OUT(Z, 8,~A##go); LANE_OUT(Z, 7, A##gi);           \
+        LANE_OUT(Z, 6, A##ge); LANE_OUT(Z, 5, A##ga);           \
+        LANE_OUT(Z, 4, A##bu); LANE_OUT(Z, 3, A##bo);           \
+        LANE_OUT(Z, 2,~A##bi); LANE_OUT(Z, 1,~A##be);           \
+        LANE_OUT(Z, 0, A##ba);                                  \
+        break;                                                  \
+    default:                                                    \
+        PORT_Assert(0);                                         \
+    }
+
+/*
+ * Squeeze whole blocks of output straight into the caller's buffer: permute
+ * and store the rate lanes from the locals, blocks times, with the state
+ * only loaded at the start and stored at the end, the way Keccak_absorb
+ * does it for input.
+ */
+static SHA3_FORCEINLINE void
+Keccak_squeeze(PRUint64 *S, unsigned char *Z, unsigned int blocks,
+                                     unsigned int r, unsigned int nr)
 {
-    shake(message, len, out, outLen, SHAKE_DOMAIN, SHAKE128_R);
+    KECCAK_DECLARE_LANES(A);
+    KECCAK_DECLARE_LANES(E);
+    KECCAK_DECLARE_TEMPS;
+    unsigned int lanes = r / sizeof(PRUint64);
+    int iR;
+
+    PORT_Assert((nr & 1) == 0);
+    KECCAK_COMPLEMENT(S);
+    KECCAK_LOAD(A, S);
+    while (blocks--) {
+        KECCAK_PARITY(A);
+        for (iR=24-nr; iR < 24; iR += 2) {
+            KECCAK_ROUND(iR, A, E);
+            KECCAK_ROUND(iR+1, E, A);
+        }
+        KECCAK_OUT_BLOCK(Z, A, lanes);
+        Z += r;
+    }
+    KECCAK_STORE(S, A);
+    KECCAK_COMPLEMENT(S);
 }
+#endif
 
-void
-SHAKE256_Raw(unsigned char *message, unsigned int len,
-             unsigned char *out, unsigned int outlen)
+/*
+ * Multi-buffer Keccak
+ *
+ * When we have several independent messages, we can run their permutations
+ * side by side. The states are interleaved lane by lane: lane i of stream s
+ * lives at S[i*n + s], where n is the number of streams in the group. With
+ * n=4 a single ymm register holds lane i of all four streams, with n=8 a
+ * single zmm register holds lane i of all eight, and each step of the
+ * permutation is exactly the scalar step, applied to all streams at once.
+ *
+ * The sponge helpers below don't care how the permutation is done, only that
+ * the interleaved layout is kept.
+ */
+#define SHA3_X4 4
+#define SHA3_X8 8
+#define SHA3_MAX_STREAMS SHA3_X8
+
+#define SHA3_LANE(S,n,i,s) (S)[(i)*(n)+(s)]
+
+/* XOR byte b into byte off of stream s (the state is little endian) */
+#define SHA3_XOR_BYTE(S,n,s,off,b) \
+    SHA3_LANE(S,n,(off)/8,s) ^= (PRUint64)(b) << (8*((off) & 7))
+
+/*
+ * XOR len bytes of input into stream s of the n interleaved states in S,
+ * starting at byte off of the state; n=1, s=0 for a single state. This is
+ * how we absorb partial blocks: the bytes go straight into the state, with
+ * no buffer, eight at a time, and only the last few one by one. Short
+ * pieces rarely start on a lane (after a length prefix, say), so the
+ * eight bytes are split across two lanes rather than fed in bytewise up
+ * to the next lane.
+ */
+static SHA3_FORCEINLINE void
+sha3_xor_bytes(PRUint64 *S, unsigned int n, unsigned int s, unsigned int off,
+               const unsigned char *N, unsigned int len)
 {
-    shake(message, len, out, outLen, SHAKE_RAW_DOMAIN, SHAKE256_R);
+    unsigned int i, lanes, k = 8*(off & 7);
+    PRUint64 w;
+
+    lanes = len / sizeof(PRUint64);
+    if (k) {
+        /* each 8 bytes of input straddle two lanes */
+        for (i=0; i < lanes; i++) {
+            w = LANE_IN(N, i);
+            SHA3_LANE(S, n, off/8 + i, s) ^= w << k;
+            SHA3_LANE(S, n, off/8 + i + 1, s) ^= w >> (64 - k);
+        }
+    } else {
+        for (i=0; i < lanes; i++) {
+            SHA3_LANE(S, n, off/8 + i, s) ^= LANE_IN(N, i);
+        }
+    }
+    off += lanes * sizeof(PRUint64);
+    N += lanes * sizeof(PRUint64);
+    len -= lanes * sizeof(PRUint64);
+    for (; len; off++, N++, len--) {
+        SHA3_XOR_BYTE(S, n, s, off, *N);
+    }
 }
 
-void
-SHAKE256(unsigned char *message, unsigned int len,
-             unsigned char *out, unsigned int outlen)
+#ifdef SHA3_X86_SIMD
+#define ROTL_X4(a,n) \
+    _mm256_or_si256(_mm256_slli_epi64(a,n),_mm256_srli_epi64(a,64-(n)))
+
+/*
+ * Same steps as sha3_theta, sha3_rho_pi, sha3_chi and sha3_iota, but the
+ * whole state is kept in locals for all 24 rounds. The compiler has to spill
+ * some of it, since 25 lanes plus temporaries don't fit in 16 ymm registers,
+ * but it does so on the stack rather than through the context.
+ */
+__attribute__((target("avx2")))
+static void
+Keccak_p_x4_avx2(PRUint64 *S, unsigned int nr)
 {
-    shake(message, len, out, outLen, SHAKE_DOMAIN, SHAKE256_R);
-}
+    __m256i A[X_SIZE*Y_SIZE];
+    __m256i B[X_SIZE*Y_SIZE];
+    __m256i C[X_SIZE];
+    __m256i D;
+    int iR;
 
-#endif
+#define LOAD_X4(i) A[i] = _mm256_loadu_si256((const __m256i *)&S[(i)*SHA3_X4])
+#define STORE_X4(i) _mm256_storeu_si256((__m256i *)&S[(i)*SHA3_X4], A[i])
 
+#define STEP_THETA1_X4(x)                                      \
+    C[x] = _mm256_xor_si256(                                   \
+               _mm256_xor_si256(A[IN(x,0)], A[IN(x,1)]),       \
+               _mm256_xor_si256(_mm256_xor_si256(A[IN(x,2)],   \
+                                                 A[IN(x,3)]),  \
+                                A[IN(x,4)]))
 
-static inline void
-sha3_final(SHA3Context *ctx, unsigned int r, unsigned char *Z, unsigned int d)
-{
-    sha3_finalpad(ctx, SHA3_DOMAIN, r);
-    sha3_unload_state(ctx, Z, d);
-}
+#define STEP_THETA2_X4(x)                                         \
+    D = _mm256_xor_si256(C[LEFT(x)], ROTL_X4(C[RIGHT(x)],1));     \
+    A[IN(x,0)] = _mm256_xor_si256(A[IN(x,0)], D);                 \
+    A[IN(x,1)] = _mm256_xor_si256(A[IN(x,1)], D);                 \
+    A[IN(x,2)] = _mm256_xor_si256(A[IN(x,2)], D);                 \
+    A[IN(x,3)] = _mm256_xor_si256(A[IN(x,3)], D);                 \
+    A[IN(x,4)] = _mm256_xor_si256(A[IN(x,4)], D)
 
-/* constants in bytes, r = (b-c)/8 d = d/8 */
-#define SHA3_224_R 144 /* (1600-448)/8 */
-#define SHA3_224_D  28 /* (224)/8 */
-#define SHA3_256_R 136 /* (1600-512)/8 */
-#define SHA3_256_D  32 /* (256)/8 */
-#define SHA3_384_R 104 /* (1600-768)/8 */
-#define SHA3_384_D  48 /* (384)/8 */
-#define SHA3_512_R  72 /* (1600-1024)/8 */
-#define SHA3_512_D  64 /* (512)/8 */
-#define SHAKE128_R 168 /* (1600-256)/8 */
-#define SHAKE256_R 136 /* (1600-512)/8 */
+#define STEP_RHO_PI_X4(i) \
+    B[PI_INV(i)] = ROTL_X4(A[i],RHO(i))
 
+    /* _mm256_andnot_si256(a,b) is ~a & b, which is exactly what chi wants */
+#define STEP_CHI_X4(x) \
+    A[x] = _mm256_xor_si256(B[x], _mm256_andnot_si256(B[CHIR1(x)],B[CHIR2(x)]))
 
-SHA3Context *
-SHA3_NewContext(void )
-{
-    SHA3Context *ctx = PORT_New(SHA3Context);
-    return ctx;
+    UNROLL_25(LOAD_X4);
+    for (iR=24-nr; iR < 24; iR++) {
+        UNROLL_5(STEP_THETA1_X4);
+        UNROLL_5(STEP_THETA2_X4);
+        UNROLL_25(STEP_RHO_PI_X4);
+        UNROLL_25(STEP_CHI_X4);
+        A[0] = _mm256_xor_si256(A[0], _mm256_set1_epi64x(RC[iR]));
+    }
+    UNROLL_25(STORE_X4);
 }
 
-void
-SHA3_DestroyContext(SHA3Context *ctx, PRBool freeit)
+/*
+ * AVX-512 has 32 zmm registers, so the whole 8-way state stays in registers.
+ * It also gives us a native 64 bit rotate (vprolq), and vpternlogq, which
+ * evaluates any three input boolean function in one instruction. The
+ * immediates below are the truth tables of the functions, with the inputs
+ * a=0xf0, b=0xcc, c=0xaa:
+ *
+ *   0x96  a ^ b ^ c          (theta)
+ *   0xd2  a ^ (~b & c)       (chi)
+ *
+ * Theta is folded into a single ternary XOR per lane: with
+ * R[x] = ROTL(C[x],1), A'[x,y] = A[x,y] ^ C[x-1] ^ R[x+1].
+ */
+#define XOR3_X8(a,b,c) _mm512_ternarylogic_epi64(a,b,c,0x96)
+#define CHI_X8(a,b,c) _mm512_ternarylogic_epi64(a,b,c,0xd2)
+
+__attribute__((target("avx512f")))
+static void
+Keccak_p_x8_avx512(PRUint64 *S, unsigned int nr)
 {
-    PORT_Memset(ctx, 0, sizeof (*ctx));
-    if (freeit) {
-        PORT_Free(ctx);
-    }
+    __m512i A[X_SIZE*Y_SIZE];
+    __m512i B[X_SIZE*Y_SIZE];
+    __m512i C[X_SIZE];
+    __m512i R[X_SIZE];
+    int iR;
+
+#define LOAD_X8(i) A[i] = _mm512_loadu_si512((const void *)&S[(i)*SHA3_X8])
+#define STORE_X8(i) _mm512_storeu_si512((void *)&S[(i)*SHA3_X8], A[i])
+
+#define STEP_THETA1_X8(x)                                          \
+    C[x] = XOR3_X8(XOR3_X8(A[IN(x,0)], A[IN(x,1)], A[IN(x,2)]),    \
+                   A[IN(x,3)], A[IN(x,4)]);                        \
+    R[x] = _mm512_rol_epi64(C[x], 1)
 
+    /* theta's D is applied on the way into rho and pi */
+#define STEP_THETA_RHO_PI_X8(i)                                     \
+    B[PI_INV(i)] = _mm512_rol_epi64(                                \
+        XOR3_X8(A[i], C[LEFT((i)%X_SIZE)], R[RIGHT((i)%X_SIZE)]),   \
+        RHO(i))
+
+#define STEP_CHI_X8(x) \
+    A[x] = CHI_X8(B[x], B[CHIR1(x)], B[CHIR2(x)])
+
+    UNROLL_25(LOAD_X8);
+    for (iR=24-nr; iR < 24; iR++) {
+        UNROLL_5(STEP_THETA1_X8);
+        UNROLL_25(STEP_THETA_RHO_PI_X8);
+        UNROLL_25(STEP_CHI_X8);
+        A[0] = _mm512_xor_si512(A[0], _mm512_set1_epi64(RC[iR]));
+    }
+    UNROLL_25(STORE_X8);
 }
+#endif /* SHA3_X86_SIMD */
 
-void
-SHA3_Begin(SHA3Context *ctx)
+/* Keccak_f, or Keccak_p for fewer rounds */
+static SHA3_FORCEINLINE void
+sha3_permute(PRUint64 *A, unsigned int nr)
 {
-    PORT_Memset(ctx->A1, 0, sizeof(ctx->A1));
-    PORT_Memset(ctx->A2, 0, sizeof(ctx->A1));
-    PORT_Memset(ctx->buf, 0, sizeof(ctx->buf));
-    ctx->bufSize = 0;
-    DUMP_BYTES("State (in bytes)",ctx->A1);
+    if (nr == 24) {
+        Keccak_f(A);
+    } else {
+        Keccak_p(A, nr);
+    }
 }
 
-unsigned int
-SHA3_FlattenSize(SHA3Context *ctx)
+/* run the scalar permutation on each stream in turn */
+static void
+Keccak_p_xN_generic(PRUint64 *S, unsigned int n, unsigned int nr)
 {
-    return sizeof *ctx;
+    PRUint64 A[X_SIZE*Y_SIZE];
+    unsigned int i, s;
+
+    for (s=0; s < n; s++) {
+        for (i=0; i < X_SIZE*Y_SIZE; i++) {
+            A[i] = SHA3_LANE(S,n,i,s);
+        }
+        sha3_permute(A, nr);
+        for (i=0; i < X_SIZE*Y_SIZE; i++) {
+            SHA3_LANE(S,n,i,s) = A[i];
+        }
+    }
 }
 
-SECStatus
-SHA3_Flatten(SHA3Context *ctx,unsigned char *space)
+#ifdef SHA3_X86_SIMD
+/* on AVX2-only machines, run an 8-way group as two 4-way groups */
+static void
+Keccak_p_x8_avx2(PRUint64 *S, unsigned int nr)
 {
-    PORT_Memcpy(space, ctx, sizeof *ctx);
-    return SECSuccess;
+    PRUint64 S4[2][X_SIZE*Y_SIZE*SHA3_X4];
+    unsigned int i, s;
+
+    for (i=0; i < X_SIZE*Y_SIZE; i++) {
+        for (s=0; s < SHA3_X8; s++) {
+            SHA3_LANE(S4[s/SHA3_X4],SHA3_X4,i,s%SHA3_X4) =
+                                            SHA3_LANE(S,SHA3_X8,i,s);
+        }
+    }
+    Keccak_p_x4_avx2(S4[0], nr);
+    Keccak_p_x4_avx2(S4[1], nr);
+    for (i=0; i < X_SIZE*Y_SIZE; i++) {
+        for (s=0; s < SHA3_X8; s++) {
+            SHA3_LANE(S,SHA3_X8,i,s) =
+                            SHA3_LANE(S4[s/SHA3_X4],SHA3_X4,i,s%SHA3_X4);
+        }
+    }
 }
+#endif /* SHA3_X86_SIMD */
 
-SHA3Context *
-SHA3_Resurrect(unsigned char *space, void *arg)
+static void
+Keccak_p_x4_generic(PRUint64 *S, unsigned int nr)
 {
-    SHA3Context *ctx = SHA3_NewContext();
-    if (ctx)
-        PORT_Memcpy(ctx, space, sizeof *ctx);
-    return ctx;
+    Keccak_p_xN_generic(S, SHA3_X4, nr);
+}
+
+static void
+Keccak_p_x8_generic(PRUint64 *S, unsigned int nr)
+{
+    Keccak_p_xN_generic(S, SHA3_X8, nr);
+}
+
+/*
+ * Backends
+ *
+ * Which permutations we use is decided once, when the library is loaded,
+ * from the best the CPU supports. NSS_SHA3_BACKEND=scalar, avx2 or avx512
+ * forces one of them, so the backends can be compared on the same machine.
+ * A forced backend the CPU can't run is ignored. Single stream hashing
+ * always uses the scalar permutation, inlined into the absorb kernels.
+ *
+ * Until the constructor has run (say, from another library's constructor)
+ * we use the scalar backend, which runs everywhere.
+ */
+typedef struct {
+    const char *name;
+    unsigned int width;     /* streams per group we hash in parallel */
+    unsigned int minLanes;  /* fewest busy streams worth a group */
+    void (*keccak_p_x4)(PRUint64 *S, unsigned int nr);
+    void (*keccak_p_x8)(PRUint64 *S, unsigned int nr);
+} SHA3Backend;
+
+enum { SHA3_BACKEND_SCALAR, SHA3_BACKEND_AVX2, SHA3_BACKEND_AVX512 };
+
+static const SHA3Backend sha3_backends[] = {
+    { "scalar", 1, 2, Keccak_p_x4_generic, Keccak_p_x8_generic },
+#ifdef SHA3_X86_SIMD
+    { "avx2", SHA3_X4, 3, Keccak_p_x4_avx2, Keccak_p_x8_avx2 },
+    { "avx512", SHA3_X8, 2, Keccak_p_x4_avx2, Keccak_p_x8_avx512 },
+#endif
+};
+
+static const SHA3Backend *sha3_backend = &sha3_backends[SHA3_BACKEND_SCALAR];
+
+__attribute__((constructor))
+static void
+sha3_select_backend(void)
+{
+    int best = SHA3_BACKEND_SCALAR;
+    const char *forced;
+    int i;
+
+#ifdef SHA3_X86_SIMD
+    if (avx512_support()) {
+        best = SHA3_BACKEND_AVX512;
+    } else if (avx2_support()) {
+        best = SHA3_BACKEND_AVX2;
+    }
+#endif
+    forced = blapi_forced_backend("NSS_SHA3_BACKEND");
+    if (forced) {
+        for (i=0; i <= best; i++) {
+            if (strcmp(forced, sha3_backends[i].name) == 0) {
+                best = i;
+                break;
+            }
+        }
+    }
+    sha3_backend = &sha3_backends[best];
+}
+
+const char *
+SHA3_GetBackend(void)
+{
+    return sha3_backend->name;
+}
+
+/* Keccak-p[1600,nr] on n interleaved streams */
+static void
+Keccak_p_xN(PRUint64 *S, unsigned int n, unsigned int nr)
+{
+    switch (n) {
+    case SHA3_X4:
+        sha3_backend->keccak_p_x4(S, nr);
+        break;
+    case SHA3_X8:
+        sha3_backend->keccak_p_x8(S, nr);
+        break;
+    default:
+        Keccak_p_xN_generic(S, n, nr);
+        break;
+    }
+}
+
+static SHA3_FORCEINLINE void
+Keccak_f_xN(PRUint64 *S, unsigned int n)
+{
+    Keccak_p_xN(S, n, 24);
+}
+
+/*
+ * Absorb kernels, one for each rate we use:
+ *
+ *    72  SHA3-512
+ *   104  SHA3-384
+ *   136  SHA3-256, SHAKE256
+ *   144  SHA3-224
+ *   168  SHAKE128
+ *
+ * Each is Keccak_absorb with the rate fixed at compile time, so XORing a
+ * block into the state is fully unrolled, with no loop or branch on the
+ * rate.
+ */
+typedef void (*Keccak_absorb_fn)(PRUint64 *S, const unsigned char *N,
+                                 unsigned int blocks);
+
+#define SHA3_ABSORB_KERNEL(r)                                           \
+static void                                                             \
+Keccak_absorb_##r(PRUint64 *S, const unsigned char *N, unsigned int blocks) \
+{                                                                       \
+    Keccak_absorb(S, N, blocks, r, 24);                                 \
+}
+
+SHA3_ABSORB_KERNEL(72)
+SHA3_ABSORB_KERNEL(104)
+SHA3_ABSORB_KERNEL(136)
+SHA3_ABSORB_KERNEL(144)
+SHA3_ABSORB_KERNEL(168)
+
+/* and the same for squeezing, at the SHAKE rates */
+typedef void (*Keccak_squeeze_fn)(PRUint64 *S, unsigned char *Z,
+                                  unsigned int blocks);
+
+#define SHA3_SQUEEZE_KERNEL(r)                                          \
+static void                                                             \
+Keccak_squeeze_##r(PRUint64 *S, unsigned char *Z, unsigned int blocks)  \
+{                                                                       \
+    Keccak_squeeze(S, Z, blocks, r, 24);                                \
+}
+
+SHA3_SQUEEZE_KERNEL(136)
+SHA3_SQUEEZE_KERNEL(168)
+
+/* and the 12 round ones, for TurboSHAKE128 and TurboSHAKE256 */
+#define TURBOSHAKE_ROUNDS 12
+
+#define TURBOSHAKE_KERNELS(r)                                           \
+static void                                                             \
+Keccak_p_absorb_##r(PRUint64 *S, const unsigned char *N, unsigned int blocks) \
+{                                                                       \
+    Keccak_absorb(S, N, blocks, r, TURBOSHAKE_ROUNDS);                  \
+}                                                                       \
+                                                                        \
+static void                                                             \
+Keccak_p_squeeze_##r(PRUint64 *S, unsigned char *Z, unsigned int blocks) \
+{                                                                       \
+    Keccak_squeeze(S, Z, blocks, r, TURBOSHAKE_ROUNDS);                 \
+}
+
+TURBOSHAKE_KERNELS(136)
+TURBOSHAKE_KERNELS(168)
+
+/*
+ * Pick the kernel for rate r and nr rounds. The per variant functions call
+ * this with a constant rate, through inline functions, so the compiler
+ * resolves it to a direct call.
+ */
+static SHA3_FORCEINLINE Keccak_absorb_fn
+sha3_absorb_kernel_p(unsigned int r, unsigned int nr)
+{
+    if (nr == TURBOSHAKE_ROUNDS) {
+        PORT_Assert(r == 136 || r == 168);
+        return r == 136 ? Keccak_p_absorb_136 : Keccak_p_absorb_168;
+    }
+    switch (r) {
+    case 72:
+        return Keccak_absorb_72;
+    case 104:
+        return Keccak_absorb_104;
+    case 136:
+        return Keccak_absorb_136;
+    case 144:
+        return Keccak_absorb_144;
+    default:
+        PORT_Assert(r == 168);
+        return Keccak_absorb_168;
+    }
+}
+
+static SHA3_FORCEINLINE Keccak_absorb_fn
+sha3_absorb_kernel(unsigned int r)
+{
+    return sha3_absorb_kernel_p(r, 24);
+}
+
+static SHA3_FORCEINLINE Keccak_squeeze_fn
+sha3_squeeze_kernel_p(unsigned int r, unsigned int nr)
+{
+    if (nr == TURBOSHAKE_ROUNDS) {
+        PORT_Assert(r == 136 || r == 168);
+        return r == 136 ? Keccak_p_squeeze_136 : Keccak_p_squeeze_168;
+    }
+    switch (r) {
+    case 136:
+        return Keccak_squeeze_136;
+    default:
+        PORT_Assert(r == 168);
+        return Keccak_squeeze_168;
+    }
+}
+
+/*
+ * Absorb len bytes at rate r, with a Keccak-p of nr rounds. The scheduler
+ * only runs the full 24, so it is skipped for fewer.
+ */
+static SHA3_FORCEINLINE void
+sha3_update_p(SHA3Context *ctx, const unsigned char *N, unsigned int len,
+                                     unsigned int r, unsigned int nr)
+{
+    Keccak_absorb_fn absorb = sha3_absorb_kernel_p(r, nr);
+    unsigned int blocks;
+
+    if (nr == 24 && ctx->sched && sha3_sched_update(ctx, N, len, r)) {
+        return;
+    }
+    if (ctx->bufSize) {
+        unsigned int fill = r - ctx->bufSize;
+        if (len < fill) {
+           sha3_xor_bytes(ctx->A1, 1, 0, ctx->bufSize, N, len);
+           ctx->bufSize += len;
+           return;
+        }
+        sha3_xor_bytes(ctx->A1, 1, 0, ctx->bufSize, N, fill);
+        sha3_permute(ctx->A1, nr);
+        ctx->bufSize= 0;
+        N +=fill;
+        len -= fill;
+    }
+    blocks = len / r;
+    if (blocks) {
+        absorb(ctx->A1, N, blocks);
+        N += blocks * r;
+        len -= blocks * r;
+    }
+    if (len) {
+        sha3_xor_bytes(ctx->A1, 1, 0, 0, N, len);
+        ctx->bufSize = len;
+    }
+}
+
+static SHA3_FORCEINLINE void
+sha3_update(SHA3Context *ctx, const unsigned char *N, unsigned int len,
+                                                 unsigned int r)
+{
+    sha3_update_p(ctx, N, len, r, 24);
+}
+
+/* domains include initial padding bit */
+/* NOTE: domain values are bit strings of non-standard byte lengths. Since we
+ * only support byte length hash bits, we know they always start on a byte
+ * boundary. We also know that they will be followed up by the initial padding
+ * bit. The final bit will be added as needed. Also know, bits go from right to
+ * left (sigh) */
+#define SHA3_DOMAIN      0x06
+#define SHAKE_RAW_DOMAIN 0x07
+#define SHAKE_DOMAIN     0x1f
+#define SHA3_FINAL_PAD   0x80
+
+/*
+ * Pad the message: the partial block is already in the state, so the
+ * padding is XORed in after it, and the state is ready for the last
+ * permutation.
+ */
+static SHA3_FORCEINLINE void
+sha3_pad(SHA3Context *ctx, unsigned char domain, unsigned int r)
+{
+    SHA3_XOR_BYTE(ctx->A1, 1, 0, ctx->bufSize, domain);
+    SHA3_XOR_BYTE(ctx->A1, 1, 0, r-1, SHA3_FINAL_PAD);
+    ctx->bufSize = 0;
+}
+
+/*
+ * On little endian machines the state is already in output byte order, so
+ * this is a copy. It is inlined with a constant d from each End/HashBuf,
+ * which the compiler turns into full width stores.
+ */
+static SHA3_FORCEINLINE void
+sha3_unload_state(SHA3Context *ctx, unsigned char *Z, unsigned int d)
+{
+#ifdef PR_BIG_ENDIAN
+    /* now fill remainder of 'd' that is a multiple of 64 */
+    PRUint64 *S = &ctx->A1[0];
+    int i;
+    while (d > sizeof(PRUint64)) {
+        Z[0] =     *S     & 0xff;
+        Z[1] = (*S >>  8) & 0xff;
+        Z[2] = (*S >> 16) & 0xff;
+        Z[3] = (*S >> 24) & 0xff;
+        Z[4] = (*S >> 32) & 0xff;
+        Z[5] = (*S >> 40) & 0xff;
+        Z[6] = (*S >> 48) & 0xff;
+        Z[7] = (*S >> 56) & 0xff;
+        S++;
+        Z += sizeof(PRUint64);
+        d -= sizeof(PRUint64);
+    }
+    /* handle any remaining partials  (SHA224, for instance) */
+    for (i=0; i < d; i++) {
+        Z[i] = ((*S) >> (i*8)) &0xff;
+    }
+#else
+    PORT_Memcpy(Z, ctx->A1, d);
+#endif
+}
+
+static void
+sha3xN_absorb(PRUint64 *S, unsigned int n, const unsigned char *const *Nr,
+                                     unsigned int r, unsigned int nr)
+{
+    unsigned int i, s;
+
+    PORT_Assert((r & 0x7) == 0);
+    for (s=0; s < n; s++) {
+        for (i = 0; i < r / sizeof(PRUint64); ++i) {
+            SHA3_LANE(S,n,i,s) ^= LANE_IN(Nr[s], i);
+        }
+    }
+    Keccak_p_xN(S, n, nr);
+}
+
+/*
+ * Absorb n messages of the same length, including the final padding.
+ * The per-stream tails are padded in the same way as sha3_pad.
+ */
+static void
+sha3xN_absorb_all(PRUint64 *S, unsigned int n, const unsigned char *const *N,
+                  unsigned int len, unsigned char domain, unsigned int r,
+                  unsigned int nr)
+{
+    unsigned char buf[SHA3_MAX_STREAMS][X_SIZE*Y_SIZE*sizeof(PRUint64)];
+    const unsigned char *in[SHA3_MAX_STREAMS];
+    unsigned int offset = 0;
+    unsigned int s;
+
+    PORT_Assert(n <= SHA3_MAX_STREAMS);
+    while (len - offset >= r) {
+        for (s=0; s < n; s++) {
+            in[s] = N[s] + offset;
+        }
+        sha3xN_absorb(S, n, in, r, nr);
+        offset += r;
+    }
+    for (s=0; s < n; s++) {
+        unsigned int tail = len - offset;
+        PORT_Memcpy(buf[s], N[s] + offset, tail);
+        buf[s][tail++] = domain;
+        PORT_Memset(&buf[s][tail], 0, r - tail);
+        buf[s][r-1] |= SHA3_FINAL_PAD;
+        in[s] = buf[s];
+    }
+    sha3xN_absorb(S, n, in, r, nr);
+}
+
+static void
+sha3xN_unload_state(const PRUint64 *S, unsigned int n, unsigned char *const *Z,
+                                                               unsigned int d)
+{
+    unsigned int i, s;
+
+    for (s=0; s < n; s++) {
+        for (i=0; i < d; i++) {
+            Z[s][i] = (SHA3_LANE(S,n,i/8,s) >> ((i%8)*8)) & 0xff;
+        }
+    }
+}
+
+/*
+ * Squeeze d bytes from each of the n streams, permuting again between
+ * blocks as shake_squeeze does.
+ */
+static void
+sha3xN_squeeze(PRUint64 *S, unsigned int n, unsigned char *const *Z,
+                                        unsigned int d, unsigned int r)
+{
+    unsigned char *out[SHA3_MAX_STREAMS];
+    unsigned int offset = 0;
+    unsigned int s;
+
+    for (;;) {
+        for (s=0; s < n; s++) {
+            out[s] = Z[s] + offset;
+        }
+        if (d - offset <= r) {
+            sha3xN_unload_state(S, n, out, d - offset);
+            return;
+        }
+        sha3xN_unload_state(S, n, out, r);
+        offset += r;
+        Keccak_f_xN(S, n);
+    }
+}
+
+static void
+sha3xN_hash(unsigned int n, unsigned char *const *dest,
+            const unsigned char *const *src, unsigned int len,
+            unsigned int r, unsigned int d)
+{
+    PRUint64 S[X_SIZE*Y_SIZE*SHA3_MAX_STREAMS];
+
+    PORT_Memset(S, 0, sizeof S);
+    sha3xN_absorb_all(S, n, src, len, SHA3_DOMAIN, r, 24);
+    sha3xN_squeeze(S, n, dest, d, r);
+    PORT_Memset(S, 0, sizeof S);
+}
+
+
+/*
+ * Pad the last block into the state and run the final permutation, which
+ * only computes the digest lanes. The context has to be restarted with
+ * SHA3_Begin after this.
+ */
+static SHA3_FORCEINLINE void
+sha3_final(SHA3Context *ctx, unsigned int r, unsigned char *Z, unsigned int d)
+{
+    sha3_settle(ctx);
+    sha3_pad(ctx, SHA3_DOMAIN, r);
+    Keccak_f_out(ctx->A1, Z, d);
+}
+
+/*
+ * One shot hash of a message shorter than the rate. The whole message
+ * plus its padding is a single block, so we build that block as the
+ * initial state (the zero state XORed with the block is the block), run
+ * one permutation and copy the digest out. This skips Begin, the context
+ * buffer and the absorb loop entirely.
+ */
+static SHA3_FORCEINLINE void
+sha3_hash_short(unsigned char *Z, const unsigned char *N, unsigned int len,
+                                         unsigned int r, unsigned int d)
+{
+    PRUint64 A[25];
+    unsigned char *B = (unsigned char *)A;
+#ifdef PR_BIG_ENDIAN
+    unsigned int i;
+#endif
+
+    PORT_Assert(len < r);
+    PORT_Memset(A, 0, sizeof A);
+    PORT_Memcpy(B, N, len);
+    B[len] = SHA3_DOMAIN;
+    B[r-1] |= SHA3_FINAL_PAD;
+#ifdef PR_BIG_ENDIAN
+    for (i=0; i < r/sizeof(PRUint64); i++) {
+        A[i] = SHA_HTONLL(A[i]);
+    }
+#endif
+    Keccak_f_out(A, Z, d);
+    PORT_Memset(A, 0, sizeof A);
+}
+
+static SHA3_FORCEINLINE void
+sha3_hash(unsigned char *Z, const unsigned char *N, unsigned int len,
+                                    unsigned int r, unsigned int d)
+{
+    SHA3Context ctx;
+
+    if (len < r) {
+        sha3_hash_short(Z, N, len, r, d);
+        return;
+    }
+    ctx.sched = NULL;
+    ctx.pending = 0;
+    SHA3_Begin(&ctx);
+    sha3_update(&ctx, N, len, r);
+    sha3_final(&ctx, r, Z, d);
+    memset(&ctx, 0, sizeof ctx);
+}
+
+/*
+ * Hash count messages of the same length, in groups as wide as the
+ * backend runs in parallel. A last group of two or more messages is
+ * filled up with copies of its last message, whose digests go to a
+ * scratch buffer; a single message left over is hashed on its own. Even a
+ * half empty group costs less than hashing its messages one by one: on
+ * AVX-512 a group of 8 costs about as much as 1.6 scalar hashes, on AVX2 a
+ * group of 4 about as much as 2.
+ */
+static SHA3_FORCEINLINE void
+sha3_hash_many(unsigned char *const *dest, const unsigned char *const *src,
+               unsigned int count, unsigned int len,
+               unsigned int r, unsigned int d)
+{
+    unsigned int width = sha3_backend->width;
+
+    if (width > 1) {
+        const unsigned char *in[SHA3_MAX_STREAMS];
+        unsigned char *out[SHA3_MAX_STREAMS];
+        unsigned char scratch[64];
+        unsigned int s;
+
+        while (count >= width) {
+            sha3xN_hash(width, dest, src, len, r, d);
+            dest += width;
+            src += width;
+            count -= width;
+        }
+        if (count > 1) {
+            for (s=0; s < width; s++) {
+                in[s] = src[SHA_MIN(s, count-1)];
+                out[s] = (s < count) ? dest[s] : scratch;
+            }
+            sha3xN_hash(width, out, in, len, r, d);
+            count = 0;
+        }
+    }
+    while (count--) {
+        sha3_hash(*dest++, *src++, len, r, d);
+    }
+}
+
+/* constants in bytes, r = (b-c)/8 d = d/8 */
+#define SHA3_224_R 144 /* (1600-448)/8 */
+#define SHA3_224_D  28 /* (224)/8 */
+#define SHA3_256_R 136 /* (1600-512)/8 */
+#define SHA3_256_D  32 /* (256)/8 */
+#define SHA3_384_R 104 /* (1600-768)/8 */
+#define SHA3_384_D  48 /* (384)/8 */
+#define SHA3_512_R  72 /* (1600-1024)/8 */
+#define SHA3_512_D  64 /* (512)/8 */
+#define SHAKE128_R 168 /* (1600-256)/8 */
+#define SHAKE256_R 136 /* (1600-512)/8 */
+
+
+SHA3Context *
+SHA3_NewContext(void )
+{
+    SHA3Context *ctx = PORT_New(SHA3Context);
+    if (ctx) {
+        PORT_Memset(ctx, 0, sizeof(*ctx));
+    }
+    return ctx;
+}
+
+void
+SHA3_DestroyContext(SHA3Context *ctx, PRBool freeit)
+{
+    if (ctx->pending) {
+        sha3_sched_cancel(ctx);
+    }
+    PORT_Memset(ctx, 0, sizeof (*ctx));
+    if (freeit) {
+        PORT_Free(ctx);
+    }
+
+}
+
+void
+SHA3_Begin(SHA3Context *ctx)
+{
+    if (ctx->pending) {
+        sha3_sched_cancel(ctx);
+    }
+    PORT_Memset(ctx->A1, 0, sizeof(ctx->A1));
+    ctx->bufSize = 0;
+    DUMP_BYTES("State (in bytes)",ctx->A1);
+}
+
+unsigned int
+SHA3_FlattenSize(SHA3Context *ctx)
+{
+    return sizeof *ctx;
+}
+
+SECStatus
+SHA3_Flatten(SHA3Context *ctx,unsigned char *space)
+{
+    SHA3Context *flat = (SHA3Context *)space;
+
+    sha3_settle(ctx);
+    PORT_Memcpy(space, ctx, sizeof *ctx);
+    /* the scheduler belongs to this process and this context only */
+    flat->sched = NULL;
+    return SECSuccess;
+}
+
+SHA3Context *
+SHA3_Resurrect(unsigned char *space, void *arg)
+{
+    SHA3Context *ctx = SHA3_NewContext();
+    if (ctx)
+        PORT_Memcpy(ctx, space, sizeof *ctx);
+    return ctx;
+}
+
+void
+SHA3_Clone(SHA3Context *dest, SHA3Context *src)
+{
+    if (dest == src) {
+        return;
+    }
+    if (dest->pending) {
+        sha3_sched_cancel(dest);
+    }
+    sha3_settle(src);
+    PORT_Memcpy(dest->A1, src->A1, sizeof(dest->A1));
+    dest->bufSize = src->bufSize;
+    dest->sched = NULL;
+    dest->pending = 0;
+}
+
+/* the sponge part of a context, without the scheduler fields */
+struct SHA3PrefixStr {
+    PRUint64 A1[X_SIZE*Y_SIZE];
+    unsigned int bufSize;
+};
+
+SHA3Prefix *
+SHA3_NewPrefix(SHA3Context *ctx)
+{
+    SHA3Prefix *prefix = PORT_New(SHA3Prefix);
+
+    if (prefix) {
+        sha3_settle(ctx);
+        PORT_Memcpy(prefix->A1, ctx->A1, sizeof(prefix->A1));
+        prefix->bufSize = ctx->bufSize;
+    }
+    return prefix;
+}
+
+void
+SHA3_DestroyPrefix(SHA3Prefix *prefix)
+{
+    PORT_Memset(prefix, 0, sizeof(*prefix));
+    PORT_Free(prefix);
+}
+
+void
+SHA3_PrefixBegin(SHA3Context *ctx, const SHA3Prefix *prefix)
+{
+    if (ctx->pending) {
+        sha3_sched_cancel(ctx);
+    }
+    PORT_Memcpy(ctx->A1, prefix->A1, sizeof(ctx->A1));
+    ctx->bufSize = prefix->bufSize;
+}
+
+void
+SHA3_224_Update(SHA3Context *ctx, const unsigned char *input,
+                        unsigned int inputLength)
+{
+    sha3_update(ctx, input, inputLength, SHA3_224_R);
+}
+
+void
+SHA3_224_End(SHA3Context *ctx, unsigned char *digest, unsigned int *digestLen,
+                        unsigned int maxDigestLen)
+{
+    unsigned int maxLen = SHA_MIN(maxDigestLen, SHA3_224_D);
+    sha3_final(ctx, SHA3_224_R, digest, maxLen);
+    *digestLen = maxLen;
+}
+
+SECStatus
+SHA3_224_HashBuf(unsigned char *dest, const unsigned char *src,
+               PRUint32 src_length)
+{
+    sha3_hash(dest, src, src_length, SHA3_224_R, SHA3_224_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA2_224_Hash(unsigned char *dest, const char *src)
+{
+    return SHA3_224_HashBuf(dest, (const unsigned char *)src, PORT_Strlen(src));
+}
+
+SECStatus
+SHA3_224_HashBuf4(unsigned char *dest[4], const unsigned char *src[4],
+               PRUint32 src_length)
+{
+    sha3xN_hash(SHA3_X4, dest, src, src_length, SHA3_224_R, SHA3_224_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_224_HashBuf8(unsigned char *dest[8], const unsigned char *src[8],
+               PRUint32 src_length)
+{
+    sha3xN_hash(SHA3_X8, dest, src, src_length, SHA3_224_R, SHA3_224_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_224_HashBufMany(unsigned char *const *dest,
+                    const unsigned char *const *src, unsigned int count,
+                    PRUint32 src_length)
+{
+    sha3_hash_many(dest, src, count, src_length, SHA3_224_R, SHA3_224_D);
+    return SECSuccess;
+}
+
+
+void
+SHA3_256_Update(SHA3Context *ctx, const unsigned char *input,
+                        unsigned int inputLength)
+{
+    sha3_update(ctx, input, inputLength, SHA3_256_R);
+}
+
+void
+SHA3_256_End(SHA3Context *ctx, unsigned char *digest, unsigned int *digestLen,
+                        unsigned int maxDigestLen)
+{
+    unsigned int maxLen = SHA_MIN(maxDigestLen, SHA3_256_D);
+    sha3_final(ctx, SHA3_256_R, digest, maxLen);
+    *digestLen = maxLen;
+}
+
+SECStatus
+SHA3_256_HashBuf(unsigned char *dest, const unsigned char *src,
+               PRUint32 src_length)
+{
+    sha3_hash(dest, src, src_length, SHA3_256_R, SHA3_256_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA2_256_Hash(unsigned char *dest, const char *src)
+{
+    return SHA3_256_HashBuf(dest, (const unsigned char *)src, PORT_Strlen(src));
+}
+
+SECStatus
+SHA3_256_HashBuf4(unsigned char *dest[4], const unsigned char *src[4],
+               PRUint32 src_length)
+{
+    sha3xN_hash(SHA3_X4, dest, src, src_length, SHA3_256_R, SHA3_256_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_256_HashBuf8(unsigned char *dest[8], const unsigned char *src[8],
+               PRUint32 src_length)
+{
+    sha3xN_hash(SHA3_X8, dest, src, src_length, SHA3_256_R, SHA3_256_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_256_HashBufMany(unsigned char *const *dest,
+                    const unsigned char *const *src, unsigned int count,
+                    PRUint32 src_length)
+{
+    sha3_hash_many(dest, src, count, src_length, SHA3_256_R, SHA3_256_D);
+    return SECSuccess;
+}
+
+void
+SHA3_384_Update(SHA3Context *ctx, const unsigned char *input,
+                        unsigned int inputLength)
+{
+    sha3_update(ctx, input, inputLength, SHA3_384_R);
+}
+
+void
+SHA3_384_End(SHA3Context *ctx, unsigned char *digest, unsigned int *digestLen,
+                        unsigned int maxDigestLen)
+{
+    unsigned int maxLen = SHA_MIN(maxDigestLen, SHA3_384_D);
+    sha3_final(ctx, SHA3_384_R, digest, maxLen);
+    *digestLen = maxLen;
+}
+
+SECStatus
+SHA3_384_HashBuf(unsigned char *dest, const unsigned char *src,
+               PRUint32 src_length)
+{
+    sha3_hash(dest, src, src_length, SHA3_384_R, SHA3_384_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA2_384_Hash(unsigned char *dest, const char *src)
+{
+    return SHA3_384_HashBuf(dest, (const unsigned char *)src, PORT_Strlen(src));
+}
+
+SECStatus
+SHA3_384_HashBuf4(unsigned char *dest[4], const unsigned char *src[4],
+               PRUint32 src_length)
+{
+    sha3xN_hash(SHA3_X4, dest, src, src_length, SHA3_384_R, SHA3_384_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_384_HashBuf8(unsigned char *dest[8], const unsigned char *src[8],
+               PRUint32 src_length)
+{
+    sha3xN_hash(SHA3_X8, dest, src, src_length, SHA3_384_R, SHA3_384_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_384_HashBufMany(unsigned char *const *dest,
+                    const unsigned char *const *src, unsigned int count,
+                    PRUint32 src_length)
+{
+    sha3_hash_many(dest, src, count, src_length, SHA3_384_R, SHA3_384_D);
+    return SECSuccess;
+}
+
+void
+SHA3_512_Update(SHA3Context *ctx, const unsigned char *input,
+                        unsigned int inputLength)
+{
+    sha3_update(ctx, input, inputLength, SHA3_512_R);
+}
+
+void
+SHA3_512_End(SHA3Context *ctx, unsigned char *digest, unsigned int *digestLen,
+                        unsigned int maxDigestLen)
+{
+    unsigned int maxLen = SHA_MIN(maxDigestLen, SHA3_512_D);
+    sha3_final(ctx, SHA3_512_R, digest, maxLen);
+    *digestLen = maxLen;
+}
+
+SECStatus
+SHA3_512_HashBuf(unsigned char *dest, const unsigned char *src,
+               PRUint32 src_length)
+{
+    sha3_hash(dest, src, src_length, SHA3_512_R, SHA3_512_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA2_512_Hash(unsigned char *dest, const char *src)
+{
+    return SHA3_512_HashBuf(dest, (const unsigned char *)src, PORT_Strlen(src));
+}
+
+SECStatus
+SHA3_512_HashBuf4(unsigned char *dest[4], const unsigned char *src[4],
+               PRUint32 src_length)
+{
+    sha3xN_hash(SHA3_X4, dest, src, src_length, SHA3_512_R, SHA3_512_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_512_HashBuf8(unsigned char *dest[8], const unsigned char *src[8],
+               PRUint32 src_length)
+{
+    sha3xN_hash(SHA3_X8, dest, src, src_length, SHA3_512_R, SHA3_512_D);
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_512_HashBufMany(unsigned char *const *dest,
+                    const unsigned char *const *src, unsigned int count,
+                    PRUint32 src_length)
+{
+    sha3_hash_many(dest, src, count, src_length, SHA3_512_R, SHA3_512_D);
+    return SECSuccess;
+}
+
+/*
+ * Batches of messages of any length
+ *
+ * Each message is a sequence of steps: XOR a block into the state (the
+ * whole blocks of the message, then the padded tail) and permute; then
+ * permute again for each further block of SHAKE output. After a permutation
+ * that follows the padded tail, up to r bytes of output are copied out.
+ * Every step is "XOR a block if there is one, permute, copy out output if
+ * there is any", so messages at different points of their steps can share
+ * a multi-lane permutation.
+ *
+ * The messages are started longest first, and as soon as one finishes its
+ * lane is refilled with the next one. When no messages are left to start
+ * and too few lanes are still busy for a parallel permutation to be worth
+ * it, the last ones are finished on the scalar permutation.
+ */
+typedef struct {
+    SHA3Job *job;
+    unsigned int step;      /* next step */
+    unsigned int blocks;    /* whole input blocks */
+    unsigned int outLen;    /* output still to be copied out */
+    unsigned char *out;
+} sha3_batch_lane;
+
+typedef struct {
+    unsigned int steps;
+    unsigned int job;
+} sha3_batch_order;
+
+static const struct {
+    unsigned int r;
+    unsigned int d;         /* digest length, 0 for the XOFs */
+    unsigned char domain;
+} sha3_batch_types[] = {
+    { SHA3_224_R, SHA3_224_D, SHA3_DOMAIN },
+    { SHA3_256_R, SHA3_256_D, SHA3_DOMAIN },
+    { SHA3_384_R, SHA3_384_D, SHA3_DOMAIN },
+    { SHA3_512_R, SHA3_512_D, SHA3_DOMAIN },
+    { SHAKE128_R, 0, SHAKE_DOMAIN },
+    { SHAKE256_R, 0, SHAKE_DOMAIN },
+};
+
+static void
+sha3_batch_start(sha3_batch_lane *lane, SHA3Job *job, unsigned int r,
+                                                      unsigned int d)
+{
+    lane->job = job;
+    lane->step = 0;
+    lane->blocks = job->srcLen / r;
+    lane->outLen = d ? d : job->destLen;
+    lane->out = job->dest;
+}
+
+static unsigned int
+sha3_batch_steps(const SHA3Job *job, unsigned int r, unsigned int d)
+{
+    unsigned int outLen = d ? d : job->destLen;
+    unsigned int squeezes = outLen ? (outLen - 1) / r : 0;
+
+    return job->srcLen / r + 1 + squeezes;
+}
+
+/*
+ * The block to XOR into the state for the lane's next step, or NULL when
+ * it is squeezing. The padded tail is built in 'tail'.
+ */
+static const unsigned char *
+sha3_batch_block(const sha3_batch_lane *lane, unsigned char *tail,
+                 unsigned char domain, unsigned int r)
+{
+    unsigned int rest;
+
+    if (lane->step < lane->blocks) {
+        return lane->job->src + lane->step * r;
+    }
+    if (lane->step > lane->blocks) {
+        return NULL;
+    }
+    rest = lane->job->srcLen - lane->blocks * r;
+    PORT_Memcpy(tail, lane->job->src + lane->blocks * r, rest);
+    tail[rest] = domain;
+    PORT_Memset(&tail[rest+1], 0, r-rest-1);
+    tail[r-1] |= SHA3_FINAL_PAD;
+    return tail;
+}
+
+/*
+ * Copy out the output of the step that just ran, from stream s of the n
+ * interleaved states in S. Returns true when the message is done.
+ */
+static PRBool
+sha3_batch_output(sha3_batch_lane *lane, const PRUint64 *S, unsigned int n,
+                  unsigned int s, unsigned int r)
+{
+    PRUint64 L[SHAKE128_R/sizeof(PRUint64)];
+    unsigned int len, i;
+
+    if (lane->step++ < lane->blocks) {
+        return PR_FALSE;
+    }
+    len = SHA_MIN(lane->outLen, r);
+    for (i=0; i < (len+7)/sizeof(PRUint64); i++) {
+        L[i] = SHA3_LANE(S, n, i, s);
+    }
+    sha3_digest_out(lane->out, L, len);
+    lane->out += len;
+    lane->outLen -= len;
+    return lane->outLen == 0;
+}
+
+/* run the rest of a message on the scalar permutation, from state A */
+static void
+sha3_batch_finish(sha3_batch_lane *lane, PRUint64 *A, unsigned char domain,
+                  unsigned int r, SHA3BatchStats *stats)
+{
+    unsigned char tail[SHAKE128_R];
+    const unsigned char *block;
+    unsigned int i;
+
+    if (lane->step < lane->blocks) {
+        sha3_absorb_kernel(r)(A, lane->job->src + lane->step * r,
+                              lane->blocks - lane->step);
+        stats->scalarPermutations += lane->blocks - lane->step;
+        lane->step = lane->blocks;
+    }
+    do {
+        block = sha3_batch_block(lane, tail, domain, r);
+        if (block) {
+            for (i=0; i < r/sizeof(PRUint64); i++) {
+                A[i] ^= LANE_IN(block, i);
+            }
+        }
+        Keccak_f(A);
+        stats->scalarPermutations++;
+    } while (!sha3_batch_output(lane, A, 1, 0, r));
+}
+
+static int
+sha3_batch_compare(const void *a, const void *b)
+{
+    const sha3_batch_order *x = a, *y = b;
+
+    /* longest first */
+    if (x->steps != y->steps) {
+        return x->steps > y->steps ? -1 : 1;
+    }
+    return x->job < y->job ? -1 : (x->job > y->job);
+}
+
+/* init is the state every message starts from, NULL for the empty one */
+static SECStatus
+sha3_hash_batch(SHA3Job *jobs, unsigned int count, const PRUint64 *init,
+                unsigned int r, unsigned int d, unsigned char domain,
+                SHA3BatchStats *stats)
+{
+    PRUint64 S[X_SIZE*Y_SIZE*SHA3_MAX_STREAMS];
+    PRUint64 A[X_SIZE*Y_SIZE];
+    unsigned char tail[SHA3_MAX_STREAMS][SHAKE128_R];
+    sha3_batch_lane lanes[SHA3_MAX_STREAMS];
+    PRBool busy[SHA3_MAX_STREAMS];
+    const unsigned char *block;
+    sha3_batch_order *order;
+    unsigned int width = sha3_backend->width;
+    unsigned int next = 0, active = 0;
+    unsigned int i, s;
+
+    order = PORT_Alloc(count * sizeof(*order));
+    if (count && !order) {
+        return SECFailure;
+    }
+    for (i=0; i < count; i++) {
+        order[i].steps = sha3_batch_steps(&jobs[i], r, d);
+        order[i].job = i;
+    }
+    qsort(order, count, sizeof(*order), sha3_batch_compare);
+
+    PORT_Memset(stats, 0, sizeof(*stats));
+    stats->jobs = count;
+    PORT_Memset(busy, 0, sizeof busy);
+    if (width < sha3_backend->minLanes) {
+        width = 0;
+    }
+
+    for (;;) {
+        for (s=0; s < width && next < count; s++) {
+            if (!busy[s]) {
+                sha3_batch_start(&lanes[s], &jobs[order[next++].job], r, d);
+                for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                    SHA3_LANE(S, width, i, s) = init ? init[i] : 0;
+                }
+                busy[s] = PR_TRUE;
+                active++;
+            }
+        }
+        if (active < sha3_backend->minLanes) {
+            break;
+        }
+
+        for (s=0; s < width; s++) {
+            if (!busy[s]) {
+                continue;
+            }
+            block = sha3_batch_block(&lanes[s], tail[s], domain, r);
+            if (block) {
+                for (i=0; i < r/sizeof(PRUint64); i++) {
+                    SHA3_LANE(S, width, i, s) ^= LANE_IN(block, i);
+                }
+            }
+        }
+        Keccak_f_xN(S, width);
+        stats->permutations++;
+        stats->lanes += width;
+        stats->busyLanes += active;
+
+        for (s=0; s < width; s++) {
+            if (!busy[s]) {
+                continue;
+            }
+            if (sha3_batch_output(&lanes[s], S, width, s, r)) {
+                busy[s] = PR_FALSE;
+                active--;
+            }
+        }
+    }
+
+    /* the stragglers, and everything when we have no parallel backend */
+    for (s=0; s < width; s++) {
+        if (busy[s]) {
+            for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                A[i] = SHA3_LANE(S, width, i, s);
+            }
+            sha3_batch_finish(&lanes[s], A, domain, r, stats);
+        }
+    }
+    while (next < count) {
+        sha3_batch_start(&lanes[0], &jobs[order[next++].job], r, d);
+        if (init) {
+            PORT_Memcpy(A, init, sizeof A);
+        } else {
+            PORT_Memset(A, 0, sizeof A);
+        }
+        sha3_batch_finish(&lanes[0], A, domain, r, stats);
+    }
+
+    PORT_Memset(S, 0, sizeof S);
+    PORT_Memset(A, 0, sizeof A);
+    PORT_Free(order);
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_HashBatch(SHA3Type type, SHA3Job *jobs, unsigned int count,
+                                        SHA3BatchStats *stats)
+{
+    SHA3BatchStats dummy;
+
+    if ((unsigned int)type >= sizeof(sha3_batch_types)/sizeof(sha3_batch_types[0])) {
+        return SECFailure;
+    }
+    return sha3_hash_batch(jobs, count, NULL, sha3_batch_types[type].r,
+                           sha3_batch_types[type].d,
+                           sha3_batch_types[type].domain,
+                           stats ? stats : &dummy);
+}
+
+SECStatus
+SHA3_PrefixHashBatch(const SHA3Prefix *prefix, SHA3Type type, SHA3Job *jobs,
+                     unsigned int count, SHA3BatchStats *stats)
+{
+    SHA3BatchStats dummy;
+
+    if ((unsigned int)type >= sizeof(sha3_batch_types)/sizeof(sha3_batch_types[0])) {
+        return SECFailure;
+    }
+    /* the lanes start on a block boundary */
+    if (prefix->bufSize) {
+        return SECFailure;
+    }
+    return sha3_hash_batch(jobs, count, prefix->A1, sha3_batch_types[type].r,
+                           sha3_batch_types[type].d,
+                           sha3_batch_types[type].domain,
+                           stats ? stats : &dummy);
+}
+
+/*
+ * Job manager
+ *
+ * Streams submit their data as jobs, each one an update of a context, and
+ * a manager with one lane per stream of the backend's group runs the
+ * blocks of all the jobs in its lanes through the multi-buffer Keccak.
+ * Each job is cut into blocks the way sha3_update and sha3_final cut it:
+ * the context's partial block topped up from the data, then the whole
+ * blocks of the data, then the rest of the data is left as a partial
+ * block, which the last job of a stream pads to a final block.
+ *
+ * Jobs come back completed from submit once a full group of lanes has run
+ * until one of them is done, and from flush, which runs whatever is left.
+ * When a flush leaves fewer busy lanes than a parallel permutation is worth
+ * (the backend's minLanes), and on backends with no parallel permutation
+ * at all, jobs are finished on the scalar permutation instead.
+ */
+struct SHA3JobManagerStr {
+    PRUint64 S[X_SIZE*Y_SIZE*SHA3_MAX_STREAMS];
+    SHA3HashJob *lane[SHA3_MAX_STREAMS];
+    unsigned int width;
+    unsigned int busy;
+    unsigned int r;
+    unsigned int d;
+    SHA3HashJob *done;          /* completed, not yet returned */
+    SHA3HashJob *doneTail;
+};
+
+/*
+ * XOR the job's next block into stream s of the n interleaved states in S:
+ * the context's partial block topped up from the data, or a whole block of
+ * the data. Returns true when that leaves a permutation to run, false when
+ * the job has no blocks left; that last call XORs the rest of the data in
+ * as a partial block, padded to a final block for the last job of a stream.
+ */
+static PRBool
+sha3_job_prepare(SHA3HashJob *job, PRUint64 *S, unsigned int n,
+                 unsigned int s, unsigned int r)
+{
+    SHA3Context *ctx = job->ctx;
+    unsigned int fill = r - ctx->bufSize;
+
+    if (job->last) {
+        return PR_FALSE;
+    }
+    if (job->len >= fill) {
+        sha3_xor_bytes(S, n, s, ctx->bufSize, job->data, fill);
+        job->data += fill;
+        job->len -= fill;
+        ctx->bufSize = 0;
+        return PR_TRUE;
+    }
+    sha3_xor_bytes(S, n, s, ctx->bufSize, job->data, job->len);
+    ctx->bufSize += job->len;
+    job->len = 0;
+    if (job->flags & SHA3_JOB_LAST) {
+        SHA3_XOR_BYTE(S, n, s, ctx->bufSize, SHA3_DOMAIN);
+        SHA3_XOR_BYTE(S, n, s, r-1, SHA3_FINAL_PAD);
+        ctx->bufSize = 0;
+        job->last = PR_TRUE;
+        return PR_TRUE;
+    }
+    return PR_FALSE;
+}
+
+/*
+ * After a permutation of stream s of the n interleaved states in S: move
+ * on to the job's next block. Returns true when the job is done, with the
+ * state back in the context, or the digest in the job for the last job of
+ * a stream.
+ */
+static PRBool
+sha3_job_next(SHA3HashJob *job, PRUint64 *S, unsigned int n, unsigned int s,
+              unsigned int r, unsigned int d)
+{
+    PRUint64 L[8];
+    unsigned int i;
+
+    if (job->last) {
+        for (i=0; i < (d+7)/sizeof(PRUint64); i++) {
+            L[i] = SHA3_LANE(S, n, i, s);
+        }
+        sha3_digest_out(job->digest, L, d);
+        job->digestLen = d;
+        return PR_TRUE;
+    }
+    if (sha3_job_prepare(job, S, n, s, r)) {
+        return PR_FALSE;
+    }
+    if (S != job->ctx->A1) {
+        for (i=0; i < X_SIZE*Y_SIZE; i++) {
+            job->ctx->A1[i] = SHA3_LANE(S, n, i, s);
+        }
+    }
+    return PR_TRUE;
+}
+
+static void
+sha3_mgr_complete(SHA3JobManager *mgr, SHA3HashJob *job)
+{
+    job->status = SHA3_JOB_COMPLETE;
+    job->next = NULL;
+    if (mgr->doneTail) {
+        mgr->doneTail->next = job;
+    } else {
+        mgr->done = job;
+    }
+    mgr->doneTail = job;
+}
+
+static SHA3HashJob *
+sha3_mgr_pop(SHA3JobManager *mgr)
+{
+    SHA3HashJob *job = mgr->done;
+
+    if (job) {
+        mgr->done = job->next;
+        if (!mgr->done) {
+            mgr->doneTail = NULL;
+        }
+        job->next = NULL;
+    }
+    return job;
+}
+
+/* run the rest of a job whose state is in its context on Keccak_f */
+static void
+sha3_job_finish(SHA3JobManager *mgr, SHA3HashJob *job)
+{
+    SHA3Context *ctx = job->ctx;
+    unsigned int blocks;
+
+    do {
+        Keccak_f(ctx->A1);
+        /* whole blocks of data go through the fused absorb in one call */
+        if (!job->last && job->len >= mgr->r) {
+            blocks = job->len / mgr->r;
+            sha3_absorb_kernel(mgr->r)(ctx->A1, job->data, blocks);
+            job->data += blocks * mgr->r;
+            job->len -= blocks * mgr->r;
+        }
+    } while (!sha3_job_next(job, ctx->A1, 1, 0, mgr->r, mgr->d));
+    sha3_mgr_complete(mgr, job);
+}
+
+/* one parallel permutation of all the busy lanes */
+static void
+sha3_mgr_step(SHA3JobManager *mgr)
+{
+    unsigned int s;
+
+    Keccak_f_xN(mgr->S, mgr->width);
+    for (s=0; s < mgr->width; s++) {
+        if (mgr->lane[s] &&
+            sha3_job_next(mgr->lane[s], mgr->S, mgr->width, s,
+                          mgr->r, mgr->d)) {
+            sha3_mgr_complete(mgr, mgr->lane[s]);
+            mgr->lane[s] = NULL;
+            mgr->busy--;
+        }
+    }
+}
+
+SHA3JobManager *
+SHA3_NewJobManager(SHA3Type type)
+{
+    SHA3JobManager *mgr;
+
+    if ((unsigned int)type > SHA3_TYPE_512) {
+        return NULL;
+    }
+    mgr = PORT_New(SHA3JobManager);
+    if (!mgr) {
+        return NULL;
+    }
+    PORT_Memset(mgr, 0, sizeof(*mgr));
+    mgr->r = sha3_batch_types[type].r;
+    mgr->d = sha3_batch_types[type].d;
+    mgr->width = sha3_backend->width;
+    if (mgr->width < sha3_backend->minLanes) {
+        mgr->width = 0;
+    }
+    return mgr;
+}
+
+void
+SHA3_DestroyJobManager(SHA3JobManager *mgr)
+{
+    PORT_Memset(mgr, 0, sizeof(*mgr));
+    PORT_Free(mgr);
+}
+
+SHA3HashJob *
+SHA3_SubmitJob(SHA3JobManager *mgr, SHA3HashJob *job,
+               const unsigned char *data, unsigned int len,
+               unsigned int flags)
+{
+    unsigned int i, s;
+
+    PORT_Assert(job->status != SHA3_JOB_PROCESSING);
+    if (flags & SHA3_JOB_FIRST) {
+        SHA3_Begin(job->ctx);
+    }
+    sha3_settle(job->ctx);
+    job->status = SHA3_JOB_PROCESSING;
+    job->data = data;
+    job->len = len;
+    job->flags = flags;
+    job->last = PR_FALSE;
+    job->digestLen = 0;
+    job->next = NULL;
+
+    if (!sha3_job_prepare(job, job->ctx->A1, 1, 0, mgr->r)) {
+        /* all of it went into the partial block */
+        sha3_mgr_complete(mgr, job);
+    } else if (!mgr->width) {
+        sha3_job_finish(mgr, job);
+    } else {
+        for (s=0; mgr->lane[s]; s++)
+            ;
+        for (i=0; i < X_SIZE*Y_SIZE; i++) {
+            SHA3_LANE(mgr->S, mgr->width, i, s) = job->ctx->A1[i];
+        }
+        mgr->lane[s] = job;
+        mgr->busy++;
+        while (mgr->busy == mgr->width) {
+            sha3_mgr_step(mgr);
+        }
+    }
+    return sha3_mgr_pop(mgr);
+}
+
+SHA3HashJob *
+SHA3_FlushJobs(SHA3JobManager *mgr)
+{
+    unsigned int i, s;
+
+    while (!mgr->done && mgr->busy) {
+        if (mgr->busy >= sha3_backend->minLanes) {
+            sha3_mgr_step(mgr);
+            continue;
+        }
+        for (s=0; !mgr->lane[s]; s++)
+            ;
+        for (i=0; i < X_SIZE*Y_SIZE; i++) {
+            mgr->lane[s]->ctx->A1[i] = SHA3_LANE(mgr->S, mgr->width, i, s);
+        }
+        sha3_job_finish(mgr, mgr->lane[s]);
+        mgr->lane[s] = NULL;
+        mgr->busy--;
+    }
+    return sha3_mgr_pop(mgr);
+}
+
+/*
+ * Scheduler
+ *
+ * A server with many open streams sees lots of small updates, and each
+ * block they complete would get a scalar permutation of its own. A
+ * context attached to a scheduler instead XORs in the block a small update
+ * completes and leaves its permutation with the scheduler; the rest of
+ * the update waits in the scheduler too, since it can only go into the
+ * state after that permutation. The queued contexts are permuted together
+ * in one multi-buffer permutation once the queue holds a full group, or
+ * when the caller flushes the scheduler (say, on a timer).
+ *
+ * Until then the context's state is out of date: small updates add to the
+ * waiting tail, and anything else that needs the state (the next block,
+ * End, Flatten, ...) runs the queue first. Updates of a whole block or
+ * more don't wait; they are absorbed on the spot like they would be
+ * without a scheduler.
+ */
+struct SHA3SchedulerStr {
+    PRUint64 S[X_SIZE*Y_SIZE*SHA3_MAX_STREAMS];
+    SHA3Context *ctx[SHA3_MAX_STREAMS];
+    unsigned char tail[SHA3_MAX_STREAMS][SHAKE128_R];   /* ctx->bufSize */
+    unsigned int queued;
+    unsigned int width;
+    unsigned int r;
+};
+
+static void
+sha3_sched_run(SHA3Scheduler *sched)
+{
+    SHA3Context *ctx;
+    unsigned int i, q, n = sched->width;
+
+    if (sched->queued < sha3_backend->minLanes) {
+        for (q=0; q < sched->queued; q++) {
+            Keccak_f(sched->ctx[q]->A1);
+        }
+    } else {
+        for (q=0; q < sched->queued; q++) {
+            for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                SHA3_LANE(sched->S, n, i, q) = sched->ctx[q]->A1[i];
+            }
+        }
+        Keccak_f_xN(sched->S, n);
+        for (q=0; q < sched->queued; q++) {
+            for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                sched->ctx[q]->A1[i] = SHA3_LANE(sched->S, n, i, q);
+            }
+        }
+    }
+    for (q=0; q < sched->queued; q++) {
+        ctx = sched->ctx[q];
+        sha3_xor_bytes(ctx->A1, 1, 0, 0, sched->tail[q], ctx->bufSize);
+        ctx->pending = 0;
+    }
+    sched->queued = 0;
+}
+
+/* take the context out of the queue, without running its permutation */
+static void
+sha3_sched_cancel(SHA3Context *ctx)
+{
+    SHA3Scheduler *sched = ctx->sched;
+    unsigned int q = ctx->pending - 1;
+    unsigned int last = --sched->queued;
+
+    if (q != last) {
+        sched->ctx[q] = sched->ctx[last];
+        PORT_Memcpy(sched->tail[q], sched->tail[last],
+                    sched->ctx[last]->bufSize);
+        sched->ctx[q]->pending = q + 1;
+    }
+    ctx->pending = 0;
+}
+
+/*
+ * Called by sha3_update for a context with a scheduler. Returns true if it
+ * took care of the update, false if sha3_update should go ahead with it.
+ */
+static PRBool
+sha3_sched_update(SHA3Context *ctx, const unsigned char *N, unsigned int len,
+                  unsigned int r)
+{
+    SHA3Scheduler *sched = ctx->sched;
+    unsigned int fill, q;
+
+    PORT_Assert(r == sched->r);
+    if (ctx->pending) {
+        if (len < r - ctx->bufSize) {
+            /* still short of a block, it can wait with the rest */
+            PORT_Memcpy(&sched->tail[ctx->pending-1][ctx->bufSize], N, len);
+            ctx->bufSize += len;
+            return PR_TRUE;
+        }
+        sha3_sched_run(sched);
+    }
+    fill = r - ctx->bufSize;
+    if (len < fill || !sched->width || len - fill >= r) {
+        return PR_FALSE;
+    }
+
+    q = sched->queued++;
+    sha3_xor_bytes(ctx->A1, 1, 0, ctx->bufSize, N, fill);
+    sched->ctx[q] = ctx;
+    ctx->pending = q + 1;
+    PORT_Memcpy(sched->tail[q], N + fill, len - fill);
+    ctx->bufSize = len - fill;
+    if (sched->queued == sched->width) {
+        sha3_sched_run(sched);
+    }
+    return PR_TRUE;
+}
+
+SHA3Scheduler *
+SHA3_NewScheduler(SHA3Type type)
+{
+    SHA3Scheduler *sched;
+
+    if ((unsigned int)type > SHA3_TYPE_512) {
+        return NULL;
+    }
+    sched = PORT_New(SHA3Scheduler);
+    if (!sched) {
+        return NULL;
+    }
+    PORT_Memset(sched, 0, sizeof(*sched));
+    sched->r = sha3_batch_types[type].r;
+    sched->width = sha3_backend->width;
+    if (sched->width < sha3_backend->minLanes) {
+        sched->width = 0;
+    }
+    return sched;
+}
+
+void
+SHA3_FlushScheduler(SHA3Scheduler *sched)
+{
+    sha3_sched_run(sched);
+}
+
+void
+SHA3_DestroyScheduler(SHA3Scheduler *sched)
+{
+    sha3_sched_run(sched);
+    PORT_Memset(sched, 0, sizeof(*sched));
+    PORT_Free(sched);
+}
+
+void
+SHA3_SetScheduler(SHA3Context *ctx, SHA3Scheduler *sched)
+{
+    sha3_settle(ctx);
+    ctx->sched = sched;
+}
+
+/*
+ * Context table
+ *
+ * For very many streams, a table keeps their states in groups of as many
+ * streams as the backend permutes at once, interleaved like the states of
+ * the multi-buffer Keccak, so a group is permuted where it lies. A stream
+ * is a handle, its index in the table. As in a context, its partial block
+ * is XORed straight into its state.
+ *
+ * A block that an update completes is XORed into the state right away,
+ * but the permutation that should follow is only owed: it runs together
+ * with those of the rest of the group when the stream needs its state
+ * again (its next block, or End), or on SHA3_TableFlush. Input that comes
+ * while the permutation is owed can't go into the state yet, so it waits
+ * in a tail slot, as the scheduler's tails do. The slots are shared by the
+ * whole table, since only owed streams hold one; when they run out, the
+ * groups holding them are run, which empties them all.
+ */
+#define SHA3_TABLE_TAILS 256
+
+struct SHA3TableStr {
+    PRUint64 *S;                /* the groups */
+    unsigned char *bufSize;
+    unsigned short *tailSlot;   /* per stream, its tail slot + 1, or 0 */
+    unsigned char *owed;        /* per group, streams owed a permutation */
+    unsigned int *free;         /* free handles */
+    unsigned int nfree;
+    unsigned char *tail;        /* r bytes per slot */
+    unsigned int *tailOwner;    /* per slot, the stream holding it */
+    unsigned short *freeTails;
+    unsigned int nfreeTails;
+    unsigned int ntails;
+    unsigned int capacity;
+    unsigned int width;
+    unsigned int r;
+    unsigned int d;
+};
+
+#define SHA3_TABLE_GROUP(t, h) (&(t)->S[((h) / (t)->width) * \
+                                    X_SIZE*Y_SIZE*(t)->width])
+
+/* give the tail slot of stream h back, if it has one */
+static void
+sha3_table_free_tail(SHA3Table *t, unsigned int h)
+{
+    if (t->tailSlot[h]) {
+        t->freeTails[t->nfreeTails++] = t->tailSlot[h] - 1;
+        t->tailSlot[h] = 0;
+    }
+}
+
+/*
+ * run the permutations owed by the streams of group g, then XOR in the
+ * tails that were waiting for them
+ */
+static void
+sha3_table_run(SHA3Table *t, unsigned int g)
+{
+    PRUint64 save[SHA3_MAX_STREAMS][X_SIZE*Y_SIZE];
+    PRUint64 A[X_SIZE*Y_SIZE];
+    PRUint64 *G = &t->S[g*X_SIZE*Y_SIZE*t->width];
+    unsigned int owed = t->owed[g];
+    unsigned int n = t->width, busy = 0;
+    unsigned int i, s, h;
+
+    if (!owed) {
+        return;
+    }
+    for (s=0; s < n; s++) {
+        busy += (owed >> s) & 1;
+    }
+    if (busy < sha3_backend->minLanes) {
+        for (s=0; s < n; s++) {
+            if (!(owed & (1 << s))) {
+                continue;
+            }
+            for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                A[i] = SHA3_LANE(G, n, i, s);
+            }
+            Keccak_f(A);
+            for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                SHA3_LANE(G, n, i, s) = A[i];
+            }
+        }
+    } else {
+        /* the streams that aren't owed one get their state put back */
+        for (s=0; s < n; s++) {
+            if (!(owed & (1 << s))) {
+                for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                    save[s][i] = SHA3_LANE(G, n, i, s);
+                }
+            }
+        }
+        Keccak_f_xN(G, n);
+        for (s=0; s < n; s++) {
+            if (!(owed & (1 << s))) {
+                for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                    SHA3_LANE(G, n, i, s) = save[s][i];
+                }
+            }
+        }
+    }
+    t->owed[g] = 0;
+    for (s=0; s < n; s++) {
+        h = g*n + s;
+        if ((owed & (1 << s)) && t->tailSlot[h]) {
+            sha3_xor_bytes(G, n, s, 0, &t->tail[(t->tailSlot[h] - 1) * t->r],
+                           t->bufSize[h]);
+            sha3_table_free_tail(t, h);
+        }
+    }
+}
+
+/* out of tail slots: run the groups holding them, which frees them all */
+static void
+sha3_table_spill(SHA3Table *t)
+{
+    unsigned int i;
+
+    for (i=0; i < t->ntails; i++) {
+        sha3_table_run(t, t->tailOwner[i] / t->width);
+    }
+}
+
+SHA3Table *
+SHA3_NewTable(SHA3Type type, unsigned int capacity)
+{
+    SHA3Table *t;
+    unsigned int groups, h, i;
+
+    if ((unsigned int)type > SHA3_TYPE_512 || capacity == 0) {
+        return NULL;
+    }
+    t = PORT_New(SHA3Table);
+    if (!t) {
+        return NULL;
+    }
+    PORT_Memset(t, 0, sizeof(*t));
+    t->r = sha3_batch_types[type].r;
+    t->d = sha3_batch_types[type].d;
+    t->capacity = capacity;
+    t->width = sha3_backend->width;
+    if (t->width < sha3_backend->minLanes) {
+        t->width = 1;
+    }
+    groups = (capacity + t->width - 1) / t->width;
+    t->ntails = SHA_MIN(capacity, SHA3_TABLE_TAILS);
+
+    t->S = PORT_ZAlloc(groups * t->width * X_SIZE*Y_SIZE * sizeof(PRUint64));
+    t->bufSize = PORT_ZAlloc(capacity);
+    t->tailSlot = PORT_ZAlloc(capacity * sizeof(unsigned short));
+    t->owed = PORT_ZAlloc(groups);
+    t->free = PORT_Alloc(capacity * sizeof(unsigned int));
+    t->tail = PORT_ZAlloc(t->ntails * t->r);
+    t->tailOwner = PORT_Alloc(t->ntails * sizeof(unsigned int));
+    t->freeTails = PORT_Alloc(t->ntails * sizeof(unsigned short));
+    if (!t->S || !t->bufSize || !t->tailSlot || !t->owed || !t->free ||
+        !t->tail || !t->tailOwner || !t->freeTails) {
+        SHA3_DestroyTable(t);
+        return NULL;
+    }
+    /* hand out the low handles first, so streams fill whole groups */
+    for (h=0; h < capacity; h++) {
+        t->free[h] = capacity - 1 - h;
+    }
+    t->nfree = capacity;
+    for (i=0; i < t->ntails; i++) {
+        t->freeTails[i] = i;
+    }
+    t->nfreeTails = t->ntails;
+    return t;
+}
+
+void
+SHA3_DestroyTable(SHA3Table *t)
+{
+    unsigned int groups = (t->capacity + t->width - 1) / t->width;
+
+    if (t->S) {
+        PORT_Memset(t->S, 0,
+                    groups * t->width * X_SIZE*Y_SIZE * sizeof(PRUint64));
+    }
+    if (t->tail) {
+        PORT_Memset(t->tail, 0, t->ntails * t->r);
+    }
+    PORT_Free(t->S);
+    PORT_Free(t->bufSize);
+    PORT_Free(t->tailSlot);
+    PORT_Free(t->owed);
+    PORT_Free(t->free);
+    PORT_Free(t->tail);
+    PORT_Free(t->tailOwner);
+    PORT_Free(t->freeTails);
+    PORT_Free(t);
+}
+
+SECStatus
+SHA3_TableOpen(SHA3Table *t, unsigned int *handle)
+{
+    if (!t->nfree) {
+        return SECFailure;
+    }
+    *handle = t->free[--t->nfree];
+    return SECSuccess;
+}
+
+/* start stream h over: zero state, no tail, nothing owed */
+static void
+sha3_table_reset(SHA3Table *t, unsigned int h)
+{
+    PRUint64 *G = SHA3_TABLE_GROUP(t, h);
+    unsigned int s = h % t->width;
+    unsigned int i;
+
+    for (i=0; i < X_SIZE*Y_SIZE; i++) {
+        SHA3_LANE(G, t->width, i, s) = 0;
+    }
+    if (t->tailSlot[h]) {
+        PORT_Memset(&t->tail[(t->tailSlot[h] - 1) * t->r], 0, t->r);
+        sha3_table_free_tail(t, h);
+    }
+    t->bufSize[h] = 0;
+    t->owed[h / t->width] &= ~(1 << s);
+}
+
+void
+SHA3_TableClose(SHA3Table *t, unsigned int h)
+{
+    PORT_Assert(h < t->capacity);
+    sha3_table_reset(t, h);
+    t->free[t->nfree++] = h;
+}
+
+void
+SHA3_TableUpdate(SHA3Table *t, unsigned int h, const unsigned char *N,
+                 unsigned int len)
+{
+    PRUint64 A[X_SIZE*Y_SIZE];
+    PRUint64 *G = SHA3_TABLE_GROUP(t, h);
+    unsigned int g = h / t->width, s = h % t->width, n = t->width;
+    unsigned int r = t->r;
+    unsigned int fill, blocks, i, slot;
+
+    PORT_Assert(h < t->capacity);
+    while (len) {
+        fill = r - t->bufSize[h];
+        if (t->owed[g] & (1 << s)) {
+            if (len >= fill) {
+                /* this completes a block, for which we need the state */
+                sha3_table_run(t, g);
+                continue;
+            }
+            if (!t->tailSlot[h]) {
+                if (!t->nfreeTails) {
+                    /* may run our group too, so look again */
+                    sha3_table_spill(t);
+                    continue;
+                }
+                slot = t->freeTails[--t->nfreeTails];
+                t->tailOwner[slot] = h;
+                t->tailSlot[h] = slot + 1;
+            }
+            PORT_Memcpy(&t->tail[(t->tailSlot[h] - 1) * r + t->bufSize[h]],
+                        N, len);
+            t->bufSize[h] += len;
+            return;
+        }
+        if (len < fill) {
+            sha3_xor_bytes(G, n, s, t->bufSize[h], N, len);
+            t->bufSize[h] += len;
+            return;
+        }
+        sha3_xor_bytes(G, n, s, t->bufSize[h], N, fill);
+        N += fill;
+        len -= fill;
+        t->bufSize[h] = 0;
+        t->owed[g] |= 1 << s;
+
+        /* whole blocks straight from the input don't wait for the group */
+        if (len >= r) {
+            sha3_table_run(t, g);
+            blocks = len / r;
+            for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                A[i] = SHA3_LANE(G, n, i, s);
+            }
+            sha3_absorb_kernel(r)(A, N, blocks);
+            for (i=0; i < X_SIZE*Y_SIZE; i++) {
+                SHA3_LANE(G, n, i, s) = A[i];
+            }
+            N += blocks * r;
+            len -= blocks * r;
+        }
+    }
+}
+
+void
+SHA3_TableEnd(SHA3Table *t, unsigned int h, unsigned char *digest,
+              unsigned int *digestLen, unsigned int maxDigestLen)
+{
+    PRUint64 A[X_SIZE*Y_SIZE];
+    PRUint64 *G = SHA3_TABLE_GROUP(t, h);
+    unsigned int g = h / t->width, s = h % t->width, n = t->width;
+    unsigned int maxLen = SHA_MIN(maxDigestLen, t->d);
+    unsigned int i;
+
+    PORT_Assert(h < t->capacity);
+    if (t->owed[g] & (1 << s)) {
+        sha3_table_run(t, g);
+    }
+    SHA3_XOR_BYTE(G, n, s, t->bufSize[h], SHA3_DOMAIN);
+    SHA3_XOR_BYTE(G, n, s, t->r-1, SHA3_FINAL_PAD);
+    for (i=0; i < X_SIZE*Y_SIZE; i++) {
+        A[i] = SHA3_LANE(G, n, i, s);
+    }
+    Keccak_f_out(A, digest, maxLen);
+    *digestLen = maxLen;
+    PORT_Memset(A, 0, sizeof A);
+    sha3_table_reset(t, h);
 }
 
 void
-SHA3_224_Update(SHA3Context *ctx, const unsigned char *input,
-                        unsigned int inputLength)
+SHA3_TableFlush(SHA3Table *t)
+{
+    unsigned int groups = (t->capacity + t->width - 1) / t->width;
+    unsigned int g;
+
+    for (g=0; g < groups; g++) {
+        sha3_table_run(t, g);
+    }
+}
+
+/*
+ * Checkpoints
+ *
+ * Byte 0 is the version, bytes 1 and 2 the rate and the domain, byte 3
+ * bufSize, then the state, lane by lane, little endian. The rate and the
+ * domain are enough to tell the hashes apart; they are checked against
+ * the table of hashes so that a corrupted checkpoint can't give us a rate
+ * the sponge code doesn't handle. Only the four SHA3 hashes are taken:
+ * SHAKE is resumed through a SHAKEContext, which has no checkpoints, so
+ * a SHAKE checkpoint could never be continued.
+ */
+#define SHA3_CHECKPOINT_HDR 4
+
+SECStatus
+SHA3_SaveCheckpoint(SHA3Context *ctx, SHA3Type type, unsigned char *space,
+                    unsigned int len)
+{
+    PRUint64 L;
+    unsigned int i;
+
+    if ((unsigned int)type > SHA3_TYPE_512 || len < SHA3_CHECKPOINT_LEN) {
+        return SECFailure;
+    }
+    sha3_settle(ctx);
+    PORT_Assert(ctx->bufSize < sha3_batch_types[type].r);
+    space[0] = SHA3_CHECKPOINT_VERSION;
+    space[1] = sha3_batch_types[type].r;
+    space[2] = sha3_batch_types[type].domain;
+    space[3] = ctx->bufSize;
+    for (i=0; i < X_SIZE*Y_SIZE; i++) {
+        L = ctx->A1[i];
+        sha3_digest_out(&space[SHA3_CHECKPOINT_HDR + i*sizeof(PRUint64)],
+                        &L, sizeof(PRUint64));
+    }
+    return SECSuccess;
+}
+
+SECStatus
+SHA3_LoadCheckpoint(SHA3Context *ctx, SHA3Type *type,
+                    const unsigned char *space, unsigned int len)
+{
+    unsigned int i, t;
+
+    if (len < SHA3_CHECKPOINT_LEN || space[0] != SHA3_CHECKPOINT_VERSION) {
+        return SECFailure;
+    }
+    for (t=0; t <= SHA3_TYPE_512; t++) {
+        if (sha3_batch_types[t].r == space[1] &&
+            sha3_batch_types[t].domain == space[2]) {
+            break;
+        }
+    }
+    if (t > SHA3_TYPE_512 || space[3] >= sha3_batch_types[t].r) {
+        return SECFailure;
+    }
+    SHA3_Begin(ctx);
+    for (i=0; i < X_SIZE*Y_SIZE; i++) {
+        ctx->A1[i] = LANE_IN(&space[SHA3_CHECKPOINT_HDR], i);
+    }
+    ctx->bufSize = space[3];
+    *type = (SHA3Type)t;
+    return SECSuccess;
+}
+
+/* copy len bytes of the state, starting at byte off, to Z */
+static SHA3_FORCEINLINE void
+sha3_extract_bytes(const PRUint64 *A, unsigned int off, unsigned char *Z,
+                   unsigned int len)
+{
+#ifdef PR_BIG_ENDIAN
+    for (; len; off++, Z++, len--) {
+        *Z = A[off/8] >> (8*(off & 7));
+    }
+#else
+    PORT_Memcpy(Z, (const unsigned char *)A + off, len);
+#endif
+}
+
+
+/*
+ * SHAKE128 and SHAKE256 (FIPS 202), and RawSHAKE
+ *
+ * After the last block is padded, output comes out of the state a rate
+ * sized block at a time, with a permutation before each block. 'out'
+ * counts the bytes of the current block that have been returned, and is r
+ * right after the padding, so the first squeeze starts with a permutation.
+ * Whole blocks go through the squeeze kernel, which writes them straight
+ * to the output a lane at a time; only the ends of a request that start or
+ * stop inside a block are copied out of the stored state.
+ */
+static void
+sha3_squeeze_p(PRUint64 *A, unsigned int r, unsigned int nr,
+               unsigned int *out, unsigned char *Z, unsigned int len)
+{
+    unsigned int n, blocks;
+
+    if (*out < r) {
+        n = SHA_MIN(len, r - *out);
+        sha3_extract_bytes(A, *out, Z, n);
+        *out += n;
+        Z += n;
+        len -= n;
+    }
+    blocks = len / r;
+    if (blocks) {
+        sha3_squeeze_kernel_p(r, nr)(A, Z, blocks);
+        Z += blocks * r;
+        len -= blocks * r;
+    }
+    if (len) {
+        sha3_permute(A, nr);
+        sha3_extract_bytes(A, 0, Z, len);
+        *out = len;
+    }
+}
+
+static SHA3_FORCEINLINE void
+sha3_squeeze(PRUint64 *A, unsigned int r, unsigned int *out,
+             unsigned char *Z, unsigned int len)
+{
+    sha3_squeeze_p(A, r, 24, out, Z, len);
+}
+
+struct SHAKEContextStr {
+    SHA3Context ctx;
+    unsigned int r;
+    unsigned int rounds;    /* 24, or TURBOSHAKE_ROUNDS */
+    unsigned char domain;
+    PRBool squeezing;
+    unsigned int out;       /* bytes of the output block already returned */
+};
+
+/* set up a SHAKEContext that lives in another structure, or on the stack */
+static void
+shake_init(SHAKEContext *cx, unsigned int r, unsigned int rounds,
+           unsigned char domain)
+{
+    cx->ctx.sched = NULL;
+    cx->ctx.pending = 0;
+    cx->r = r;
+    cx->rounds = rounds;
+    cx->domain = domain;
+    SHAKE_Begin(cx);
+}
+
+SHAKEContext *
+SHAKE_NewContext(SHA3Type type)
+{
+    SHAKEContext *cx;
+
+    if (type != SHA3_TYPE_SHAKE128 && type != SHA3_TYPE_SHAKE256) {
+        return NULL;
+    }
+    cx = PORT_New(SHAKEContext);
+    if (cx) {
+        shake_init(cx, type == SHA3_TYPE_SHAKE128 ? SHAKE128_R : SHAKE256_R,
+                   24, SHAKE_DOMAIN);
+    }
+    return cx;
+}
+
+/*
+ * TurboSHAKE is SHAKE with Keccak-p[1600,12] and the domain byte D in place
+ * of SHAKE's suffix; D carries its own first padding bit, so it goes into
+ * the state where SHAKE_DOMAIN would.
+ */
+SHAKEContext *
+TurboSHAKE_NewContext(SHA3Type type, unsigned char D)
+{
+    SHAKEContext *cx;
+
+    if (D < 0x01 || D > 0x7f) {
+        return NULL;
+    }
+    cx = SHAKE_NewContext(type);
+    if (cx) {
+        cx->rounds = TURBOSHAKE_ROUNDS;
+        cx->domain = D;
+    }
+    return cx;
+}
+
+void
+SHAKE_DestroyContext(SHAKEContext *cx, PRBool freeit)
+{
+    PORT_Memset(cx, 0, sizeof(*cx));
+    if (freeit) {
+        PORT_Free(cx);
+    }
+}
+
+void
+SHAKE_Begin(SHAKEContext *cx)
+{
+    SHA3_Begin(&cx->ctx);
+    cx->squeezing = PR_FALSE;
+    cx->out = 0;
+}
+
+SECStatus
+SHAKE_Absorb(SHAKEContext *cx, const unsigned char *input,
+             unsigned int inputLen)
+{
+    if (cx->squeezing) {
+        return SECFailure;
+    }
+    sha3_update_p(&cx->ctx, input, inputLen, cx->r, cx->rounds);
+    return SECSuccess;
+}
+
+void
+SHAKE_Squeeze(SHAKEContext *cx, unsigned char *output, unsigned int outputLen)
+{
+    if (!cx->squeezing) {
+        sha3_pad(&cx->ctx, cx->domain, cx->r);
+        cx->squeezing = PR_TRUE;
+        cx->out = cx->r;
+    }
+    sha3_squeeze_p(cx->ctx.A1, cx->r, cx->rounds, &cx->out,
+                   output, outputLen);
+}
+
+static SHA3_FORCEINLINE void
+shake(const unsigned char *message, unsigned int len, unsigned char *out,
+      unsigned int outLen, unsigned char domain, unsigned int r,
+      unsigned int nr)
+{
+    SHA3Context ctx;
+    unsigned int pos = r;
+
+    ctx.sched = NULL;
+    ctx.pending = 0;
+    SHA3_Begin(&ctx);
+    sha3_update_p(&ctx, message, len, r, nr);
+    sha3_pad(&ctx, domain, r);
+    sha3_squeeze_p(ctx.A1, r, nr, &pos, out, outLen);
+    PORT_Memset(&ctx, 0, sizeof ctx);
+}
+
+void
+SHAKE128_Raw(const unsigned char *message, unsigned int len,
+             unsigned char *out, unsigned int outLen)
+{
+    shake(message, len, out, outLen, SHAKE_RAW_DOMAIN, SHAKE128_R, 24);
+}
+
+void
+SHAKE128(const unsigned char *message, unsigned int len,
+         unsigned char *out, unsigned int outLen)
+{
+    shake(message, len, out, outLen, SHAKE_DOMAIN, SHAKE128_R, 24);
+}
+
+void
+SHAKE256_Raw(const unsigned char *message, unsigned int len,
+             unsigned char *out, unsigned int outLen)
+{
+    shake(message, len, out, outLen, SHAKE_RAW_DOMAIN, SHAKE256_R, 24);
+}
+
+void
+SHAKE256(const unsigned char *message, unsigned int len,
+         unsigned char *out, unsigned int outLen)
+{
+    shake(message, len, out, outLen, SHAKE_DOMAIN, SHAKE256_R, 24);
+}
+
+void
+TurboSHAKE128(const unsigned char *message, unsigned int len,
+              unsigned char D, unsigned char *out, unsigned int outLen)
+{
+    PORT_Assert(D >= 0x01 && D <= 0x7f);
+    shake(message, len, out, outLen, D, SHAKE128_R, TURBOSHAKE_ROUNDS);
+}
+
+void
+TurboSHAKE256(const unsigned char *message, unsigned int len,
+              unsigned char D, unsigned char *out, unsigned int outLen)
+{
+    PORT_Assert(D >= 0x01 && D <= 0x7f);
+    shake(message, len, out, outLen, D, SHAKE256_R, TURBOSHAKE_ROUNDS);
+}
+
+/*
+ * Multi-lane SHAKE
+ *
+ * Up to SHA3_MAX_STREAMS SHAKE streams kept in the interleaved layout and
+ * permuted together, for schemes that expand many streams at once (the
+ * matrix of ML-KEM is k*k SHAKE128 streams of seed || j || i). All the
+ * lanes take the same number of input bytes, so they share bufSize, and
+ * are squeezed a block at a time in lockstep. Lanes past n are idle;
+ * they are permuted with the rest, which costs nothing extra on a SIMD
+ * backend. On the scalar backend the group is just the n lanes.
+ */
+struct SHAKEMultiContextStr {
+    PRUint64 S[X_SIZE*Y_SIZE*SHA3_MAX_STREAMS];
+    unsigned int n;         /* lanes in use */
+    unsigned int width;     /* lanes permuted: SHA3_X4 or SHA3_X8 */
+    unsigned int r;
+    unsigned int bufSize;
+    PRBool squeezing;
+};
+
+SHAKEMultiContext *
+SHAKE_NewMultiContext(SHA3Type type, unsigned int lanes)
+{
+    SHAKEMultiContext *mc;
+
+    if ((type != SHA3_TYPE_SHAKE128 && type != SHA3_TYPE_SHAKE256) ||
+        lanes == 0 || lanes > SHA3_MAX_STREAMS) {
+        return NULL;
+    }
+    mc = PORT_New(SHAKEMultiContext);
+    if (mc) {
+        mc->n = lanes;
+        /*
+         * Without SIMD, idle lanes would only cost permutations. With
+         * AVX-512 a group of 8 is cheaper than the AVX2 group of 4.
+         */
+        if (sha3_backend->width == 1) {
+            mc->width = lanes;
+        } else if (lanes > SHA3_X4 || sha3_backend->width == SHA3_X8) {
+            mc->width = SHA3_X8;
+        } else {
+            mc->width = SHA3_X4;
+        }
+        mc->r = type == SHA3_TYPE_SHAKE128 ? SHAKE128_R : SHAKE256_R;
+        SHAKE_MultiBegin(mc);
+    }
+    return mc;
+}
+
+void
+SHAKE_DestroyMultiContext(SHAKEMultiContext *mc)
+{
+    PORT_Memset(mc, 0, sizeof(*mc));
+    PORT_Free(mc);
+}
+
+void
+SHAKE_MultiBegin(SHAKEMultiContext *mc)
+{
+    PORT_Memset(mc->S, 0, sizeof(mc->S));
+    mc->bufSize = 0;
+    mc->squeezing = PR_FALSE;
+}
+
+SECStatus
+SHAKE_MultiFork(SHAKEMultiContext *mc, SHAKEContext *seed)
+{
+    unsigned int i, s;
+
+    if (seed->r != mc->r || seed->rounds != 24 ||
+        seed->domain != SHAKE_DOMAIN || seed->squeezing) {
+        return SECFailure;
+    }
+    sha3_settle(&seed->ctx);
+    for (i=0; i < X_SIZE*Y_SIZE; i++) {
+        for (s=0; s < mc->width; s++) {
+            SHA3_LANE(mc->S, mc->width, i, s) = seed->ctx.A1[i];
+        }
+    }
+    mc->bufSize = seed->ctx.bufSize;
+    mc->squeezing = PR_FALSE;
+    return SECSuccess;
+}
+
+SECStatus
+SHAKE_MultiAbsorb(SHAKEMultiContext *mc, const unsigned char *const *input,
+                  unsigned int inputLen)
+{
+    unsigned int n, s, offset = 0;
+
+    if (mc->squeezing) {
+        return SECFailure;
+    }
+    while (offset < inputLen) {
+        n = SHA_MIN(inputLen - offset, mc->r - mc->bufSize);
+        for (s=0; s < mc->n; s++) {
+            sha3_xor_bytes(mc->S, mc->width, s, mc->bufSize,
+                           input[s] + offset, n);
+        }
+        mc->bufSize += n;
+        offset += n;
+        if (mc->bufSize == mc->r) {
+            Keccak_f_xN(mc->S, mc->width);
+            mc->bufSize = 0;
+        }
+    }
+    return SECSuccess;
+}
+
+void
+SHAKE_MultiSqueezeBlocks(SHAKEMultiContext *mc, unsigned char *const *output,
+                         unsigned int blocks)
+{
+    unsigned int i, s, b;
+
+    if (!mc->squeezing) {
+        for (s=0; s < mc->n; s++) {
+            SHA3_XOR_BYTE(mc->S, mc->width, s, mc->bufSize, SHAKE_DOMAIN);
+            SHA3_XOR_BYTE(mc->S, mc->width, s, mc->r-1, SHA3_FINAL_PAD);
+        }
+        mc->bufSize = 0;
+        mc->squeezing = PR_TRUE;
+    }
+    for (b=0; b < blocks; b++) {
+        Keccak_f_xN(mc->S, mc->width);
+        for (s=0; s < mc->n; s++) {
+            if (!output[s]) {
+                continue;
+            }
+            for (i=0; i < mc->r/sizeof(PRUint64); i++) {
+                LANE_OUT(output[s] + b*mc->r, i,
+                         SHA3_LANE(mc->S, mc->width, i, s));
+            }
+        }
+    }
+}
+
+/*
+ * cSHAKE and KMAC (SP 800-185)
+ *
+ * cSHAKE is SHAKE with bytepad(encode_string(N) || encode_string(S), r)
+ * absorbed first and the domain bits 00 in place of SHAKE's 1111; with N
+ * and S both empty it is SHAKE itself. KMAC is cSHAKE with N = "KMAC", and
+ * bytepad(encode_string(K), r) absorbed after the customization block and
+ * right_encode(L) after the message. Both prefixes are whole blocks, so
+ * a CSHAKEState is just the state after them, and a message starts with a
+ * copy of it.
+ *
+ * bytepad pads with zeros to the end of the block. The bytes go straight
+ * into the state, where XORing zeros does nothing, so padding is only the
+ * permutation that ends the block.
+ */
+#define CSHAKE_DOMAIN 0x04
+
+struct CSHAKEStateStr {
+    PRUint64 A[X_SIZE*Y_SIZE];
+    unsigned int r;
+    unsigned char domain;
+    PRBool kmac;
+};
+
+struct CSHAKEContextStr {
+    SHA3Context ctx;
+    const CSHAKEState *state;
+    PRBool squeezing;
+    PRBool finished;        /* by KMAC_Finish or TupleHash_Finish */
+    unsigned int out;       /* bytes of the output block already returned */
+};
+
+/* left_encode and right_encode of SP 800-185; b needs 9 bytes */
+static unsigned int
+sha3_left_encode(unsigned char *b, PRUint64 x)
+{
+    unsigned int n = 1, i;
+
+    while (n < sizeof(PRUint64) && (x >> (8*n))) {
+        n++;
+    }
+    b[0] = n;
+    for (i=1; i <= n; i++) {
+        b[i] = x >> (8*(n-i));
+    }
+    return n + 1;
+}
+
+static unsigned int
+sha3_right_encode(unsigned char *b, PRUint64 x)
+{
+    unsigned int n = sha3_left_encode(b, x) - 1;
+
+    PORT_Memmove(b, b + 1, n);
+    b[n] = n;
+    return n + 1;
+}
+
+static void
+sha3_encode_string(SHA3Context *ctx, const unsigned char *S,
+                   unsigned int len, unsigned int r)
+{
+    unsigned char b[9];
+
+    sha3_update(ctx, b, sha3_left_encode(b, (PRUint64)len * 8), r);
+    sha3_update(ctx, S, len, r);
+}
+
+static void
+sha3_bytepad_start(SHA3Context *ctx, unsigned int r)
+{
+    unsigned char b[9];
+
+    sha3_update(ctx, b, sha3_left_encode(b, r), r);
+}
+
+static void
+sha3_bytepad_end(SHA3Context *ctx)
+{
+    if (ctx->bufSize) {
+        Keccak_f(ctx->A1);
+        ctx->bufSize = 0;
+    }
+}
+
+static CSHAKEState *
+cshake_new_state(SHA3Type type, const unsigned char *N, unsigned int Nlen,
+                 const unsigned char *S, unsigned int Slen,
+                 const unsigned char *K, unsigned int Klen, PRBool kmac)
+{
+    CSHAKEState *state;
+    SHA3Context ctx;
+    unsigned int r;
+
+    if (type != SHA3_TYPE_SHAKE128 && type != SHA3_TYPE_SHAKE256) {
+        return NULL;
+    }
+    state = PORT_New(CSHAKEState);
+    if (!state) {
+        return NULL;
+    }
+    r = sha3_batch_types[type].r;
+    ctx.sched = NULL;
+    ctx.pending = 0;
+    SHA3_Begin(&ctx);
+    state->r = r;
+    state->kmac = kmac;
+    state->domain = SHAKE_DOMAIN;
+    if (Nlen || Slen) {
+        state->domain = CSHAKE_DOMAIN;
+        sha3_bytepad_start(&ctx, r);
+        sha3_encode_string(&ctx, N, Nlen, r);
+        sha3_encode_string(&ctx, S, Slen, r);
+        sha3_bytepad_end(&ctx);
+    }
+    if (kmac) {
+        sha3_bytepad_start(&ctx, r);
+        sha3_encode_string(&ctx, K, Klen, r);
+        sha3_bytepad_end(&ctx);
+    }
+    PORT_Memcpy(state->A, ctx.A1, sizeof(state->A));
+    PORT_Memset(&ctx, 0, sizeof ctx);
+    return state;
+}
+
+CSHAKEState *
+CSHAKE_NewState(SHA3Type type, const unsigned char *N, unsigned int Nlen,
+                const unsigned char *S, unsigned int Slen)
+{
+    return cshake_new_state(type, N, Nlen, S, Slen, NULL, 0, PR_FALSE);
+}
+
+CSHAKEState *
+KMAC_NewKey(SHA3Type type, const unsigned char *K, unsigned int Klen,
+            const unsigned char *S, unsigned int Slen)
+{
+    static const unsigned char kmac[] = { 'K', 'M', 'A', 'C' };
+
+    return cshake_new_state(type, kmac, sizeof kmac, S, Slen, K, Klen,
+                            PR_TRUE);
+}
+
+void
+CSHAKE_DestroyState(CSHAKEState *state)
+{
+    PORT_Memset(state, 0, sizeof(*state));
+    PORT_Free(state);
+}
+
+CSHAKEContext *
+CSHAKE_NewContext(const CSHAKEState *state)
+{
+    CSHAKEContext *cx = PORT_New(CSHAKEContext);
+
+    if (cx) {
+        cx->ctx.sched = NULL;
+        cx->ctx.pending = 0;
+        cx->state = state;
+        CSHAKE_Begin(cx);
+    }
+    return cx;
+}
+
+void
+CSHAKE_DestroyContext(CSHAKEContext *cx, PRBool freeit)
+{
+    PORT_Memset(cx, 0, sizeof(*cx));
+    if (freeit) {
+        PORT_Free(cx);
+    }
+}
+
+void
+CSHAKE_Begin(CSHAKEContext *cx)
+{
+    PORT_Memcpy(cx->ctx.A1, cx->state->A, sizeof(cx->ctx.A1));
+    cx->ctx.bufSize = 0;
+    cx->squeezing = PR_FALSE;
+    cx->finished = PR_FALSE;
+    cx->out = 0;
+}
+
+SECStatus
+CSHAKE_Update(CSHAKEContext *cx, const unsigned char *input,
+              unsigned int inputLen)
+{
+    if (cx->squeezing) {
+        return SECFailure;
+    }
+    sha3_update(&cx->ctx, input, inputLen, cx->state->r);
+    return SECSuccess;
+}
+
+/* absorb right_encode(L), for KMAC */
+static void
+kmac_length(CSHAKEContext *cx, PRUint64 bits)
 {
-    sha3_update(ctx, input, inputLength, SHA3_224_R);
+    unsigned char b[9];
+
+    sha3_update(&cx->ctx, b, sha3_right_encode(b, bits), cx->state->r);
 }
 
-void
-SHA3_224_End(SHA3Context *ctx, unsigned char *digest, unsigned int *digestLen,
-                        unsigned int maxDigestLen)
+SECStatus
+CSHAKE_Squeeze(CSHAKEContext *cx, unsigned char *output,
+               unsigned int outputLen)
 {
-    unsigned int maxLen = SHA_MIN(maxDigestLen, SHA3_224_D);
-    sha3_final(ctx, SHA3_224_R, digest, maxDigestLen);
-    *digestLen = maxLen;
+    if (cx->finished) {
+        return SECFailure;
+    }
+    if (!cx->squeezing) {
+        if (cx->state->kmac) {
+            kmac_length(cx, 0);     /* KMACXOF */
+        }
+        sha3_pad(&cx->ctx, cx->state->domain, cx->state->r);
+        cx->squeezing = PR_TRUE;
+        cx->out = cx->state->r;
+    }
+    sha3_squeeze(cx->ctx.A1, cx->state->r, &cx->out, output, outputLen);
+    return SECSuccess;
 }
 
 SECStatus
-SHA3_224_HashBuf(unsigned char *dest, const unsigned char *src,
-               PRUint32 src_length)
+KMAC_Finish(CSHAKEContext *cx, unsigned char *mac, unsigned int macLen)
 {
-    SHA3Context ctx;
-    unsigned int outLen;
+    if (!cx->state->kmac || cx->squeezing) {
+        return SECFailure;
+    }
+    kmac_length(cx, (PRUint64)macLen * 8);
+    sha3_pad(&cx->ctx, cx->state->domain, cx->state->r);
+    cx->squeezing = PR_TRUE;
+    cx->finished = PR_TRUE;
+    if (macLen <= 8*sizeof(PRUint64)) {
+        /* fits in the lanes of the pruned last round */
+        Keccak_f_out(cx->ctx.A1, mac, macLen);
+        return SECSuccess;
+    }
+    cx->out = cx->state->r;
+    sha3_squeeze(cx->ctx.A1, cx->state->r, &cx->out, mac, macLen);
+    return SECSuccess;
+}
 
-    SHA3_Begin(&ctx);
-    sha3_update(&ctx, src, src_length, SHA3_224_R);
-    sha3_final(&ctx, SHA3_224_R, dest, SHA3_224_D);
-    memset(&ctx, 0, sizeof ctx);
+void
+CSHAKE_Hash(const CSHAKEState *state, const unsigned char *input,
+            unsigned int inputLen, unsigned char *output,
+            unsigned int outputLen)
+{
+    CSHAKEContext cx;
 
-    return SECSuccess;
+    cx.ctx.sched = NULL;
+    cx.ctx.pending = 0;
+    cx.state = state;
+    CSHAKE_Begin(&cx);
+    CSHAKE_Update(&cx, input, inputLen);
+    CSHAKE_Squeeze(&cx, output, outputLen);
+    PORT_Memset(&cx, 0, sizeof cx);
 }
 
 SECStatus
-SHA2_224_Hash(unsigned char *dest, const char *src)
+KMAC_Compute(const CSHAKEState *key, const unsigned char *input,
+             unsigned int inputLen, unsigned char *mac, unsigned int macLen)
 {
-    return SHA3_224_HashBuf(dest, (const unsigned char *)src, PORT_Strlen(src));
+    CSHAKEContext cx;
+    SECStatus rv;
+
+    cx.ctx.sched = NULL;
+    cx.ctx.pending = 0;
+    cx.state = key;
+    CSHAKE_Begin(&cx);
+    CSHAKE_Update(&cx, input, inputLen);
+    rv = KMAC_Finish(&cx, mac, macLen);
+    PORT_Memset(&cx, 0, sizeof cx);
+    return rv;
 }
 
+/*
+ * TupleHash128/256 (SP 800-185, section 5)
+ *
+ * TupleHash(X, L, S) = cSHAKE(encode_string(X[1]) || ... ||
+ * encode_string(X[n]) || right_encode(L), L, "TupleHash", S). Each field
+ * is absorbed straight from the caller's buffer after its length prefix,
+ * so a record is hashed in place, field by field, without being put back
+ * together first. The end is KMAC's, with right_encode(L) after the
+ * tuple.
+ */
+struct TupleHashContextStr {
+    CSHAKEState *state;         /* "TupleHash" and S */
+    CSHAKEContext outer;
+};
+
+TupleHashContext *
+TupleHash_NewContext(SHA3Type type, const unsigned char *S,
+                     unsigned int Slen)
+{
+    static const unsigned char name[] = {
+        'T', 'u', 'p', 'l', 'e', 'H', 'a', 's', 'h'
+    };
+    TupleHashContext *cx = PORT_New(TupleHashContext);
+
+    if (!cx) {
+        return NULL;
+    }
+    cx->state = CSHAKE_NewState(type, name, sizeof name, S, Slen);
+    if (!cx->state) {
+        PORT_Free(cx);
+        return NULL;
+    }
+    cx->outer.ctx.sched = NULL;
+    cx->outer.ctx.pending = 0;
+    cx->outer.state = cx->state;
+    TupleHash_Begin(cx);
+    return cx;
+}
 
 void
-SHA3_256_Update(SHA3Context *ctx, const unsigned char *input,
-                        unsigned int inputLength)
+TupleHash_DestroyContext(TupleHashContext *cx)
 {
-    sha3_update(ctx, input, inputLength, SHA3_256_R);
+    CSHAKE_DestroyState(cx->state);
+    PORT_Memset(cx, 0, sizeof(*cx));
+    PORT_Free(cx);
 }
 
 void
-SHA3_256_End(SHA3Context *ctx, unsigned char *digest, unsigned int *digestLen,
-                        unsigned int maxDigestLen)
+TupleHash_Begin(TupleHashContext *cx)
 {
-    unsigned int maxLen = SHA_MIN(maxDigestLen, SHA3_256_D);
-    sha3_final(ctx, SHA3_256_R, digest, maxDigestLen);
-    *digestLen = maxLen;
+    CSHAKE_Begin(&cx->outer);
 }
 
 SECStatus
-SHA3_256_HashBuf(unsigned char *dest, const unsigned char *src,
-               PRUint32 src_length)
+TupleHash_Update(TupleHashContext *cx, const SHA3Field *fields,
+                 unsigned int count)
 {
-    SHA3Context ctx;
-    unsigned int outLen;
+    SHA3Context *ctx = &cx->outer.ctx;
+    unsigned int r = cx->state->r;
+    unsigned char b[9];
+    unsigned int i, n, len;
 
-    SHA3_Begin(&ctx);
-    sha3_update(&ctx, src, src_length, SHA3_256_R);
-    sha3_final(&ctx, SHA3_256_R, dest, SHA3_256_D);
-    memset(&ctx, 0, sizeof ctx);
+    if (cx->outer.squeezing) {
+        return SECFailure;
+    }
+    for (i=0; i < count; i++) {
+        len = fields[i].len;
+        n = sha3_left_encode(b, (PRUint64)len * 8);
+        if (n < r - ctx->bufSize && len < r - ctx->bufSize - n) {
+            /* a short field, which with its prefix doesn't end the block */
+            sha3_xor_bytes(ctx->A1, 1, 0, ctx->bufSize, b, n);
+            sha3_xor_bytes(ctx->A1, 1, 0, ctx->bufSize + n, fields[i].data,
+                           len);
+            ctx->bufSize += n + len;
+        } else {
+            sha3_update(ctx, b, n, r);
+            sha3_update(ctx, fields[i].data, len, r);
+        }
+    }
+    return SECSuccess;
+}
 
+SECStatus
+TupleHash_Finish(TupleHashContext *cx, unsigned char *output,
+                 unsigned int outputLen)
+{
+    if (cx->outer.squeezing) {
+        return SECFailure;
+    }
+    kmac_length(&cx->outer, (PRUint64)outputLen * 8);
+    CSHAKE_Squeeze(&cx->outer, output, outputLen);
+    cx->outer.finished = PR_TRUE;
     return SECSuccess;
 }
 
 SECStatus
-SHA2_256_Hash(unsigned char *dest, const char *src)
+TupleHash_Squeeze(TupleHashContext *cx, unsigned char *output,
+                  unsigned int outputLen)
 {
-    return SHA3_256_HashBuf(dest, (const unsigned char *)src, PORT_Strlen(src));
+    if (!cx->outer.squeezing) {
+        kmac_length(&cx->outer, 0);     /* TupleHashXOF */
+    }
+    return CSHAKE_Squeeze(&cx->outer, output, outputLen);
+}
+
+/*
+ * Thread pool
+ *
+ * A fixed set of workers for hashing one long input on several cores. The
+ * caller gives sha3_pool_run a function and a number of items, then it and
+ * the workers take items off a shared counter until all are done, so a
+ * slow core just takes fewer items. One task runs at a time; a second
+ * caller waits on run for the first to finish.
+ */
+struct SHA3ThreadPoolStr {
+    pthread_mutex_t run;        /* held for the whole of a task */
+    pthread_mutex_t lock;       /* guards everything below */
+    pthread_cond_t work;        /* a new task, or shutdown */
+    pthread_cond_t done;        /* the task's last item is done */
+    void (*fn)(void *arg, unsigned int item);
+    void *arg;
+    unsigned int items;
+    unsigned int next;          /* the next item to hand out */
+    unsigned int finished;      /* items done */
+    unsigned int task;          /* counts the tasks, so workers see new ones */
+    PRBool shutdown;
+    unsigned int workers;
+    pthread_t *tid;
+};
+
+/* run items of the current task until there are none left; lock is held */
+static void
+sha3_pool_items(SHA3ThreadPool *pool)
+{
+    void (*fn)(void *arg, unsigned int item);
+    void *arg;
+    unsigned int item;
+
+    while (pool->next < pool->items) {
+        item = pool->next++;
+        fn = pool->fn;
+        arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+        fn(arg, item);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->items) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+}
+
+static void *
+sha3_pool_worker(void *p)
+{
+    SHA3ThreadPool *pool = p;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->task == seen) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        seen = pool->task;
+        sha3_pool_items(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void
+sha3_pool_run(SHA3ThreadPool *pool, void (*fn)(void *arg, unsigned int item),
+              void *arg, unsigned int items)
+{
+    pthread_mutex_lock(&pool->run);
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->items = items;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->task++;
+    pthread_cond_broadcast(&pool->work);
+    sha3_pool_items(pool);
+    while (pool->finished < pool->items) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->run);
+}
+
+static void
+sha3_pool_stop(SHA3ThreadPool *pool, unsigned int started)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = PR_TRUE;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=0; i < started; i++) {
+        pthread_join(pool->tid[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run);
+    PORT_Free(pool->tid);
+    PORT_Free(pool);
+}
+
+SHA3ThreadPool *
+SHA3_NewThreadPool(unsigned int threads)
+{
+    SHA3ThreadPool *pool;
+    unsigned int i;
+
+    if (threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (unsigned int)n : 1;
+    }
+    pool = PORT_ZAlloc(sizeof(SHA3ThreadPool));
+    if (!pool) {
+        return NULL;
+    }
+    /* the caller of each task is one of the threads */
+    pool->workers = threads - 1;
+    pool->tid = PORT_ZAlloc((pool->workers + 1) * sizeof(pthread_t));
+    if (!pool->tid) {
+        PORT_Free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->run, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (i=0; i < pool->workers; i++) {
+        if (pthread_create(&pool->tid[i], NULL, sha3_pool_worker, pool)) {
+            sha3_pool_stop(pool, i);
+            return NULL;
+        }
+    }
+    return pool;
 }
 
 void
-SHA3_384_Update(SHA3Context *ctx, const unsigned char *input,
-                        unsigned int inputLength)
+SHA3_DestroyThreadPool(SHA3ThreadPool *pool)
 {
-    sha3_update(ctx, input, inputLength, SHA3_384_R);
+    sha3_pool_stop(pool, pool->workers);
+}
+
+unsigned int
+SHA3_ThreadPoolSize(const SHA3ThreadPool *pool)
+{
+    return pool->workers + 1;
+}
+
+/*
+ * Leaves of the tree hashes
+ *
+ * KangarooTwelve and ParallelHash both cut the input into leaves of B
+ * bytes, hash each leaf on its own to a chaining value, and absorb the
+ * chaining values in order into a final sponge. A SHA3LeafType says how a
+ * leaf is hashed. Leaves are hashed as many at a time as the backend runs,
+ * through sha3xN_absorb_all; with a thread pool, an update of at least
+ * SHA3_MT_MIN_BYTES of whole leaves is split into runs of about
+ * SHA3_MT_RUN_BYTES, a whole number of groups, for the workers.
+ */
+#define SHA3_MT_MIN_BYTES (512*1024)  /* fewer stay on the calling thread */
+#define SHA3_MT_RUN_BYTES (128*1024)  /* per pool item */
+#define SHA3_MT_MAX_RUN 4096          /* leaves per pool item */
+#define SHA3_MT_BATCH_RUNS 512        /* pool items per pool task */
+#define SHA3_MT_MAX_BATCH 65536       /* leaves per pool task */
+
+typedef struct {
+    unsigned int B;         /* leaf length */
+    unsigned int r;
+    unsigned int nr;        /* rounds */
+    unsigned char domain;
+    unsigned int cvLen;
+} SHA3LeafType;
+
+/* write the chaining values of count whole leaves from N to cv */
+static void
+sha3_leaf_cvs(const SHA3LeafType *t, const unsigned char *N,
+              unsigned int count, unsigned char *cv)
+{
+    PRUint64 S[X_SIZE*Y_SIZE*SHA3_MAX_STREAMS];
+    unsigned char scratch[X_SIZE*Y_SIZE*sizeof(PRUint64)];
+    const unsigned char *in[SHA3_MAX_STREAMS];
+    unsigned char *out[SHA3_MAX_STREAMS];
+    unsigned int width = sha3_backend->width;
+    unsigned int n, s;
+
+    while (count) {
+        n = SHA_MIN(count, width);
+        if (width == 1 || n < sha3_backend->minLanes) {
+            shake(N, t->B, cv, t->cvLen, t->domain, t->r, t->nr);
+            n = 1;
+        } else {
+            /* idle lanes hash a copy of the first leaf, into scratch */
+            for (s=0; s < width; s++) {
+                in[s] = N + (size_t)(s < n ? s : 0) * t->B;
+                out[s] = s < n ? cv + s * t->cvLen : scratch;
+            }
+            PORT_Memset(S, 0, sizeof S);
+            sha3xN_absorb_all(S, width, in, t->B, t->domain, t->r, t->nr);
+            sha3xN_unload_state(S, width, out, t->cvLen);
+        }
+        N += (size_t)n * t->B;
+        cv += n * t->cvLen;
+        count -= n;
+    }
+    PORT_Memset(S, 0, sizeof S);
+}
+
+typedef struct {
+    const SHA3LeafType *type;
+    const unsigned char *N;
+    unsigned int count;
+    unsigned int run;       /* leaves per item */
+    unsigned char *cv;
+} SHA3LeafTask;
+
+static void
+sha3_leaf_run(void *arg, unsigned int item)
+{
+    SHA3LeafTask *task = arg;
+    unsigned int first = item * task->run;
+
+    sha3_leaf_cvs(task->type, task->N + (size_t)first * task->type->B,
+                  SHA_MIN(task->run, task->count - first),
+                  task->cv + first * task->type->cvLen);
+}
+
+/*
+ * Hash count whole leaves from N and absorb their chaining values into
+ * node, a sponge of rate r and nr rounds, on pool if it is worth it.
+ */
+static void
+sha3_hash_leaves(const SHA3LeafType *t, SHA3ThreadPool *pool,
+                 const unsigned char *N, unsigned int count,
+                 SHA3Context *node, unsigned int r, unsigned int nr)
+{
+    unsigned char cv[SHA3_MAX_STREAMS * X_SIZE*Y_SIZE*sizeof(PRUint64)];
+    unsigned int width = sha3_backend->width;
+    unsigned char *cvs = NULL;
+    SHA3LeafTask task;
+    unsigned int n, batch = 0;
+
+    /* at least one leaf per item, for leaves longer than a run */
+    task.run = SHA_MIN(SHA3_MT_RUN_BYTES / t->B, SHA3_MT_MAX_RUN);
+    task.run = SHA_MAX(task.run, 1);
+    task.run = (task.run + width - 1) / width * width;
+    if (pool && count > 1 && (PRUint64)count * t->B >= SHA3_MT_MIN_BYTES) {
+        batch = SHA_MIN(task.run * SHA3_MT_BATCH_RUNS, SHA3_MT_MAX_BATCH);
+        batch = SHA_MIN(batch, count);
+        cvs = PORT_Alloc((size_t)batch * t->cvLen);
+    }
+    if (cvs) {
+        task.type = t;
+        task.cv = cvs;
+        while (count) {
+            n = SHA_MIN(count, batch);
+            task.N = N;
+            task.count = n;
+            sha3_pool_run(pool, sha3_leaf_run, &task,
+                          (n + task.run - 1) / task.run);
+            sha3_update_p(node, cvs, n * t->cvLen, r, nr);
+            N += (size_t)n * t->B;
+            count -= n;
+        }
+        PORT_Free(cvs);
+        return;
+    }
+    /* no pool, too little input for one, or no memory for the batch */
+    while (count) {
+        n = SHA_MIN(count, SHA3_MAX_STREAMS);
+        sha3_leaf_cvs(t, N, n, cv);
+        sha3_update_p(node, cv, n * t->cvLen, r, nr);
+        N += (size_t)n * t->B;
+        count -= n;
+    }
+}
+
+/*
+ * KangarooTwelve (RFC 9861, KT128)
+ *
+ * The input S = M || C || length_encode(|C|) is cut into 8 KiB chunks. If
+ * there is only one, the hash is TurboSHAKE128(S, 0x07). Otherwise the
+ * final node is the first chunk, 0x03 and seven zero bytes, the 32 byte
+ * TurboSHAKE128(chunk, 0x0B) chaining value of each later chunk (leaf),
+ * length_encode(leaves) and 0xFF 0xFF, hashed as TurboSHAKE128(node, 0x06).
+ *
+ * The final node is absorbed as it goes, so a context only holds two
+ * sponges. Whole leaves that an update brings in one piece are hashed a
+ * group at a time on the multi-buffer Keccak, with 12 rounds; a leaf that
+ * arrives in pieces goes through the leaf sponge. With a thread pool, an
+ * update of at least 64 whole leaves is split into runs of 16 for the
+ * workers, and the chaining values are absorbed into the final node in
+ * order once the batch is done.
+ */
+#define K12_CHUNK 8192
+#define K12_CV 32
+#define K12_LEAF_DOMAIN 0x0b
+#define K12_SINGLE_DOMAIN 0x07
+#define K12_FINAL_DOMAIN 0x06
+
+static const SHA3LeafType k12_leaf = {
+    K12_CHUNK, SHAKE128_R, TURBOSHAKE_ROUNDS, K12_LEAF_DOMAIN, K12_CV
+};
+
+struct K12ContextStr {
+    SHAKEContext node;      /* the final node */
+    SHAKEContext leaf;      /* the leaf being absorbed in pieces */
+    PRUint64 len;           /* bytes of S absorbed so far */
+    unsigned char *custom;
+    unsigned int customLen;
+    PRBool squeezing;
+    SHA3ThreadPool *pool;
+};
+
+/* like right_encode, but 0 is encoded in no bytes */
+static unsigned int
+k12_length_encode(unsigned char *b, PRUint64 x)
+{
+    if (x == 0) {
+        b[0] = 0;
+        return 1;
+    }
+    return sha3_right_encode(b, x);
+}
+
+/* the leaf sponge has a whole chunk: add its chaining value to the node */
+static void
+k12_end_leaf(K12Context *cx)
+{
+    unsigned char cv[K12_CV];
+
+    SHAKE_Squeeze(&cx->leaf, cv, K12_CV);
+    SHAKE_Absorb(&cx->node, cv, K12_CV);
+    SHAKE_Begin(&cx->leaf);
+}
+
+static void
+k12_absorb(K12Context *cx, const unsigned char *N, unsigned int len)
+{
+    static const unsigned char marker[8] = { 0x03 };
+    unsigned int n, off;
+
+    while (len) {
+        if (cx->len < K12_CHUNK) {
+            n = SHA_MIN(len, K12_CHUNK - cx->len);
+            SHAKE_Absorb(&cx->node, N, n);
+        } else {
+            if (cx->len == K12_CHUNK) {
+                SHAKE_Absorb(&cx->node, marker, sizeof marker);
+            }
+            off = (cx->len - K12_CHUNK) % K12_CHUNK;
+            if (off == 0 && len >= K12_CHUNK) {
+                n = len / K12_CHUNK * K12_CHUNK;
+                sha3_hash_leaves(&k12_leaf, cx->pool, N, n / K12_CHUNK,
+                                 &cx->node.ctx, SHAKE128_R,
+                                 TURBOSHAKE_ROUNDS);
+            } else {
+                n = SHA_MIN(len, K12_CHUNK - off);
+                SHAKE_Absorb(&cx->leaf, N, n);
+                if (off + n == K12_CHUNK) {
+                    k12_end_leaf(cx);
+                }
+            }
+        }
+        cx->len += n;
+        N += n;
+        len -= n;
+    }
+}
+
+K12Context *
+K12_NewContext(const unsigned char *custom, unsigned int customLen)
+{
+    K12Context *cx = PORT_New(K12Context);
+
+    if (!cx) {
+        return NULL;
+    }
+    cx->custom = NULL;
+    cx->customLen = customLen;
+    cx->pool = NULL;
+    if (customLen) {
+        cx->custom = PORT_Alloc(customLen);
+        if (!cx->custom) {
+            PORT_Free(cx);
+            return NULL;
+        }
+        PORT_Memcpy(cx->custom, custom, customLen);
+    }
+    shake_init(&cx->node, SHAKE128_R, TURBOSHAKE_ROUNDS, K12_SINGLE_DOMAIN);
+    shake_init(&cx->leaf, SHAKE128_R, TURBOSHAKE_ROUNDS, K12_LEAF_DOMAIN);
+    K12_Begin(cx);
+    return cx;
 }
 
 void
-SHA3_384_End(SHA3Context *ctx, unsigned char *digest, unsigned int *digestLen,
-                        unsigned int maxDigestLen)
+K12_DestroyContext(K12Context *cx)
 {
-    unsigned int maxLen = SHA_MIN(maxDigestLen, SHA3_384_D);
-    sha3_final(ctx, SHA3_384_R, digest, maxDigestLen);
-    *digestLen = maxLen;
+    if (cx->custom) {
+        PORT_Memset(cx->custom, 0, cx->customLen);
+        PORT_Free(cx->custom);
+    }
+    PORT_Memset(cx, 0, sizeof(*cx));
+    PORT_Free(cx);
 }
 
-SECStatus
-SHA3_384_HashBuf(unsigned char *dest, const unsigned char *src,
-               PRUint32 src_length)
+void
+K12_SetThreadPool(K12Context *cx, SHA3ThreadPool *pool)
 {
-    SHA3Context ctx;
-    unsigned int outLen;
+    cx->pool = pool;
+}
 
-    SHA3_Begin(&ctx);
-    sha3_update(&ctx, src, src_length, SHA3_384_R);
-    sha3_final(&ctx, SHA3_384_R, dest, SHA3_384_D);
-    memset(&ctx, 0, sizeof ctx);
+void
+K12_Begin(K12Context *cx)
+{
+    SHAKE_Begin(&cx->node);
+    SHAKE_Begin(&cx->leaf);
+    cx->node.domain = K12_SINGLE_DOMAIN;
+    cx->len = 0;
+    cx->squeezing = PR_FALSE;
+}
 
+SECStatus
+K12_Update(K12Context *cx, const unsigned char *input, unsigned int inputLen)
+{
+    if (cx->squeezing) {
+        return SECFailure;
+    }
+    k12_absorb(cx, input, inputLen);
     return SECSuccess;
 }
 
-SECStatus
-SHA2_384_Hash(unsigned char *dest, const char *src)
+void
+K12_Squeeze(K12Context *cx, unsigned char *output, unsigned int outputLen)
 {
-    return SHA3_384_HashBuf(dest, (const unsigned char *)src, PORT_Strlen(src));
+    unsigned char b[9];
+    PRUint64 leaves;
+
+    if (!cx->squeezing) {
+        k12_absorb(cx, cx->custom, cx->customLen);
+        k12_absorb(cx, b, k12_length_encode(b, cx->customLen));
+        if (cx->len > K12_CHUNK) {
+            if ((cx->len - K12_CHUNK) % K12_CHUNK) {
+                k12_end_leaf(cx);
+            }
+            leaves = (cx->len - 1) / K12_CHUNK;
+            SHAKE_Absorb(&cx->node, b, k12_length_encode(b, leaves));
+            b[0] = b[1] = 0xff;
+            SHAKE_Absorb(&cx->node, b, 2);
+            cx->node.domain = K12_FINAL_DOMAIN;
+        }
+        cx->squeezing = PR_TRUE;
+    }
+    SHAKE_Squeeze(&cx->node, output, outputLen);
 }
 
 void
-SHA3_512_Update(SHA3Context *ctx, const unsigned char *input,
-                        unsigned int inputLength)
+KangarooTwelve(const unsigned char *message, unsigned int len,
+               const unsigned char *custom, unsigned int customLen,
+               unsigned char *out, unsigned int outLen)
 {
-    sha3_update(ctx, input, inputLength, SHA3_512_R);
+    K12Context cx;
+
+    /* K12_NewContext without the copy of custom, which outlives cx here */
+    cx.custom = (unsigned char *)custom;
+    cx.customLen = customLen;
+    cx.pool = NULL;
+    shake_init(&cx.node, SHAKE128_R, TURBOSHAKE_ROUNDS, K12_SINGLE_DOMAIN);
+    shake_init(&cx.leaf, SHAKE128_R, TURBOSHAKE_ROUNDS, K12_LEAF_DOMAIN);
+    K12_Begin(&cx);
+    K12_Update(&cx, message, len);
+    K12_Squeeze(&cx, out, outLen);
+    PORT_Memset(&cx, 0, sizeof cx);
+}
+
+/*
+ * ParallelHash128/256 (SP 800-185, section 6)
+ *
+ * The input X is cut into blocks of B bytes, the last one possibly
+ * shorter. Each block is hashed to a chaining value with SHAKE128 (256
+ * bits) or SHAKE256 (512 bits), which is cSHAKE with empty N and S, and
+ * the result is cSHAKE(left_encode(B) || values || right_encode(blocks)
+ * || right_encode(L), L, "ParallelHash", S).
+ *
+ * The outer cSHAKE is absorbed as it goes, from a CSHAKEState made once
+ * per context, the way K12 absorbs its final node, and whole blocks go
+ * through sha3_hash_leaves, on the context's thread pool if it has one.
+ */
+struct ParallelHashContextStr {
+    CSHAKEState *state;         /* "ParallelHash" and S */
+    CSHAKEContext outer;
+    SHAKEContext leaf;          /* the block being absorbed in pieces */
+    SHA3LeafType type;
+    PRUint64 len;               /* bytes of X absorbed so far */
+    SHA3ThreadPool *pool;
+    PRBool squeezing;
+    PRBool finished;            /* by ParallelHash_Finish: no more output */
+};
+
+ParallelHashContext *
+ParallelHash_NewContext(SHA3Type type, unsigned int B,
+                        const unsigned char *S, unsigned int Slen)
+{
+    static const unsigned char name[] = {
+        'P', 'a', 'r', 'a', 'l', 'l', 'e', 'l', 'H', 'a', 's', 'h'
+    };
+    ParallelHashContext *cx;
+
+    if (B == 0 ||
+        (type != SHA3_TYPE_SHAKE128 && type != SHA3_TYPE_SHAKE256)) {
+        return NULL;
+    }
+    cx = PORT_New(ParallelHashContext);
+    if (!cx) {
+        return NULL;
+    }
+    cx->state = CSHAKE_NewState(type, name, sizeof name, S, Slen);
+    if (!cx->state) {
+        PORT_Free(cx);
+        return NULL;
+    }
+    cx->type.B = B;
+    cx->type.r = cx->state->r;
+    cx->type.nr = 24;
+    cx->type.domain = SHAKE_DOMAIN;
+    cx->type.cvLen = type == SHA3_TYPE_SHAKE128 ? 32 : 64;
+    cx->outer.ctx.sched = NULL;
+    cx->outer.ctx.pending = 0;
+    cx->outer.state = cx->state;
+    shake_init(&cx->leaf, cx->type.r, 24, SHAKE_DOMAIN);
+    cx->pool = NULL;
+    ParallelHash_Begin(cx);
+    return cx;
 }
 
 void
-SHA3_512_End(SHA3Context *ctx, unsigned char *digest, unsigned int *digestLen,
-                        unsigned int maxDigestLen)
+ParallelHash_DestroyContext(ParallelHashContext *cx)
 {
-    unsigned int maxLen = SHA_MIN(maxDigestLen, SHA3_512_D);
-    sha3_final(ctx, SHA3_512_R, digest, maxDigestLen);
-    *digestLen = maxLen;
+    CSHAKE_DestroyState(cx->state);
+    PORT_Memset(cx, 0, sizeof(*cx));
+    PORT_Free(cx);
+}
+
+void
+ParallelHash_SetThreadPool(ParallelHashContext *cx, SHA3ThreadPool *pool)
+{
+    cx->pool = pool;
+}
+
+void
+ParallelHash_Begin(ParallelHashContext *cx)
+{
+    unsigned char b[9];
+
+    CSHAKE_Begin(&cx->outer);
+    CSHAKE_Update(&cx->outer, b, sha3_left_encode(b, cx->type.B));
+    SHAKE_Begin(&cx->leaf);
+    cx->len = 0;
+    cx->squeezing = PR_FALSE;
+    cx->finished = PR_FALSE;
+}
+
+/* the leaf sponge has a block: add its chaining value to the outer hash */
+static void
+ph_end_block(ParallelHashContext *cx)
+{
+    unsigned char cv[64];
+
+    SHAKE_Squeeze(&cx->leaf, cv, cx->type.cvLen);
+    CSHAKE_Update(&cx->outer, cv, cx->type.cvLen);
+    SHAKE_Begin(&cx->leaf);
 }
 
 SECStatus
-SHA3_512_HashBuf(unsigned char *dest, const unsigned char *src,
-               PRUint32 src_length)
+ParallelHash_Update(ParallelHashContext *cx, const unsigned char *input,
+                    unsigned int inputLen)
 {
-    SHA3Context ctx;
-    unsigned int outLen;
+    unsigned int B = cx->type.B;
+    unsigned int n, off;
 
-    SHA3_Begin(&ctx);
-    sha3_update(&ctx, src, src_length, SHA3_512_R);
-    sha3_final(&ctx, SHA3_512_R, dest, SHA3_512_D);
-    memset(&ctx, 0, sizeof ctx);
+    if (cx->squeezing) {
+        return SECFailure;
+    }
+    while (inputLen) {
+        off = cx->len % B;
+        if (off == 0 && inputLen >= B) {
+            n = inputLen / B;
+            sha3_hash_leaves(&cx->type, cx->pool, input, n, &cx->outer.ctx,
+                             cx->type.r, 24);
+            n *= B;
+        } else {
+            n = SHA_MIN(inputLen, B - off);
+            SHAKE_Absorb(&cx->leaf, input, n);
+            if (off + n == B) {
+                ph_end_block(cx);
+            }
+        }
+        cx->len += n;
+        input += n;
+        inputLen -= n;
+    }
+    return SECSuccess;
+}
+
+/* end X, and absorb right_encode(blocks) and right_encode(L) */
+static void
+ph_end(ParallelHashContext *cx, PRUint64 bits)
+{
+    unsigned char b[9];
+
+    if (cx->len % cx->type.B) {
+        ph_end_block(cx);
+    }
+    CSHAKE_Update(&cx->outer, b, sha3_right_encode(b,
+                  (cx->len + cx->type.B - 1) / cx->type.B));
+    CSHAKE_Update(&cx->outer, b, sha3_right_encode(b, bits));
+    cx->squeezing = PR_TRUE;
+}
 
+SECStatus
+ParallelHash_Finish(ParallelHashContext *cx, unsigned char *output,
+                    unsigned int outputLen)
+{
+    if (cx->squeezing) {
+        return SECFailure;
+    }
+    ph_end(cx, (PRUint64)outputLen * 8);
+    CSHAKE_Squeeze(&cx->outer, output, outputLen);
+    cx->finished = PR_TRUE;
     return SECSuccess;
 }
 
 SECStatus
-SHA2_512_Hash(unsigned char *dest, const char *src)
+ParallelHash_Squeeze(ParallelHashContext *cx, unsigned char *output,
+                     unsigned int outputLen)
 {
-    return SHA3_512_HashBuf(dest, (const unsigned char *)src, PORT_Strlen(src));
+    if (cx->finished) {
+        return SECFailure;
+    }
+    if (!cx->squeezing) {
+        ph_end(cx, 0);      /* ParallelHashXOF */
+    }
+    return CSHAKE_Squeeze(&cx->outer, output, outputLen);
 }
 
 
@@ -6,6 +6,8 @@
 
 /* This should ultimately become part of blapi.h */
 typedef enum { PR_FALSE, PR_TRUE } PRBool;
+typedef enum { SECSuccess=0, SECFailure=-1 } SECStatus;
+typedef uint32_t PRUint32;
 typedef struct SHA3ContextStr SHA3Context;
 
 /*
@@ -19,6 +21,7 @@ typedef struct SHA3ContextStr SHA3Context;
 #define SHA3_224_FlattenSize SHA3_FlattenSize
 #define SHA3_224_Flatten SHA3_Flatten
 #define SHA3_224_Resurrect SHA3_Resurrect
+#define SHA3_224_Clone SHA3_Clone
 
 #define SHA3_256_NewContext SHA3_NewContext
 #define SHA3_256_DestroyContext SHA3_DestroyContext
@@ -27,6 +30,7 @@ typedef struct SHA3ContextStr SHA3Context;
 #define SHA3_256_FlattenSize SHA3_FlattenSize
 #define SHA3_256_Flatten SHA3_Flatten
 #define SHA3_256_Resurrect SHA3_Resurrect
+#define SHA3_256_Clone SHA3_Clone
 
 #define SHA3_384_NewContext SHA3_NewContext
 #define SHA3_384_DestroyContext SHA3_DestroyContext
@@ -35,6 +39,7 @@ typedef struct SHA3ContextStr SHA3Context;
 #define SHA3_384_FlattenSize SHA3_FlattenSize
 #define SHA3_384_Flatten SHA3_Flatten
 #define SHA3_384_Resurrect SHA3_Resurrect
+#define SHA3_384_Clone SHA3_Clone
 
 #define SHA3_512_NewContext SHA3_NewContext
 #define SHA3_512_DestroyContext SHA3_DestroyContext
@@ -43,6 +48,7 @@ typedef struct SHA3ContextStr SHA3Context;
 #define SHA3_512_FlattenSize SHA3_FlattenSize
 #define SHA3_512_Flatten SHA3_Flatten
 #define SHA3_512_Resurrect SHA3_Resurrect
+#define SHA3_512_Clone SHA3_Clone
 
 extern SHA3Context *SHA3_NewContext(void);
 extern void SHA3_DestroyContext(SHA3Context *cx, PRBool freeit);
@@ -51,13 +57,538 @@ extern void SHA3_Update(SHA3Context *cx, const unsigned char *input,
                                           unsigned int inputLen);
 extern void SHA3_End(SHA3Context *cx, unsigned char *digest,
                                  unsigned int *digestLen, unsigned int maxDigestLen);
+extern unsigned int SHA3_FlattenSize(SHA3Context *cx);
+extern SECStatus SHA3_Flatten(SHA3Context *cx, unsigned char *space);
+extern SHA3Context *SHA3_Resurrect(unsigned char *space, void *arg);
+
+/*
+ * Make dest a copy of src, ready to take more input. dest doesn't inherit
+ * src's scheduler (see SHA3_SetScheduler). The copy is the 200 byte state
+ * and a length, nothing is allocated.
+ */
+extern void SHA3_Clone(SHA3Context *dest, SHA3Context *src);
+
+/*
+ * A frozen prefix: the state of a context after some common input (a
+ * protocol header, a domain separator, a per-tenant salt), kept so that
+ * any number of messages can start from it. SHA3_NewPrefix takes the
+ * prefix from a context that has absorbed it, and the context can go on
+ * to be used or destroyed. SHA3_PrefixBegin restarts a context at the
+ * prefix instead of at the empty message; after that it takes Update and
+ * End of the same SHA3 variant as the one that absorbed the prefix.
+ *
+ * Cost model: absorbing a prefix takes one Keccak-f permutation per
+ * started block of rate bytes (136 for SHA3-256, 72 for SHA3-512), about
+ * 5-6 cycles per byte on the scalar backend. SHA3_PrefixBegin is a copy
+ * of about 200 bytes, the same for any prefix length, so a prefix pays
+ * for itself from the first reuse once it is a block or more, and saves
+ * only the copying of input short of a block. A prefix takes about 208
+ * bytes of memory and can be shared between threads, it is never written
+ * to after SHA3_NewPrefix.
+ */
+typedef struct SHA3PrefixStr SHA3Prefix;
+
+extern SHA3Prefix *SHA3_NewPrefix(SHA3Context *cx);
+extern void SHA3_DestroyPrefix(SHA3Prefix *prefix);
+extern void SHA3_PrefixBegin(SHA3Context *cx, const SHA3Prefix *prefix);
+
+extern void SHA3_224_Update(SHA3Context *cx, const unsigned char *input,
+                            unsigned int inputLen);
+extern void SHA3_224_End(SHA3Context *cx, unsigned char *digest,
+                         unsigned int *digestLen, unsigned int maxDigestLen);
+extern void SHA3_256_Update(SHA3Context *cx, const unsigned char *input,
+                            unsigned int inputLen);
+extern void SHA3_256_End(SHA3Context *cx, unsigned char *digest,
+                         unsigned int *digestLen, unsigned int maxDigestLen);
+extern void SHA3_384_Update(SHA3Context *cx, const unsigned char *input,
+                            unsigned int inputLen);
+extern void SHA3_384_End(SHA3Context *cx, unsigned char *digest,
+                         unsigned int *digestLen, unsigned int maxDigestLen);
+extern void SHA3_512_Update(SHA3Context *cx, const unsigned char *input,
+                            unsigned int inputLen);
+extern void SHA3_512_End(SHA3Context *cx, unsigned char *digest,
+                         unsigned int *digestLen, unsigned int maxDigestLen);
+
+extern SECStatus SHA3_224_HashBuf(unsigned char *dest, const unsigned char *src,
+                                  PRUint32 src_length);
+extern SECStatus SHA3_256_HashBuf(unsigned char *dest, const unsigned char *src,
+                                  PRUint32 src_length);
+extern SECStatus SHA3_384_HashBuf(unsigned char *dest, const unsigned char *src,
+                                  PRUint32 src_length);
+extern SECStatus SHA3_512_HashBuf(unsigned char *dest, const unsigned char *src,
+                                  PRUint32 src_length);
+
+/*
+ * Hash four messages of the same length at once. On AVX2 machines the four
+ * permutations run side by side in ymm registers.
+ */
+extern SECStatus SHA3_224_HashBuf4(unsigned char *dest[4],
+                        const unsigned char *src[4], PRUint32 src_length);
+extern SECStatus SHA3_256_HashBuf4(unsigned char *dest[4],
+                        const unsigned char *src[4], PRUint32 src_length);
+extern SECStatus SHA3_384_HashBuf4(unsigned char *dest[4],
+                        const unsigned char *src[4], PRUint32 src_length);
+extern SECStatus SHA3_512_HashBuf4(unsigned char *dest[4],
+                        const unsigned char *src[4], PRUint32 src_length);
+
+/*
+ * Same, for eight messages. On AVX-512 machines all eight states stay in zmm
+ * registers; on AVX2 machines this runs as two 4-way groups.
+ */
+extern SECStatus SHA3_224_HashBuf8(unsigned char *dest[8],
+                        const unsigned char *src[8], PRUint32 src_length);
+extern SECStatus SHA3_256_HashBuf8(unsigned char *dest[8],
+                        const unsigned char *src[8], PRUint32 src_length);
+extern SECStatus SHA3_384_HashBuf8(unsigned char *dest[8],
+                        const unsigned char *src[8], PRUint32 src_length);
+extern SECStatus SHA3_512_HashBuf8(unsigned char *dest[8],
+                        const unsigned char *src[8], PRUint32 src_length);
+
+/*
+ * Hash count messages of the same length: dest[i] gets the digest of
+ * src[i]. The messages go through the widest multi-buffer Keccak the CPU
+ * has (see SHA3_GetBackend) in groups, or one at a time on the scalar
+ * backend.
+ */
+extern SECStatus SHA3_224_HashBufMany(unsigned char *const *dest,
+                        const unsigned char *const *src, unsigned int count,
+                        PRUint32 src_length);
+extern SECStatus SHA3_256_HashBufMany(unsigned char *const *dest,
+                        const unsigned char *const *src, unsigned int count,
+                        PRUint32 src_length);
+extern SECStatus SHA3_384_HashBufMany(unsigned char *const *dest,
+                        const unsigned char *const *src, unsigned int count,
+                        PRUint32 src_length);
+extern SECStatus SHA3_512_HashBufMany(unsigned char *const *dest,
+                        const unsigned char *const *src, unsigned int count,
+                        PRUint32 src_length);
+
+/*
+ * Batches of messages of any length, for any of the SHA3 hashes or XOFs.
+ * Each job hashes srcLen bytes at src into dest. For the SHA3 hashes dest
+ * gets the whole digest and destLen is ignored; for SHAKE128/256 it gets
+ * destLen bytes of output.
+ *
+ * Messages share the multi-buffer Keccak: the longest are started first,
+ * and a lane is refilled with the next message as soon as its message is
+ * done. The last few are finished one at a time. If stats isn't NULL, it
+ * is filled in with how well the lanes were used.
+ */
+typedef enum {
+    SHA3_TYPE_224,
+    SHA3_TYPE_256,
+    SHA3_TYPE_384,
+    SHA3_TYPE_512,
+    SHA3_TYPE_SHAKE128,
+    SHA3_TYPE_SHAKE256
+} SHA3Type;
+
+typedef struct SHA3JobStr {
+    const unsigned char *src;
+    PRUint32 srcLen;
+    unsigned char *dest;
+    unsigned int destLen;
+} SHA3Job;
+
+typedef struct SHA3BatchStatsStr {
+    unsigned int jobs;
+    unsigned int permutations;          /* parallel permutations run */
+    unsigned int lanes;                 /* streams they had room for */
+    unsigned int busyLanes;             /* streams that were in use */
+    unsigned int scalarPermutations;    /* for the last few messages */
+} SHA3BatchStats;
+
+extern SECStatus SHA3_HashBatch(SHA3Type type, SHA3Job *jobs,
+                                unsigned int count, SHA3BatchStats *stats);
+
+/*
+ * Same, with every message hashed as the continuation of a prefix (see
+ * SHA3_NewPrefix) of the same hash. The prefix must end on a block
+ * boundary, a whole number of rate bytes; otherwise this fails.
+ */
+extern SECStatus SHA3_PrefixHashBatch(const SHA3Prefix *prefix, SHA3Type type,
+                                      SHA3Job *jobs, unsigned int count,
+                                      SHA3BatchStats *stats);
+
+/*
+ * Job manager, for many streams hashed a piece at a time. Each stream has
+ * its own context and SHA3HashJob. Submitting a job hands the manager
+ * len bytes of data for the stream: with SHA3_JOB_FIRST the context is
+ * started first, with SHA3_JOB_LAST the hash is finished and the digest
+ * left in the job. Data and job belong to the manager until the job comes
+ * back from SHA3_SubmitJob or SHA3_FlushJobs, with status
+ * SHA3_JOB_COMPLETE. Submit returns a completed job or NULL; jobs for
+ * different streams run side by side in the multi-buffer Keccak and may
+ * complete in any order. Flush runs the jobs still in flight and returns
+ * them one per call, then NULL. Only the SHA3 hashes are supported.
+ */
+typedef struct SHA3JobManagerStr SHA3JobManager;
+
+#define SHA3_JOB_UPDATE 0
+#define SHA3_JOB_FIRST  1
+#define SHA3_JOB_LAST   2
+#define SHA3_JOB_ENTIRE (SHA3_JOB_FIRST|SHA3_JOB_LAST)
+
+typedef enum {
+    SHA3_JOB_IDLE,
+    SHA3_JOB_PROCESSING,
+    SHA3_JOB_COMPLETE
+} SHA3JobStatus;
+
+typedef struct SHA3HashJobStr {
+    SHA3Context *ctx;
+    void *user;
+    SHA3JobStatus status;
+    unsigned char digest[64];
+    unsigned int digestLen;
+    /* private to the manager */
+    const unsigned char *data;
+    unsigned int len;
+    unsigned int flags;
+    PRBool last;
+    struct SHA3HashJobStr *next;
+} SHA3HashJob;
+
+extern SHA3JobManager *SHA3_NewJobManager(SHA3Type type);
+extern void SHA3_DestroyJobManager(SHA3JobManager *mgr);
+extern SHA3HashJob *SHA3_SubmitJob(SHA3JobManager *mgr, SHA3HashJob *job,
+                                   const unsigned char *data,
+                                   unsigned int len, unsigned int flags);
+extern SHA3HashJob *SHA3_FlushJobs(SHA3JobManager *mgr);
+
+/*
+ * Scheduler, for many streams that are each updated a little at a time.
+ * Once a context is attached with SHA3_SetScheduler, the blocks its small
+ * updates complete are queued in the scheduler and absorbed together with
+ * those of other contexts in one multi-buffer permutation, when a full
+ * group is queued or when SHA3_FlushScheduler is called. The context API
+ * is unchanged: End and everything else that needs the state run the
+ * queue first. A scheduler is for one SHA3 hash; its contexts must only be
+ * updated with that hash. Contexts stay attached across SHA3_Begin; pass
+ * NULL to detach one, and detach or destroy them all before destroying the
+ * scheduler.
+ */
+typedef struct SHA3SchedulerStr SHA3Scheduler;
+
+extern SHA3Scheduler *SHA3_NewScheduler(SHA3Type type);
+extern void SHA3_DestroyScheduler(SHA3Scheduler *sched);
+extern void SHA3_FlushScheduler(SHA3Scheduler *sched);
+extern void SHA3_SetScheduler(SHA3Context *ctx, SHA3Scheduler *sched);
+
+/*
+ * Context table, for very many streams of one SHA3 hash. A stream is an
+ * integer handle from SHA3_TableOpen, and is updated and finished much like
+ * a context. SHA3_TableEnd leaves the stream ready to hash the next
+ * message; SHA3_TableClose gives the handle back. The states of streams
+ * with neighbouring handles are stored together and permuted together on
+ * the multi-buffer Keccak. A stream takes about 207 bytes, the state and a
+ * few bytes of bookkeeping, against about 232 for a context and its malloc
+ * header, and a table adds 256 slots of one block each (34 KiB for
+ * SHA3-256) for input that waits on a permutation. SHA3_TableFlush runs
+ * any permutations still owed by the streams; it is never needed for
+ * correct results.
+ */
+typedef struct SHA3TableStr SHA3Table;
+
+extern SHA3Table *SHA3_NewTable(SHA3Type type, unsigned int capacity);
+extern void SHA3_DestroyTable(SHA3Table *t);
+extern SECStatus SHA3_TableOpen(SHA3Table *t, unsigned int *handle);
+extern void SHA3_TableClose(SHA3Table *t, unsigned int handle);
+extern void SHA3_TableUpdate(SHA3Table *t, unsigned int handle,
+                             const unsigned char *input, unsigned int inputLen);
+extern void SHA3_TableEnd(SHA3Table *t, unsigned int handle,
+                          unsigned char *digest, unsigned int *digestLen,
+                          unsigned int maxDigestLen);
+extern void SHA3_TableFlush(SHA3Table *t);
+
+/*
+ * Checkpoints, for hashes that are resumed much later, possibly by another
+ * build or on another machine (say, the hash of an append-only log that is
+ * extended now and then). SHA3_SaveCheckpoint writes the state of a hash
+ * in progress to SHA3_CHECKPOINT_LEN bytes: a version byte, the rate and
+ * the padding domain of the hash, the number of bytes of the current block
+ * absorbed so far, then the 200 byte state with the lanes in little endian
+ * order. Unlike SHA3_Flatten, which copies the context as it is in memory,
+ * the format doesn't depend on the build, and later versions will keep
+ * reading it. A checkpoint can be taken after any number of bytes.
+ *
+ * Only SHA3-224, SHA3-256, SHA3-384 and SHA3-512 can be checkpointed;
+ * SHA3_SaveCheckpoint fails on the SHAKE types.
+ *
+ * SHA3_LoadCheckpoint sets up a context from a checkpoint, after which it
+ * takes the bytes that follow the checkpoint, through the Update and End
+ * of the type it returns. It fails on anything that isn't a valid
+ * checkpoint. The checkpoint doesn't say how many bytes came before it;
+ * keep the offset next to it.
+ */
+#define SHA3_CHECKPOINT_VERSION 1
+#define SHA3_CHECKPOINT_LEN 204
+
+extern SECStatus SHA3_SaveCheckpoint(SHA3Context *cx, SHA3Type type,
+                                     unsigned char *space, unsigned int len);
+extern SECStatus SHA3_LoadCheckpoint(SHA3Context *cx, SHA3Type *type,
+                                     const unsigned char *space,
+                                     unsigned int len);
+
+/*
+ * SHAKE128 and SHAKE256 (FIPS 202), as extendable output functions. A
+ * SHAKEContext takes input with SHAKE_Absorb, then output with any number
+ * of SHAKE_Squeeze calls, which continue one output stream: squeezing 10
+ * bytes and then 20 gives the same 30 bytes as squeezing 30 at once. Once
+ * squeezing has started the context takes no more input, SHAKE_Absorb
+ * fails and absorbs nothing; SHAKE_Begin starts it over on a new message. Long outputs run close to the speed of
+ * the permutation, a block of the rate for each one.
+ *
+ * SHAKE128 and SHAKE256 hash a whole message at once, and the _Raw
+ * variants are RawSHAKE, SHAKE without the "11" of its domain suffix.
+ *
+ * TurboSHAKE128 and TurboSHAKE256 (RFC 9861) are the same sponges on
+ * Keccak-p[1600,12], half the rounds of Keccak-f, with a domain separation
+ * byte D from 0x01 to 0x7F. TurboSHAKE_NewContext makes a SHAKEContext for
+ * one, from SHA3_TYPE_SHAKE128 or SHA3_TYPE_SHAKE256; it is used like any
+ * other, but can't be forked with SHAKE_MultiFork.
+ */
+typedef struct SHAKEContextStr SHAKEContext;
+
+extern SHAKEContext *SHAKE_NewContext(SHA3Type type);
+extern SHAKEContext *TurboSHAKE_NewContext(SHA3Type type, unsigned char D);
+extern void SHAKE_DestroyContext(SHAKEContext *cx, PRBool freeit);
+extern void SHAKE_Begin(SHAKEContext *cx);
+extern SECStatus SHAKE_Absorb(SHAKEContext *cx, const unsigned char *input,
+                              unsigned int inputLen);
+extern void SHAKE_Squeeze(SHAKEContext *cx, unsigned char *output,
+                          unsigned int outputLen);
+
+extern void SHAKE128(const unsigned char *message, unsigned int len,
+                     unsigned char *out, unsigned int outLen);
+extern void SHAKE256(const unsigned char *message, unsigned int len,
+                     unsigned char *out, unsigned int outLen);
+extern void SHAKE128_Raw(const unsigned char *message, unsigned int len,
+                         unsigned char *out, unsigned int outLen);
+extern void SHAKE256_Raw(const unsigned char *message, unsigned int len,
+                         unsigned char *out, unsigned int outLen);
+extern void TurboSHAKE128(const unsigned char *message, unsigned int len,
+                          unsigned char D, unsigned char *out,
+                          unsigned int outLen);
+extern void TurboSHAKE256(const unsigned char *message, unsigned int len,
+                          unsigned char D, unsigned char *out,
+                          unsigned int outLen);
+
+/*
+ * Several SHAKE128 or SHAKE256 streams at once, on the multi-buffer Keccak
+ * (see SHA3_GetBackend): the lanes are permuted as a group of 8 with
+ * AVX-512; with AVX2, up to 4 lanes are a group of 4 and up to 8 are two.
+ *
+ * SHAKE_MultiAbsorb XORs inputLen bytes of input[s] into lane s, for each
+ * of the lanes; it can be called any number of times, so a seed shared by
+ * all the lanes and a per lane index can go in as two calls, the first
+ * with the same pointer for every lane. SHAKE_MultiSqueezeBlocks then
+ * writes the next blocks blocks of rate bytes (168 for SHAKE128, 136 for
+ * SHAKE256) of each lane's output to output[s], and can be called again
+ * for more; a lane whose output[s] is NULL still runs, but isn't written.
+ * Once squeezing has started SHAKE_MultiAbsorb fails and absorbs nothing;
+ * SHAKE_MultiBegin starts all the lanes over.
+ *
+ * SHAKE_MultiFork instead starts every lane from where seed is, so a seed
+ * that all the streams share is absorbed once, into a SHAKEContext of the
+ * same type, and each stream only adds its own nonce with
+ * SHAKE_MultiAbsorb. seed must not have been squeezed, and is left as it
+ * is, so it can be forked again for the next set of nonces.
+ */
+typedef struct SHAKEMultiContextStr SHAKEMultiContext;
+
+extern SHAKEMultiContext *SHAKE_NewMultiContext(SHA3Type type,
+                                                unsigned int lanes);
+extern void SHAKE_DestroyMultiContext(SHAKEMultiContext *mc);
+extern void SHAKE_MultiBegin(SHAKEMultiContext *mc);
+extern SECStatus SHAKE_MultiFork(SHAKEMultiContext *mc, SHAKEContext *seed);
+extern SECStatus SHAKE_MultiAbsorb(SHAKEMultiContext *mc,
+                                   const unsigned char *const *input,
+                                   unsigned int inputLen);
+extern void SHAKE_MultiSqueezeBlocks(SHAKEMultiContext *mc,
+                                     unsigned char *const *output,
+                                     unsigned int blocks);
+
+/*
+ * cSHAKE128/256 and KMAC128/256 (SP 800-185), with the customization
+ * precomputed. A CSHAKEState is SHAKE128 or SHAKE256 with the function
+ * name N and customization string S already absorbed, and for KMAC the key
+ * as well; it takes about 220 bytes, and is never written to after it is
+ * made, so threads can share it. A message then costs a copy of the
+ * state, its own blocks and the final permutations.
+ *
+ * CSHAKE_Squeeze ends the message on its first call and returns the next
+ * outputLen bytes of output on each call; on a KMAC key that is KMACXOF.
+ * KMAC_Finish ends the message with the MAC length as KMAC does, and
+ * writes the macLen byte MAC; it fails on a cSHAKE state. After either,
+ * the context takes no more input until CSHAKE_Begin: CSHAKE_Update fails
+ * and absorbs nothing. After KMAC_Finish CSHAKE_Squeeze fails too, and
+ * leaves output as it was.
+ * CSHAKE_Hash and KMAC_Compute do a whole message without allocating.
+ */
+typedef struct CSHAKEStateStr CSHAKEState;
+typedef struct CSHAKEContextStr CSHAKEContext;
+
+extern CSHAKEState *CSHAKE_NewState(SHA3Type type,
+                            const unsigned char *N, unsigned int Nlen,
+                            const unsigned char *S, unsigned int Slen);
+extern CSHAKEState *KMAC_NewKey(SHA3Type type,
+                            const unsigned char *K, unsigned int Klen,
+                            const unsigned char *S, unsigned int Slen);
+extern void CSHAKE_DestroyState(CSHAKEState *state);
+
+extern CSHAKEContext *CSHAKE_NewContext(const CSHAKEState *state);
+extern void CSHAKE_DestroyContext(CSHAKEContext *cx, PRBool freeit);
+extern void CSHAKE_Begin(CSHAKEContext *cx);
+extern SECStatus CSHAKE_Update(CSHAKEContext *cx,
+                               const unsigned char *input,
+                               unsigned int inputLen);
+extern SECStatus CSHAKE_Squeeze(CSHAKEContext *cx, unsigned char *output,
+                                unsigned int outputLen);
+extern SECStatus KMAC_Finish(CSHAKEContext *cx, unsigned char *mac,
+                             unsigned int macLen);
+
+extern void CSHAKE_Hash(const CSHAKEState *state,
+                        const unsigned char *input, unsigned int inputLen,
+                        unsigned char *output, unsigned int outputLen);
+extern SECStatus KMAC_Compute(const CSHAKEState *key,
+                        const unsigned char *input, unsigned int inputLen,
+                        unsigned char *mac, unsigned int macLen);
+
+/*
+ * TupleHash128/256 (SP 800-185), from SHA3_TYPE_SHAKE128 or
+ * SHA3_TYPE_SHAKE256, with customization string S. It hashes a tuple of
+ * byte strings so that no two different tuples hash the same, whatever
+ * the strings; TupleHash_Update appends count fields to the tuple, each
+ * absorbed with its length from the caller's buffer, so a record does not
+ * have to be copied into one buffer first. A tuple can be given over any
+ * number of updates; an update of no fields changes nothing, but a field
+ * of length 0 is still a field.
+ *
+ * TupleHash_Finish ends the tuple with the output length and writes
+ * outputLen bytes; it fails if the context was already ended.
+ * TupleHash_Squeeze is TupleHashXOF: it ends the tuple on its first call
+ * and returns the next outputLen bytes on each call. After either the
+ * context takes no more fields until TupleHash_Begin: TupleHash_Update
+ * fails and absorbs nothing. After TupleHash_Finish TupleHash_Squeeze
+ * fails too, and leaves output as it was.
+ */
+typedef struct SHA3FieldStr {
+    const unsigned char *data;
+    unsigned int len;
+} SHA3Field;
+
+typedef struct TupleHashContextStr TupleHashContext;
+
+extern TupleHashContext *TupleHash_NewContext(SHA3Type type,
+                                  const unsigned char *S, unsigned int Slen);
+extern void TupleHash_DestroyContext(TupleHashContext *cx);
+extern void TupleHash_Begin(TupleHashContext *cx);
+extern SECStatus TupleHash_Update(TupleHashContext *cx,
+                                  const SHA3Field *fields,
+                                  unsigned int count);
+extern SECStatus TupleHash_Finish(TupleHashContext *cx,
+                                  unsigned char *output,
+                                  unsigned int outputLen);
+extern SECStatus TupleHash_Squeeze(TupleHashContext *cx,
+                                   unsigned char *output,
+                                   unsigned int outputLen);
+
+/*
+ * A pool of threads for hashing a long input on several cores, shared by
+ * the tree hashes below. threads counts the thread that calls the hash,
+ * which works too, so a pool of N starts N-1 workers; 0 means one per
+ * online CPU. A pool can be shared by any number of contexts and threads,
+ * but runs one hash at a time; it must outlive the contexts using it.
+ */
+typedef struct SHA3ThreadPoolStr SHA3ThreadPool;
+
+extern SHA3ThreadPool *SHA3_NewThreadPool(unsigned int threads);
+extern void SHA3_DestroyThreadPool(SHA3ThreadPool *pool);
+extern unsigned int SHA3_ThreadPoolSize(const SHA3ThreadPool *pool);
+
+/*
+ * KangarooTwelve (RFC 9861, KT128), with customization string custom. It
+ * is TurboSHAKE128 over a tree of 8 KiB chunks: for long inputs the leaf
+ * chunks are hashed side by side on the multi-buffer Keccak, so K12 runs
+ * several times faster than SHA3-256, which has twice the rounds and only
+ * one stream. Not a FIPS function; use it where we pick the hash.
+ *
+ * K12_Squeeze ends the message on its first call and returns the next
+ * outputLen bytes of output on each call, like SHAKE_Squeeze; after that
+ * K12_Update fails and absorbs nothing until K12_Begin. Updates that hand
+ * over whole chunks are the fast path. KangarooTwelve hashes a whole
+ * message at once, without allocating.
+ *
+ * K12_SetThreadPool has the context spread the leaves of long updates
+ * over the pool's threads; updates of less than 512 KiB of whole leaves
+ * stay on the calling thread, where waking the workers would cost more
+ * than it saves. pool may be NULL, to go back to one thread.
+ */
+typedef struct K12ContextStr K12Context;
+
+extern K12Context *K12_NewContext(const unsigned char *custom,
+                                  unsigned int customLen);
+extern void K12_DestroyContext(K12Context *cx);
+extern void K12_SetThreadPool(K12Context *cx, SHA3ThreadPool *pool);
+extern void K12_Begin(K12Context *cx);
+extern SECStatus K12_Update(K12Context *cx, const unsigned char *input,
+                            unsigned int inputLen);
+extern void K12_Squeeze(K12Context *cx, unsigned char *output,
+                        unsigned int outputLen);
+extern void KangarooTwelve(const unsigned char *message, unsigned int len,
+                           const unsigned char *custom,
+                           unsigned int customLen,
+                           unsigned char *out, unsigned int outLen);
+
+/*
+ * ParallelHash128/256 (SP 800-185), from SHA3_TYPE_SHAKE128 or
+ * SHA3_TYPE_SHAKE256, with block size B and customization string S. The
+ * blocks are hashed side by side on the multi-buffer Keccak and, with
+ * ParallelHash_SetThreadPool, over the pool's threads; the size of the
+ * pool (see SHA3_NewThreadPool) sets how many. B is part of the hash, so
+ * both ends must agree on it: 8 KiB or more keeps the per block overhead,
+ * a padded block and one chaining value of the outer hash, small.
+ *
+ * ParallelHash_Finish ends the message with the output length and writes
+ * outputLen bytes; it fails if the context was already ended.
+ * ParallelHash_Squeeze is ParallelHashXOF: it ends the message on its
+ * first call and returns the next outputLen bytes on each call. After
+ * either the context takes no more input until ParallelHash_Begin:
+ * ParallelHash_Update fails and absorbs nothing. After ParallelHash_Finish
+ * ParallelHash_Squeeze fails too, and leaves output as it was.
+ */
+typedef struct ParallelHashContextStr ParallelHashContext;
+
+extern ParallelHashContext *ParallelHash_NewContext(SHA3Type type,
+                                        unsigned int B,
+                                        const unsigned char *S,
+                                        unsigned int Slen);
+extern void ParallelHash_DestroyContext(ParallelHashContext *cx);
+extern void ParallelHash_SetThreadPool(ParallelHashContext *cx,
+                                       SHA3ThreadPool *pool);
+extern void ParallelHash_Begin(ParallelHashContext *cx);
+extern SECStatus ParallelHash_Update(ParallelHashContext *cx,
+                                     const unsigned char *input,
+                                     unsigned int inputLen);
+extern SECStatus ParallelHash_Finish(ParallelHashContext *cx,
+                                     unsigned char *output,
+                                     unsigned int outputLen);
+extern SECStatus ParallelHash_Squeeze(ParallelHashContext *cx,
+                                      unsigned char *output,
+                                      unsigned int outputLen);
+
+/*
+ * Name of the Keccak backend in use: "scalar", "avx2" or "avx512". The best
+ * one the CPU supports is picked when the library is loaded;
+ * NSS_SHA3_BACKEND=<name> forces a specific one, if the CPU can run it.
+ */
+extern const char *SHA3_GetBackend(void);
 
 /*
 // TODO implement the below, with appropriate repetition to
 //      account for the various hash sizes
 
-extern SECStatus SHA256_HashBuf(unsigned char *dest, const unsigned char *src,
-                                PRUint32 src_length);
 extern SECStatus SHA256_Hash(unsigned char *dest, const char *src);
 extern void SHA256_TraceState(SHA256Context *cx);
 extern unsigned int SHA256_FlattenSize(SHA256Context *cx);
@@ -20,6 +20,12 @@
 //#include "blapi.h"
 //XXX
 #include "sha2.h"
+#include "blinit.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__x86_64))
+#define SHA_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 /* ============= Common constants and defines ======================= */
 
@@ -179,7 +185,7 @@ SHA256_Begin(SHA256Context *ctx)
 }
 
 static void
-SHA256_Compress(SHA256Context *ctx)
+SHA256_Compress_Generic(SHA256Context *ctx)
 {
   {
     register PRUint32 t1, t2;
@@ -393,6 +399,114 @@ SHA256_Compress(SHA256Context *ctx)
 #undef S0
 #undef S1
 
+#ifdef SHA_X86_SIMD
+/*
+ * SHA-256 with the SHA extensions. sha256rnds2 does two rounds and wants
+ * the state split as ABEF and CDGH, so we shuffle H into that form on the
+ * way in and back on the way out. sha256msg1 and sha256msg2 compute the
+ * message schedule four words at a time, in step with the rounds.
+ */
+__attribute__((target("sha,sse4.1")))
+static void
+SHA256_Compress_Native(SHA256Context *ctx)
+{
+    const __m128i shuffle = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                           0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp;
+    __m128i m0, m1, m2, m3;
+
+    tmp = _mm_loadu_si128((const __m128i *)&H[0]);      /* DCBA */
+    state1 = _mm_loadu_si128((const __m128i *)&H[4]);   /* HGFE */
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);                  /* CDAB */
+    state1 = _mm_shuffle_epi32(state1, 0x1B);            /* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);            /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);         /* CDGH */
+    abef = state0;
+    cdgh = state1;
+
+#define LOADW(m,t) \
+    m = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&B[(t)*16]), shuffle)
+
+    /* four rounds, using the schedule words in m */
+#define RNDS4(t,m)                                                          \
+    msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i *)&K256[(t)*4])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                    \
+    msg = _mm_shuffle_epi32(msg, 0x0E);                                     \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg)
+
+    /* finish the schedule words in next, from the last two groups */
+#define MSG2(next,cur,prev)                                                 \
+    tmp = _mm_alignr_epi8(cur, prev, 4);                                    \
+    next = _mm_add_epi32(next, tmp);                                        \
+    next = _mm_sha256msg2_epu32(next, cur)
+
+    /* start the schedule words in old, which are needed in three groups */
+#define MSG1(old,cur) \
+    old = _mm_sha256msg1_epu32(old, cur)
+
+    LOADW(m0,0); RNDS4( 0,m0);
+    LOADW(m1,1); RNDS4( 1,m1);                  MSG1(m0,m1);
+    LOADW(m2,2); RNDS4( 2,m2);                  MSG1(m1,m2);
+    LOADW(m3,3); RNDS4( 3,m3); MSG2(m0,m3,m2);  MSG1(m2,m3);
+                 RNDS4( 4,m0); MSG2(m1,m0,m3);  MSG1(m3,m0);
+                 RNDS4( 5,m1); MSG2(m2,m1,m0);  MSG1(m0,m1);
+                 RNDS4( 6,m2); MSG2(m3,m2,m1);  MSG1(m1,m2);
+                 RNDS4( 7,m3); MSG2(m0,m3,m2);  MSG1(m2,m3);
+                 RNDS4( 8,m0); MSG2(m1,m0,m3);  MSG1(m3,m0);
+                 RNDS4( 9,m1); MSG2(m2,m1,m0);  MSG1(m0,m1);
+                 RNDS4(10,m2); MSG2(m3,m2,m1);  MSG1(m1,m2);
+                 RNDS4(11,m3); MSG2(m0,m3,m2);  MSG1(m2,m3);
+                 RNDS4(12,m0); MSG2(m1,m0,m3);  MSG1(m3,m0);
+                 RNDS4(13,m1); MSG2(m2,m1,m0);
+                 RNDS4(14,m2); MSG2(m3,m2,m1);
+                 RNDS4(15,m3);
+
+#undef LOADW
+#undef RNDS4
+#undef MSG2
+#undef MSG1
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);               /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xB1);            /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);         /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);            /* HGFE */
+    _mm_storeu_si128((__m128i *)&H[0], state0);
+    _mm_storeu_si128((__m128i *)&H[4], state1);
+}
+#endif /* SHA_X86_SIMD */
+
+/*
+ * The compression function is picked once, when the library is loaded.
+ * NSS_SHA2_BACKEND=generic forces the C implementation even where the SHA
+ * extensions are available.
+ */
+static void (*sha256_compress)(SHA256Context *ctx) = SHA256_Compress_Generic;
+static const char *sha256_backend = "generic";
+#define SHA256_Compress(ctx) sha256_compress(ctx)
+
+__attribute__((constructor))
+static void
+sha256_select_backend(void)
+{
+#ifdef SHA_X86_SIMD
+    const char *forced = blapi_forced_backend("NSS_SHA2_BACKEND");
+
+    if (sha_support() && (!forced || strcmp(forced, "generic") != 0)) {
+        sha256_compress = SHA256_Compress_Native;
+        sha256_backend = "shani";
+    }
+#endif
+}
+
+const char *
+SHA256_GetBackend(void)
+{
+    return sha256_backend;
+}
+
 void
 SHA256_Update(SHA256Context *ctx, const unsigned char *input,
 		    unsigned int inputLen)
@@ -838,7 +952,7 @@ SHA512_Begin(SHA512Context *ctx)
 #endif
 
 static void
-SHA512_Compress(SHA512Context *ctx)
+SHA512_Compress_Generic(SHA512Context *ctx)
 {
 #if defined(IS_LITTLE_ENDIAN)
   {
@@ -1090,6 +1204,20 @@ SHA512_Compress(SHA512Context *ctx)
   }
 }
 
+/*
+ * There is only the C implementation of SHA-512 for now, but it goes
+ * through the same indirection as SHA-256 so a native one can be added
+ * the same way.
+ */
+static void (*sha512_compress)(SHA512Context *ctx) = SHA512_Compress_Generic;
+#define SHA512_Compress(ctx) sha512_compress(ctx)
+
+const char *
+SHA512_GetBackend(void)
+{
+    return "generic";
+}
+
 void
 SHA512_Update(SHA512Context *ctx, const unsigned char *input,
               unsigned int inputLen)
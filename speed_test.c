@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include "sha3.h"
 #include "sha2.h"
+#include "hmac.h"
 
 /*
 
@@ -163,6 +164,167 @@ uint32_t measureRandomBuffer_512(uint32_t dtMin, size_t size)
     return tMin;
 }
 
+uint32_t measureRandomBuffer_256x4(uint32_t dtMin, size_t size)
+{
+    uint32_t tMin = 0xFFFFFFFF;
+    uint32_t t0,t1,i;
+    unsigned char *input[4];
+    unsigned char digest[4][64];
+    unsigned char *out[4];
+    int s;
+
+    for (s=0; s<4; s++) {
+        input[s] = randomBuffer(size);
+        out[s] = digest[s];
+    }
+
+    for (i=0;i < TIMER_SAMPLE_CNT;i++) {
+        t0 = HiResTime();
+
+        SHA3_256_HashBuf4(out, (const unsigned char **)input, size);
+
+        t1 = HiResTime();
+        if (tMin > t1-t0 - dtMin) {
+            tMin = t1-t0 - dtMin;
+        }
+    }
+
+    /* now tMin = # clocks required for running RoutineToBeTimed() */
+    for (s=0; s<4; s++) {
+        free(input[s]);
+    }
+    return tMin;
+}
+
+uint32_t measureRandomBuffer_256x8(uint32_t dtMin, size_t size)
+{
+    uint32_t tMin = 0xFFFFFFFF;
+    uint32_t t0,t1,i;
+    unsigned char *input[8];
+    unsigned char digest[8][64];
+    unsigned char *out[8];
+    int s;
+
+    for (s=0; s<8; s++) {
+        input[s] = randomBuffer(size);
+        out[s] = digest[s];
+    }
+
+    for (i=0;i < TIMER_SAMPLE_CNT;i++) {
+        t0 = HiResTime();
+
+        SHA3_256_HashBuf8(out, (const unsigned char **)input, size);
+
+        t1 = HiResTime();
+        if (tMin > t1-t0 - dtMin) {
+            tMin = t1-t0 - dtMin;
+        }
+    }
+
+    /* now tMin = # clocks required for running RoutineToBeTimed() */
+    for (s=0; s<8; s++) {
+        free(input[s]);
+    }
+    return tMin;
+}
+
+/* enough messages for one full and one partial group of 8 */
+#define MANY_CNT 12
+
+uint32_t measureRandomBuffer_256many(uint32_t dtMin, size_t size)
+{
+    uint32_t tMin = 0xFFFFFFFF;
+    uint32_t t0,t1,i;
+    unsigned char *input[MANY_CNT];
+    unsigned char digest[MANY_CNT][64];
+    unsigned char *out[MANY_CNT];
+    int s;
+
+    for (s=0; s<MANY_CNT; s++) {
+        input[s] = randomBuffer(size);
+        out[s] = digest[s];
+    }
+
+    for (i=0;i < TIMER_SAMPLE_CNT;i++) {
+        t0 = HiResTime();
+
+        SHA3_256_HashBufMany(out, (const unsigned char **)input, MANY_CNT,
+                             size);
+
+        t1 = HiResTime();
+        if (tMin > t1-t0 - dtMin) {
+            tMin = t1-t0 - dtMin;
+        }
+    }
+
+    /* now tMin = # clocks required for running RoutineToBeTimed() */
+    for (s=0; s<MANY_CNT; s++) {
+        free(input[s]);
+    }
+    return tMin;
+}
+
+/* size bytes of SHAKE128 output from a 32 byte seed */
+uint32_t measureRandomBuffer_shake128(uint32_t dtMin, size_t size)
+{
+    uint32_t tMin = 0xFFFFFFFF;
+    uint32_t t0,t1,i;
+    unsigned char *seed = randomBuffer(32);
+    unsigned char *output = randomBuffer(size);
+    SHAKEContext *ctx = SHAKE_NewContext(SHA3_TYPE_SHAKE128);
+
+    for (i=0;i < TIMER_SAMPLE_CNT;i++) {
+        t0 = HiResTime();
+
+        SHAKE_Begin(ctx);
+        SHAKE_Absorb(ctx, seed, 32);
+        SHAKE_Squeeze(ctx, output, size);
+
+        t1 = HiResTime();
+        if (tMin > t1-t0 - dtMin) {
+            tMin = t1-t0 - dtMin;
+        }
+    }
+
+    /* now tMin = # clocks required for running RoutineToBeTimed() */
+    SHAKE_DestroyContext(ctx, PR_TRUE);
+    free(output);
+    free(seed);
+    return tMin;
+}
+
+uint32_t measureRandomBuffer_hmac256(uint32_t dtMin, size_t size)
+{
+    uint32_t tMin = 0xFFFFFFFF;
+    uint32_t t0,t1,i;
+    unsigned char *input = randomBuffer(size);
+    unsigned char *secret = randomBuffer(32);
+    HMACKey *key = HMAC_NewKey(HMAC_SHA3_256, secret, 32);
+    HMACContext *ctx = HMAC_NewContext(key);
+    unsigned char mac[64];
+    unsigned int macLen;
+
+    for (i=0;i < TIMER_SAMPLE_CNT;i++) {
+        t0 = HiResTime();
+
+        HMAC_Begin(ctx);
+        HMAC_Update(ctx, input, size);
+        HMAC_Finish(ctx, mac, &macLen, 64);
+
+        t1 = HiResTime();
+        if (tMin > t1-t0 - dtMin) {
+            tMin = t1-t0 - dtMin;
+        }
+    }
+
+    /* now tMin = # clocks required for running RoutineToBeTimed() */
+    HMAC_DestroyContext(ctx, PR_TRUE);
+    HMAC_DestroyKey(key);
+    free(secret);
+    free(input);
+    return tMin;
+}
+
 uint32_t measureRandomBuffer_SHA256(uint32_t dtMin, size_t size)
 {
     uint32_t tMin = 0xFFFFFFFF;
@@ -223,7 +385,9 @@ int main()
   srandom(HiResTime());
 
   uint32_t calibration = calibrate();
-  printf("Calibration: %d\n\n", calibration);
+  printf("Calibration: %d\n", calibration);
+  printf("Backends: SHA-256 %s, SHA-512 %s, SHA3 %s\n\n",
+         SHA256_GetBackend(), SHA512_GetBackend(), SHA3_GetBackend());
 
   int i;
   uint32_t measurement;
@@ -253,21 +417,58 @@ int main()
 
   printf("=== SHA3-256 ===\n");
   for (i=0; i<4; ++i) {
-    measurement = measureRandomBuffer_224(calibration, testSizes[i]);
+    measurement = measureRandomBuffer_256(calibration, testSizes[i]);
     printf(format, testSizes[i], measurement * 1.0 / testSizes[i]);
   }
   printf("\n");
 
   printf("=== SHA3-384 ===\n");
   for (i=0; i<4; ++i) {
-    measurement = measureRandomBuffer_224(calibration, testSizes[i]);
+    measurement = measureRandomBuffer_384(calibration, testSizes[i]);
     printf(format, testSizes[i], measurement * 1.0 / testSizes[i]);
   }
   printf("\n");
 
   printf("=== SHA3-512 ===\n");
   for (i=0; i<4; ++i) {
-    measurement = measureRandomBuffer_224(calibration, testSizes[i]);
+    measurement = measureRandomBuffer_512(calibration, testSizes[i]);
+    printf(format, testSizes[i], measurement * 1.0 / testSizes[i]);
+  }
+  printf("\n");
+
+  /* cycles per byte of all the messages together */
+  printf("=== SHA3-256 x4 ===\n");
+  for (i=0; i<4; ++i) {
+    measurement = measureRandomBuffer_256x4(calibration, testSizes[i]);
+    printf(format, testSizes[i], measurement * 1.0 / (4 * testSizes[i]));
+  }
+  printf("\n");
+
+  printf("=== SHA3-256 x8 ===\n");
+  for (i=0; i<4; ++i) {
+    measurement = measureRandomBuffer_256x8(calibration, testSizes[i]);
+    printf(format, testSizes[i], measurement * 1.0 / (8 * testSizes[i]));
+  }
+  printf("\n");
+
+  printf("=== SHA3-256 many (%d) ===\n", MANY_CNT);
+  for (i=0; i<4; ++i) {
+    measurement = measureRandomBuffer_256many(calibration, testSizes[i]);
+    printf(format, testSizes[i], measurement * 1.0 / (MANY_CNT * testSizes[i]));
+  }
+  printf("\n");
+
+  /* cycles per byte of output */
+  printf("=== SHAKE128 squeeze ===\n");
+  for (i=0; i<4; ++i) {
+    measurement = measureRandomBuffer_shake128(calibration, testSizes[i]);
+    printf(format, testSizes[i], measurement * 1.0 / testSizes[i]);
+  }
+  printf("\n");
+
+  printf("=== HMAC-SHA3-256 ===\n");
+  for (i=0; i<4; ++i) {
+    measurement = measureRandomBuffer_hmac256(calibration, testSizes[i]);
     printf(format, testSizes[i], measurement * 1.0 / testSizes[i]);
   }
   printf("\n");